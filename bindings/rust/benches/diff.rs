@@ -0,0 +1,55 @@
+//! Measures diffing two revisions of a generated spec that differ in a few
+//! junction list items, proof steps and definitions.
+//!
+//! Usage: `cargo bench --bench diff [-- <lines>]` (default 50000).
+
+use std::env;
+use std::time::Instant;
+use tree_sitter::Parser;
+use tree_sitter_tlaplus::diff::diff;
+
+fn main() {
+    let args: Vec<String> = env::args().skip(1).filter(|arg| arg != "--bench").collect();
+    let line_count: usize = args.first().and_then(|arg| arg.parse().ok()).unwrap_or(50000);
+    let block_count = line_count / 11;
+    let old = spec(block_count, None);
+    let new = spec(block_count, Some(block_count / 3));
+
+    let mut parser = Parser::new();
+    parser.set_language(tree_sitter_tlaplus::language()).unwrap();
+    let old_tree = parser.parse(&old, None).unwrap();
+    let new_tree = parser.parse(&new, None).unwrap();
+    for _ in 0..3 {
+        let start = Instant::now();
+        let changes = diff(&old_tree, old.as_bytes(), &new_tree, new.as_bytes());
+        println!(
+            "{:>6} lines diffed in {:>8.3} ms, {} changes",
+            old.lines().count(),
+            start.elapsed().as_secs_f64() * 1000.0,
+            changes.len()
+        );
+    }
+}
+
+// A spec of blocks of definitions and theorems, the given block edited.
+fn spec(block_count: usize, edited: Option<usize>) -> String {
+    let mut source = String::from("---- MODULE Big ----\nEXTENDS Naturals\nVARIABLES x, y\n");
+    for i in 0..block_count {
+        let is_edited = Some(i) == edited;
+        source += &format!("Next{} ==\n  /\\ x' = x + {}\n  /\\ y' = y\n", i, i);
+        if is_edited {
+            source += "  /\\ x < 10\n";
+        }
+        source += &format!("Inv{} == x \\in Nat /\\ y \\in Nat\n", i);
+        source += &format!(
+            "THEOREM Thm{} == Inv{} /\\ [Next{}]_<<x, y>> => Inv{}'\n<1>1. x' \\in Nat\n  BY DEF Next{}\n",
+            i, i, i, i, i
+        );
+        source += if is_edited { "<1>2. y' \\in Nat\n  BY DEF Next0\n" } else { "<1>2. y' \\in Nat\n  OBVIOUS\n" };
+        source += &format!("<1> QED BY <1>1, <1>2 DEF Inv{}\n", i);
+        if !is_edited {
+            source += &format!("Unused{} == {}\n", i, i);
+        }
+    }
+    source + "====\n"
+}
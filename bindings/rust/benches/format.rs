@@ -0,0 +1,49 @@
+//! Measures laying out the jlists of a generated spec whose lists start
+//! mid-line, use Unicode bullets and are indented with tabs.
+//!
+//! Usage: `cargo bench --bench format [-- <lines>]` (default 10000).
+
+use std::env;
+use std::time::Instant;
+use tree_sitter::Parser;
+use tree_sitter_tlaplus::format::format;
+
+fn main() {
+    let args: Vec<String> = env::args().skip(1).filter(|arg| arg != "--bench").collect();
+    let line_count: usize = args.first().and_then(|arg| arg.parse().ok()).unwrap_or(10000);
+    let source = spec(line_count / 10);
+
+    let mut parser = Parser::new();
+    parser.set_language(tree_sitter_tlaplus::language()).unwrap();
+    let tree = parser.parse(&source, None).unwrap();
+    assert!(!tree.root_node().has_error());
+    for _ in 0..3 {
+        let start = Instant::now();
+        let edits = format(&mut parser, &tree, &source, 8).unwrap();
+        println!(
+            "{:>6} lines formatted in {:>8.3} ms, {} edits",
+            source.lines().count(),
+            start.elapsed().as_secs_f64() * 1000.0,
+            edits.len()
+        );
+    }
+}
+
+// A spec of blocks of ten lines, each with a list to move, nested lists
+// indented with tabs, and a comment continued inside a list.
+fn spec(block_count: usize) -> String {
+    let mut source = String::from("---- MODULE Big ----\nEXTENDS Naturals\nVARIABLES x, y, z\n");
+    for i in 0..block_count {
+        source += &format!("Init{:05} ==   /\\ x = {}\n", i, i);
+        source += "               /\\ \\/ y = 0\n";
+        source += &format!("                  \\/ y = {}\n", i);
+        source += &format!("Next{:05} ==\n", i);
+        source += "\t\u{2227} x' \u{2208} Nat\n";
+        source += "\t\u{2227} \u{2228} y' = y\n";
+        source += &format!("\t  \u{2228} y' = {}\n", i);
+        source += "\t\u{2227} UNCHANGED z (* keeps\n";
+        source += "\t   z *)\n";
+        source += &format!("Inv{:05} == x \\in Nat\n", i);
+    }
+    source + "====\n"
+}
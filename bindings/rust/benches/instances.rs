@@ -0,0 +1,61 @@
+//! Measures expanding a refinement hierarchy in which each module instances
+//! the next, first and from the cache, and again after one module in the
+//! middle of the chain is replaced.
+//!
+//! Usage: `cargo bench --bench instances [-- <modules>]` (default 50).
+
+use std::env;
+use std::time::Instant;
+use tree_sitter::Parser;
+use tree_sitter_tlaplus::instance::InstanceCache;
+
+fn main() {
+    let args: Vec<String> = env::args().skip(1).filter(|arg| arg != "--bench").collect();
+    let module_count: usize = args.first().and_then(|arg| arg.parse().ok()).unwrap_or(50);
+    let mut parser = Parser::new();
+    parser.set_language(tree_sitter_tlaplus::language()).unwrap();
+    let mut cache = InstanceCache::new();
+    let mut insert = |cache: &mut InstanceCache, i: usize, extra: &str| {
+        let source = module(i, module_count, extra);
+        let tree = parser.parse(&source, None).unwrap();
+        cache.insert(format!("M{}.tla", i), tree, source.into_bytes());
+    };
+
+    let start = Instant::now();
+    for i in 0..module_count {
+        insert(&mut cache, i, "");
+    }
+    println!("{:>6} modules parsed in {:>8.3} ms", module_count, millis(start));
+
+    for pass in &["first", "cached"] {
+        let start = Instant::now();
+        let views = cache.expand("Level0");
+        println!("{:>6} views expanded ({}) in {:>8.3} ms", views.len(), pass, millis(start));
+        assert_eq!(module_count - 1, views.len());
+    }
+
+    insert(&mut cache, module_count / 2, "Extra == x\n");
+    let start = Instant::now();
+    let views = cache.expand("Level0");
+    println!("{:>6} views expanded after an edit in {:>8.3} ms", views.len(), millis(start));
+
+    let start = Instant::now();
+    let resolved = views.iter().filter(|view| view.resolve("x").is_some()).count();
+    println!("{:>6} parameters resolved in {:>8.3} ms", resolved, millis(start));
+}
+
+fn module(i: usize, module_count: usize, extra: &str) -> String {
+    let mut source = format!(
+        "---- MODULE Level{} ----\nEXTENDS Naturals\nCONSTANT N\nVARIABLES x, y\n\
+         Init == x = 0 /\\ y = N\nNext == x' = x + 1 /\\ y' = y\n{}",
+        i, extra
+    );
+    if i + 1 < module_count {
+        source += &format!("Abs == INSTANCE Level{} WITH x <- x \\div 2, N <- N + 1\n", i + 1);
+    }
+    source + "====\n"
+}
+
+fn millis(start: Instant) -> f64 {
+    start.elapsed().as_secs_f64() * 1000.0
+}
@@ -0,0 +1,48 @@
+//! Measures parse time of expressions spanning a single very long line, as
+//! found in generated specs with large set or sequence literals.
+//!
+//! Usage: `cargo bench --bench long_lines [-- <size in KiB>]` (default 1024).
+//! Each literal is parsed once on its own and once as an item of a jlist,
+//! where the scanner has to check every token against the list's column.
+
+use std::env;
+use std::time::Instant;
+use tree_sitter::Parser;
+
+fn main() {
+    let args: Vec<String> = env::args().skip(1).filter(|arg| arg != "--bench").collect();
+    let size_kib: usize = args.first().and_then(|arg| arg.parse().ok()).unwrap_or(1024);
+    let literal = literal(size_kib * 1024);
+
+    let mut parser = Parser::new();
+    parser.set_language(tree_sitter_tlaplus::language()).unwrap();
+    for (name, prefix) in [("definition", "S == "), ("jlist item", "S ==\n  /\\ s = ")].iter() {
+        let source = format!("---- MODULE Long ----\n{}{}\n====\n", prefix, literal);
+        let start = Instant::now();
+        let tree = parser.parse(&source, None).unwrap();
+        let elapsed = start.elapsed();
+        assert!(!tree.root_node().has_error());
+        println!(
+            "{:>10}: {:>9} B in {:>8.3} s, {:>8.2} MiB/s",
+            name,
+            source.len(),
+            elapsed.as_secs_f64(),
+            source.len() as f64 / (1024.0 * 1024.0) / elapsed.as_secs_f64()
+        );
+    }
+}
+
+// A set of records of about the given size, all on one line.
+fn literal(size: usize) -> String {
+    let mut literal = String::from("{");
+    let mut i = 0;
+    while literal.len() < size {
+        if i > 0 {
+            literal.push_str(", ");
+        }
+        literal.push_str(&format!("[id |-> {}, tags |-> <<\"a\", \"b\">>]", i));
+        i += 1;
+    }
+    literal.push('}');
+    literal
+}
@@ -0,0 +1,117 @@
+//! Compares peak resident memory of parsing a large generated file from a
+//! string against parsing it through a memory mapping.
+//!
+//! Usage: `cargo bench --bench mapped_rss [-- <size in MiB>]` (default 1024).
+//! Each mode runs in its own child process so peak RSS figures don't mix.
+//! Memory mapping is only supported on unix, so elsewhere this does nothing.
+
+#[cfg(unix)]
+fn main() {
+    unix::main();
+}
+
+#[cfg(not(unix))]
+fn main() {
+    eprintln!("mapped_rss: memory mapping is only supported on unix");
+}
+
+#[cfg(unix)]
+mod unix {
+    use std::env;
+    use std::fs::{self, File};
+    use std::io::{BufWriter, Write};
+    use std::path::Path;
+    use std::process::Command;
+    use std::time::Instant;
+    use tree_sitter::Parser;
+    use tree_sitter_tlaplus::mapped::{parse_mapped, MappedFile};
+
+    const BLOCK: &str = r#"State dump produced by the model checker; this paragraph is
+extramodular text and is skipped by the parser as a single token.
+
+---- MODULE Block ----
+EXTENDS Naturals, Sequences
+VARIABLES x, y, queue
+Init ==
+  /\ x = 0
+  /\ y = {1, 2, 3}
+  /\ queue = <<>>
+Next ==
+  \/ /\ x' = x + 1
+     /\ queue' = Append(queue, x)
+     /\ UNCHANGED y
+  \/ /\ y' = y \cup {x}
+     /\ UNCHANGED <<x, queue>>
+Spec == Init /\ [][Next]_<<x, y, queue>>
+====
+"#;
+
+    pub fn main() {
+        let args: Vec<String> = env::args().skip(1).filter(|arg| arg != "--bench").collect();
+        if args.len() == 2 {
+            return measure(&args[0], Path::new(&args[1]));
+        }
+
+        let size_mib: usize = args.first().and_then(|arg| arg.parse().ok()).unwrap_or(1024);
+        let path = env::temp_dir().join("tree-sitter-tlaplus-mapped-rss.tla");
+        generate(&path, size_mib * 1024 * 1024);
+        println!("input: {} MiB", size_mib);
+        for mode in ["string", "mapped"].iter() {
+            let status = Command::new(env::current_exe().unwrap())
+                .arg(mode)
+                .arg(&path)
+                .status()
+                .unwrap();
+            assert!(status.success());
+        }
+        fs::remove_file(&path).unwrap();
+    }
+
+    fn generate(path: &Path, size: usize) {
+        let mut out = BufWriter::new(File::create(path).unwrap());
+        let mut written = 0;
+        while written < size {
+            out.write_all(BLOCK.as_bytes()).unwrap();
+            written += BLOCK.len();
+        }
+        out.flush().unwrap();
+    }
+
+    fn measure(mode: &str, path: &Path) {
+        let mut parser = Parser::new();
+        parser.set_language(tree_sitter_tlaplus::language()).unwrap();
+        let start = Instant::now();
+        let tree = match mode {
+            "string" => {
+                let source = fs::read(path).unwrap();
+                parser.parse(&source, None)
+            }
+            "mapped" => {
+                // The file is generated by this bench and left alone while mapped.
+            let file = unsafe { MappedFile::open(path) }.unwrap();
+                parse_mapped(&mut parser, &file, None)
+            }
+            _ => panic!("unknown mode {}", mode),
+        }
+        .unwrap();
+        let elapsed = start.elapsed();
+        assert!(!tree.root_node().has_error());
+        println!(
+            "{:>6}: {:>8.2} s, peak RSS {:>8} MiB",
+            mode,
+            elapsed.as_secs_f64(),
+            peak_rss_bytes() / (1024 * 1024)
+        );
+    }
+
+    fn peak_rss_bytes() -> usize {
+        let mut usage: libc::rusage = unsafe { std::mem::zeroed() };
+        unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) };
+        // Linux reports kilobytes, macOS bytes.
+        if cfg!(target_os = "macos") {
+            usage.ru_maxrss as usize
+        } else {
+            usage.ru_maxrss as usize * 1024
+        }
+    }
+}
@@ -0,0 +1,46 @@
+//! Measures parse time of definitions whose deeply nested jlists are all
+//! closed by a single token: the next definition, or the end of the module.
+//!
+//! Usage: `cargo bench --bench nested_jlists [-- <depth> <definitions>]`
+//! (default depth 32, 2000 definitions).
+
+use std::env;
+use std::time::Instant;
+use tree_sitter::Parser;
+
+fn main() {
+    let args: Vec<String> = env::args().skip(1).filter(|arg| arg != "--bench").collect();
+    let depth: usize = args.get(0).and_then(|arg| arg.parse().ok()).unwrap_or(32);
+    let definitions: usize = args.get(1).and_then(|arg| arg.parse().ok()).unwrap_or(2000);
+    let source = generate(depth, definitions);
+
+    let mut parser = Parser::new();
+    parser.set_language(tree_sitter_tlaplus::language()).unwrap();
+    let start = Instant::now();
+    let tree = parser.parse(&source, None).unwrap();
+    let elapsed = start.elapsed();
+    assert!(!tree.root_node().has_error());
+    println!(
+        "depth {:>4}, {:>6} definitions, {:>9} B: {:>8.3} s, {:>8.2} MiB/s",
+        depth,
+        definitions,
+        source.len(),
+        elapsed.as_secs_f64(),
+        source.len() as f64 / (1024.0 * 1024.0) / elapsed.as_secs_f64()
+    );
+}
+
+// Each definition opens `depth` alternating jlists on one line, so the
+// following definition has to close all of them at once.
+fn generate(depth: usize, definitions: usize) -> String {
+    let mut source = String::from("---- MODULE Nested ----\n");
+    for i in 0..definitions {
+        source.push_str(&format!("op{} ==\n  ", i));
+        for level in 0..depth {
+            source.push_str(if 0 == level % 2 { "/\\ " } else { "\\/ " });
+        }
+        source.push_str(&format!("x = {}\n", i));
+    }
+    source.push_str("====\n");
+    source
+}
@@ -0,0 +1,67 @@
+//! Measures building a reference index over a generated workspace, and
+//! looking up a name referenced from every file, both in memory and, on unix,
+//! through the saved index mapped back in.
+//!
+//! Usage: `cargo bench --bench references [-- <files>]` (default 10000).
+
+use std::env;
+use std::fs;
+use std::time::Instant;
+use tree_sitter_tlaplus::index::Index;
+#[cfg(unix)]
+use tree_sitter_tlaplus::index::MappedIndex;
+
+const MODULE: &str = r#"---- MODULE Spec ----
+EXTENDS Naturals, Common
+VARIABLES x, queue
+Init == x = Zero /\ queue = <<>>
+Step(n) == x' = x + n /\ queue' = Append(queue, x)
+Next == \E n \in Values : Step(n)
+Spec == Init /\ [][Next]_<<x, queue>>
+====
+"#;
+
+fn main() {
+    let args: Vec<String> = env::args().skip(1).filter(|arg| arg != "--bench").collect();
+    let file_count: usize = args.first().and_then(|arg| arg.parse().ok()).unwrap_or(10000);
+    let dir = env::temp_dir().join("tree-sitter-tlaplus-bench-references");
+    fs::create_dir_all(&dir).unwrap();
+    let paths: Vec<_> = (0..file_count)
+        .map(|i| {
+            let path = dir.join(format!("Spec{}.tla", i));
+            fs::write(&path, MODULE.replace("Spec ", &format!("Spec{} ", i))).unwrap();
+            path
+        })
+        .collect();
+
+    let mut index = Index::new();
+    let start = Instant::now();
+    assert!(index.index_files(&paths).iter().all(|result| result.is_ok()));
+    println!("{:>6} files indexed in {:>8.3} s", file_count, start.elapsed().as_secs_f64());
+
+    let start = Instant::now();
+    let count = index.references("queue").len();
+    println!("{:>8} references found in memory in {:>8.3} ms", count, millis(start));
+
+    #[cfg(unix)]
+    {
+        let index_path = dir.join("index");
+        index.save(&index_path).unwrap();
+        let start = Instant::now();
+        // The index file is only ever written above.
+        let mapped = unsafe { MappedIndex::open(&index_path) }.unwrap();
+        let references = mapped.references("queue");
+        println!(
+            "{:>8} references found through the mapped index in {:>8.3} ms, {} B",
+            references.len(),
+            millis(start),
+            fs::metadata(&index_path).unwrap().len()
+        );
+        assert_eq!(count, references.len());
+    }
+    fs::remove_dir_all(&dir).unwrap();
+}
+
+fn millis(start: Instant) -> f64 {
+    start.elapsed().as_secs_f64() * 1000.0
+}
@@ -0,0 +1,63 @@
+//! Measures indexing a generated workspace for structural search, and
+//! running queries over it: one narrowed down by a literal, one by node kinds
+//! found in few files, and one every file could match.
+//!
+//! Usage: `cargo bench --bench search [-- <files>]` (default 10000).
+
+use std::env;
+use std::fs;
+use std::time::Instant;
+use tree_sitter_tlaplus::search::SearchIndex;
+
+const MODULE: &str = r#"---- MODULE Spec ----
+EXTENDS Naturals
+VARIABLES x, queue
+Init == x = 0 /\ queue = <<>>
+Step(n) == x' = x + n /\ queue' = Append(queue, x)
+Next == \E n \in Values : Step(n)
+Spec == Init /\ [][Next]_<<x, queue>>
+====
+"#;
+
+const QUERIES: [&str; 3] = [
+    r#"((bounded_quantification (quantifier_bound (identifier_ref) @set)) (#eq? @set "Values17"))"#,
+    "(theorem (terminal_proof) @proof)",
+    "(bounded_quantification) @quantifier",
+];
+
+fn main() {
+    let args: Vec<String> = env::args().skip(1).filter(|arg| arg != "--bench").collect();
+    let file_count: usize = args.first().and_then(|arg| arg.parse().ok()).unwrap_or(10000);
+    let dir = env::temp_dir().join("tree-sitter-tlaplus-bench-search");
+    fs::create_dir_all(&dir).unwrap();
+    let paths: Vec<_> = (0..file_count)
+        .map(|i| {
+            let path = dir.join(format!("Spec{}.tla", i));
+            let mut source = MODULE.replace("Spec ", &format!("Spec{} ", i)).replace("Values", &format!("Values{}", i));
+            if i % 100 == 0 {
+                source = source.replace("====", "THEOREM Spec => []TRUE OBVIOUS\n====");
+            }
+            fs::write(&path, source).unwrap();
+            path
+        })
+        .collect();
+
+    let mut index = SearchIndex::new();
+    let start = Instant::now();
+    assert!(index.add_files(&paths).iter().all(|result| result.is_ok()));
+    println!("{:>6} files indexed in {:>8.3} s", file_count, start.elapsed().as_secs_f64());
+
+    for query in QUERIES.iter() {
+        let start = Instant::now();
+        let candidates = index.candidate_paths(query).len();
+        let matches = index.search(query).unwrap().len();
+        println!(
+            "{:>6} candidates, {:>6} matches in {:>8.3} ms: {}",
+            candidates,
+            matches,
+            start.elapsed().as_secs_f64() * 1000.0,
+            query
+        );
+    }
+    fs::remove_dir_all(&dir).unwrap();
+}
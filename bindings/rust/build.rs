@@ -1,5 +1,13 @@
+use std::env;
+use std::fs;
+use std::path::{Path, PathBuf};
+
+// Number of translation units the generated tables are spread over, which
+// cc compiles in parallel.
+const PARSER_UNITS: usize = 4;
+
 fn main() {
-    let src_dir = std::path::Path::new("src");
+    let src_dir = Path::new("src");
 
     let mut c_config = cc::Build::new();
     c_config.include(&src_dir);
@@ -8,7 +16,18 @@ fn main() {
         .flag_if_supported("-Wno-unused-but-set-variable")
         .flag_if_supported("-Wno-trigraphs");
     let parser_path = src_dir.join("parser.c");
-    c_config.file(&parser_path);
+    let out_dir = PathBuf::from(env::var("OUT_DIR").unwrap());
+    match split_parser(&parser_path, &out_dir, PARSER_UNITS) {
+        Some(unit_paths) => {
+            c_config.include(&out_dir);
+            for unit_path in unit_paths {
+                c_config.file(unit_path);
+            }
+        }
+        None => {
+            c_config.file(&parser_path);
+        }
+    }
 
     let scanner_path = src_dir.join("scanner.cc");
     c_config.file(&scanner_path);
@@ -28,3 +47,100 @@ fn main() {
     cpp_config.compile("scanner");
     println!("cargo:rerun-if-changed={}", scanner_path.to_str().unwrap());
 }
+
+// A table or lex function defined in the generated parser.
+struct Definition<'a> {
+    name: &'a str,
+    declaration: String,
+    lines: &'a [&'a str],
+}
+
+/// Splits the generated parser into translation units written to `out_dir`,
+/// so that its tables compile in parallel rather than as one 30 MB file:
+/// `parser_tables.h` holds the macros and enums and declares every table
+/// and lex function, `parser_tables_<n>.c` define them, packed largest first
+/// into at most `units` files, and `parser_language.c` defines the
+/// `TSLanguage` from them. The definitions lose `static` and are prefixed
+/// with the grammar name so they don't clash with other grammars. Returns
+/// None, to compile `parser.c` as is, if it isn't laid out as expected.
+fn split_parser(parser_path: &Path, out_dir: &Path, units: usize) -> Option<Vec<PathBuf>> {
+    let source = fs::read_to_string(parser_path).ok()?;
+    let lines: Vec<&str> = source.lines().collect();
+    // The external scanner and language function come last.
+    let tail_start = lines.iter().position(|line| "#ifdef __cplusplus" == *line)?;
+
+    let mut header = String::new();
+    let mut definitions = Vec::new();
+    let mut i = 0;
+    while i < tail_start {
+        let line = lines[i];
+        if line.starts_with("static ") && line.ends_with('{') {
+            let length = lines[i..tail_start]
+                .iter()
+                .position(|line| "};" == *line || "}" == *line)?;
+            let signature = &line["static ".len()..];
+            let name = signature[..signature.find(|c| '[' == c || '(' == c)?]
+                .rsplit(|c| ' ' == c || '*' == c)
+                .next()?;
+            let declaration = match signature.find(" = {") {
+                Some(end) => format!("extern {};\n", &signature[..end]),
+                None => format!("{};\n", signature.strip_suffix(" {")?),
+            };
+            definitions.push(Definition {
+                name,
+                declaration,
+                lines: &lines[i..=i + length],
+            });
+            i += length + 1;
+        } else {
+            header.push_str(line);
+            header.push('\n');
+            i += 1;
+        }
+    }
+    if definitions.is_empty() {
+        return None;
+    }
+
+    header.push('\n');
+    for definition in &definitions {
+        header.push_str(&format!("#define {0} tree_sitter_tlaplus_{0}\n", definition.name));
+    }
+    header.push('\n');
+    for definition in &definitions {
+        header.push_str(&definition.declaration);
+    }
+    fs::write(out_dir.join("parser_tables.h"), header).ok()?;
+
+    definitions.sort_by_key(|definition| std::cmp::Reverse(definition.lines.len()));
+    let mut unit_sources = vec![(0, String::from("#include \"parser_tables.h\"\n")); units.max(1)];
+    for definition in &definitions {
+        let (size, unit_source) = unit_sources.iter_mut().min_by_key(|(size, _)| *size).unwrap();
+        *size += definition.lines.len();
+        unit_source.push('\n');
+        unit_source.push_str(&definition.lines[0]["static ".len()..]);
+        unit_source.push('\n');
+        for line in &definition.lines[1..] {
+            unit_source.push_str(line);
+            unit_source.push('\n');
+        }
+    }
+
+    let mut unit_paths = Vec::new();
+    for (n, (size, unit_source)) in unit_sources.iter().enumerate() {
+        if 0 < *size {
+            let unit_path = out_dir.join(format!("parser_tables_{}.c", n));
+            fs::write(&unit_path, unit_source).ok()?;
+            unit_paths.push(unit_path);
+        }
+    }
+    let language_path = out_dir.join("parser_language.c");
+    let mut language_source = String::from("#include \"parser_tables.h\"\n\n");
+    for line in &lines[tail_start..] {
+        language_source.push_str(line);
+        language_source.push('\n');
+    }
+    fs::write(&language_path, language_source).ok()?;
+    unit_paths.push(language_path);
+    Some(unit_paths)
+}
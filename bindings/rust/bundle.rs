@@ -0,0 +1,344 @@
+//! Parallel parsing of files holding many top-level modules.
+//!
+//! TLC trace dumps and concatenated spec bundles often contain dozens of
+//! modules separated by extramodular text. Since each top-level module parses
+//! independently of its neighbours, such files can be pre-split on module
+//! boundaries and each module handed to its own [Parser][] (and therefore its
+//! own external scanner) on a separate thread. Every module is parsed against
+//! the original source buffer restricted to its byte range, so node positions
+//! in the resulting trees are already absolute and need no translation.
+//!
+//! [Parser]: https://docs.rs/tree-sitter/*/tree_sitter/struct.Parser.html
+
+use std::cmp::Reverse;
+use std::ops;
+use tree_sitter::{Node, Parser, Point, Range, Tree};
+
+use crate::parallel;
+
+/// A source file parsed as a sequence of independently-parsed parts.
+pub struct Bundle {
+    parts: Vec<Part>,
+    split: bool,
+}
+
+/// One independently-parsed region of a [Bundle][].
+pub struct Part {
+    range: ops::Range<usize>,
+    tree: Tree,
+}
+
+impl Part {
+    /// The byte range of the source covered by this part.
+    pub fn byte_range(&self) -> ops::Range<usize> {
+        self.range.clone()
+    }
+
+    /// The parse tree of this part; node positions refer to the whole file.
+    pub fn tree(&self) -> &Tree {
+        &self.tree
+    }
+}
+
+impl Bundle {
+    /// The parts of the file in source order.
+    pub fn parts(&self) -> &[Part] {
+        &self.parts
+    }
+
+    /// Whether the file was parsed one module at a time. If not, there is a
+    /// single part holding the tree of the entire file.
+    pub fn is_split(&self) -> bool {
+        self.split
+    }
+
+    /// Finds the part covering the given byte offset. When the file was split,
+    /// offsets between parts fall in extramodular text and return `None`.
+    pub fn part_at(&self, byte: usize) -> Option<&Part> {
+        let index = self.parts.partition_point(|part| part.range.end <= byte);
+        self.parts
+            .get(index)
+            .filter(|part| part.range.start <= byte)
+    }
+
+    /// All top-level module nodes of the file in source order.
+    pub fn modules(&self) -> Vec<Node<'_>> {
+        let mut modules = Vec::new();
+        for part in &self.parts {
+            let root = part.tree.root_node();
+            for i in 0..root.named_child_count() {
+                let child = root.named_child(i).unwrap();
+                if child.kind() == "module" {
+                    modules.push(child);
+                }
+            }
+        }
+        modules
+    }
+}
+
+/// Parses the given source, splitting it on top-level module boundaries and
+/// parsing the modules in parallel when it holds more than one. Wall time is
+/// then bounded by the largest module rather than the sum of all of them.
+///
+/// Module boundaries are found with a fast textual scan. If any module fails
+/// to parse cleanly in isolation, the whole file is parsed serially instead
+/// so the result never differs from an ordinary parse of a valid file.
+pub fn parse_bundle(source: &[u8]) -> Option<Bundle> {
+    let spans = split_modules(source);
+    if spans.len() > 1 {
+        // Hand out the largest modules first so they don't end up last.
+        let mut order: Vec<usize> = (0..spans.len()).collect();
+        order.sort_by_key(|&i| Reverse(spans[i].end_byte - spans[i].start_byte));
+        let trees = parallel::map(&order, new_parser, |parser, &i| {
+            parse_module(parser, source, spans[i])
+        });
+
+        let mut parts: Vec<Option<Part>> = (0..spans.len()).map(|_| None).collect();
+        for (&i, tree) in order.iter().zip(trees) {
+            parts[i] = tree.map(|tree| Part {
+                range: spans[i].start_byte..spans[i].end_byte,
+                tree,
+            });
+        }
+        if parts.iter().all(Option::is_some) {
+            return Some(Bundle {
+                parts: parts.into_iter().map(Option::unwrap).collect(),
+                split: true,
+            });
+        }
+    }
+
+    let tree = new_parser().parse(source, None)?;
+    Some(Bundle {
+        parts: vec![Part {
+            range: 0..source.len(),
+            tree,
+        }],
+        split: false,
+    })
+}
+
+fn new_parser() -> Parser {
+    let mut parser = Parser::new();
+    parser
+        .set_language(crate::language())
+        .expect("Error loading tlaplus grammar");
+    parser
+}
+
+/// Parses a single module in isolation, returning `None` unless the result
+/// is exactly one error-free module.
+fn parse_module(parser: &mut Parser, source: &[u8], span: Range) -> Option<Tree> {
+    parser.set_included_ranges(&[span]).ok()?;
+    let tree = parser.parse(source, None)?;
+    let root = tree.root_node();
+    let is_single_module = 1 == root.named_child_count()
+        && root.named_child(0).map_or(false, |child| child.kind() == "module");
+    if root.has_error() || !is_single_module {
+        None
+    } else {
+        Some(tree)
+    }
+}
+
+/// Finds the ranges of all top-level modules in the source. Module headers
+/// are recognized the same way the external scanner recognizes the end of
+/// extramodular text, as `----` followed by any further dashes, spaces, and
+/// the `MODULE` keyword. Inside a module, strings and comments are skipped
+/// and nested module headers are matched against `====` lines so that
+/// submodules don't end their parent module.
+pub fn split_modules(source: &[u8]) -> Vec<Range> {
+    let mut spans = Vec::new();
+    let mut cursor = Cursor::new(source);
+    let mut depth = 0;
+    let mut start = (0, Point::default());
+    while let Some(codepoint) = cursor.peek(0) {
+        if let Some(header_length) = module_header_length(&source[cursor.offset..]) {
+            if depth == 0 {
+                start = (cursor.offset, cursor.position());
+            }
+            depth += 1;
+            cursor.advance(header_length);
+            continue;
+        }
+
+        if depth == 0 {
+            cursor.advance(1);
+            continue;
+        }
+
+        match codepoint {
+            b'"' => cursor.skip_string(),
+            b'\\' if cursor.peek(1) == Some(b'*') => cursor.skip_line(),
+            b'(' if cursor.peek(1) == Some(b'*') => cursor.skip_block_comment(),
+            b'=' => {
+                let run_length = source[cursor.offset..]
+                    .iter()
+                    .take_while(|&&c| c == b'=')
+                    .count();
+                cursor.advance(run_length);
+                if run_length >= 4 {
+                    depth -= 1;
+                    if depth == 0 {
+                        spans.push(cursor.range_from(start));
+                    }
+                }
+            }
+            _ => cursor.advance(1),
+        }
+    }
+
+    if depth > 0 {
+        // Unterminated module; let it run to the end of the file.
+        spans.push(cursor.range_from(start));
+    }
+
+    spans
+}
+
+/// Returns the length of the module header starting at the beginning of the
+/// given text, if there is one.
+fn module_header_length(text: &[u8]) -> Option<usize> {
+    let dashes = text.iter().take_while(|&&c| c == b'-').count();
+    if dashes < 4 {
+        return None;
+    }
+    let spaces = text[dashes..].iter().take_while(|&&c| c == b' ').count();
+    let keyword_start = dashes + spaces;
+    if text[keyword_start..].starts_with(b"MODULE") {
+        Some(keyword_start + "MODULE".len())
+    } else {
+        None
+    }
+}
+
+// Byte cursor tracking tree-sitter points (rows & byte columns).
+struct Cursor<'a> {
+    source: &'a [u8],
+    offset: usize,
+    row: usize,
+    line_start: usize,
+}
+
+impl<'a> Cursor<'a> {
+    fn new(source: &'a [u8]) -> Self {
+        Cursor {
+            source,
+            offset: 0,
+            row: 0,
+            line_start: 0,
+        }
+    }
+
+    fn peek(&self, distance: usize) -> Option<u8> {
+        self.source.get(self.offset + distance).copied()
+    }
+
+    fn position(&self) -> Point {
+        Point::new(self.row, self.offset - self.line_start)
+    }
+
+    fn range_from(&self, start: (usize, Point)) -> Range {
+        Range {
+            start_byte: start.0,
+            end_byte: self.offset,
+            start_point: start.1,
+            end_point: self.position(),
+        }
+    }
+
+    fn advance(&mut self, count: usize) {
+        let end = (self.offset + count).min(self.source.len());
+        for i in self.offset..end {
+            if b'\n' == self.source[i] {
+                self.row += 1;
+                self.line_start = i + 1;
+            }
+        }
+        self.offset = end;
+    }
+
+    // Skips a string literal; these cannot span lines.
+    fn skip_string(&mut self) {
+        self.advance(1);
+        while let Some(codepoint) = self.peek(0) {
+            match codepoint {
+                b'"' => return self.advance(1),
+                b'\n' => return,
+                b'\\' => self.advance(2),
+                _ => self.advance(1),
+            }
+        }
+    }
+
+    // Skips to the end of the line, leaving the newline itself.
+    fn skip_line(&mut self) {
+        let length = self.source[self.offset..]
+            .iter()
+            .take_while(|&&c| c != b'\n')
+            .count();
+        self.advance(length);
+    }
+
+    // Skips a possibly-nested block comment.
+    fn skip_block_comment(&mut self) {
+        let mut nest_level = 0;
+        while let Some(codepoint) = self.peek(0) {
+            if b'(' == codepoint && Some(b'*') == self.peek(1) {
+                nest_level += 1;
+                self.advance(2);
+            } else if b'*' == codepoint && Some(b')') == self.peek(1) {
+                nest_level -= 1;
+                self.advance(2);
+                if 0 == nest_level {
+                    return;
+                }
+            } else {
+                self.advance(1);
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::split_modules;
+
+    fn split(source: &str) -> Vec<&str> {
+        split_modules(source.as_bytes())
+            .iter()
+            .map(|range| &source[range.start_byte..range.end_byte])
+            .collect()
+    }
+
+    #[test]
+    fn test_split_modules() {
+        let source = "text\n---- MODULE A ----\nx == 1\n====\nmore text\n------ MODULE B ------\n====\n";
+        assert_eq!(
+            split(source),
+            vec!["---- MODULE A ----\nx == 1\n====", "------ MODULE B ------\n===="]
+        );
+        let ranges = split_modules(source.as_bytes());
+        assert_eq!((ranges[1].start_point.row, ranges[1].start_point.column), (5, 0));
+        assert_eq!((ranges[1].end_point.row, ranges[1].end_point.column), (6, 4));
+    }
+
+    #[test]
+    fn test_split_modules_skips_submodules_strings_and_comments() {
+        let source = concat!(
+            "---- MODULE A ----\n",
+            "---- MODULE B ----\n",
+            "====\n",
+            "x == \"====\" \\* ====\n",
+            "(* ---- MODULE C ---- (* ==== *) *)\n",
+            "====\n",
+            "---- MODULE D ----\n",
+            "===="
+        );
+        let modules = split(source);
+        assert_eq!(modules.len(), 2);
+        assert!(modules[0].ends_with("*)\n===="));
+        assert_eq!(modules[1], "---- MODULE D ----\n====");
+    }
+}
@@ -0,0 +1,530 @@
+//! Unresolved-identifier diagnostics, kept up to date across edits.
+//!
+//! Reports each `identifier_ref` naming nothing visible where it appears: no
+//! enclosing parameter or bound variable, no earlier module-level definition
+//! or declaration, and nothing exported by a module the spec extends or
+//! instantiates. Scopes are those of `queries/locals.scm`, plus the binders
+//! it leaves out: quantifiers, `CHOOSE`, set constructors, `LET`, labels and
+//! the `NEW`, `TAKE`, `PICK` and `DEFINE` steps of proofs.
+//!
+//! Each module-level unit is resolved on its own into the names it defines
+//! and the references it leaves free. After an edit, [Diagnostics::update][]
+//! walks only the units overlapping the edits and tree-sitter's changed
+//! ranges again, then matches every unit's free references against the
+//! module-level names, which needs no walk of the tree at all.
+
+use crate::units::{edit_range, text, top_level_modules, units_of, CachedUnit, Edits, UnitCache, UnitKey};
+use std::collections::{HashMap, HashSet};
+use std::ops;
+use tree_sitter::{InputEdit, Node, Range, Tree};
+
+// Nodes opening a scope for the names bound or declared inside them.
+const SCOPE_KINDS: [&str; 15] = [
+    "module",
+    "operator_definition",
+    "function_definition",
+    "module_definition",
+    "lambda",
+    "bounded_quantification",
+    "unbounded_quantification",
+    "choose",
+    "set_filter",
+    "set_map",
+    "function_literal",
+    "let_in",
+    "label",
+    "theorem",
+    "non_terminal_proof",
+];
+
+// Nodes whose `identifier` children declare a name in the innermost scope.
+const DECLARING_KINDS: [&str; 17] = [
+    "variable_declaration",
+    "constant_declaration",
+    "recursive_declaration",
+    "operator_declaration",
+    "operator_definition",
+    "function_definition",
+    "module_definition",
+    "quantifier_bound",
+    "single_quantifier_bound",
+    "tuple_of_identifiers",
+    "unbounded_quantification",
+    "choose",
+    "lambda",
+    "label",
+    "new",
+    "take_proof_step",
+    "pick_proof_step",
+];
+
+// Nodes whose name belongs to the scope around them rather than their own.
+const NAMED_KINDS: [&str; 5] = [
+    "operator_definition",
+    "function_definition",
+    "module_definition",
+    "theorem",
+    "assumption",
+];
+
+// The identifiers exported by the standard modules, and the modules each
+// extends. Nat, Int, Real, BOOLEAN and STRING are nodes of their own.
+const STANDARD_MODULES: [(&str, &[&str], &[&str]); 10] = [
+    ("Naturals", &[], &[]),
+    ("Integers", &[], &["Naturals"]),
+    ("Reals", &["Infinity"], &["Integers"]),
+    ("Sequences", &["Seq", "Len", "Append", "Head", "Tail", "SubSeq", "SelectSeq"], &["Naturals"]),
+    ("FiniteSets", &["IsFiniteSet", "Cardinality"], &["Naturals", "Sequences"]),
+    (
+        "Bags",
+        &[
+            "IsABag", "BagToSet", "SetToBag", "BagIn", "EmptyBag", "CopiesIn", "SubBag", "BagOfAll", "BagUnion",
+            "BagCardinality",
+        ],
+        &["TLC"],
+    ),
+    (
+        "TLC",
+        &[
+            "Print", "PrintT", "Assert", "JavaTime", "TLCGet", "TLCSet", "Permutations", "SortSeq", "RandomElement",
+            "Any", "ToString", "TLCEval",
+        ],
+        &["Naturals", "Sequences"],
+    ),
+    ("RealTime", &["RTBound", "RTnow", "now"], &["Reals"]),
+    (
+        "TLAPS",
+        &[
+            "SMT", "SMTT", "CVC3", "CVC3T", "Yices", "YicesT", "veriT", "veriTT", "Z3", "Z3T", "Spass", "SpassT",
+            "Zenon", "ZenonT", "SlowZenon", "SlowerZenon", "VerySlowZenon", "SlowestZenon", "Isa", "IsaT", "IsaM",
+            "IsaMT", "Auto", "Force", "Blast", "SimplifyAndSolve", "Simplification", "AutoBlast", "LS4", "PTL",
+            "SimpleArithmetic", "AllProvers", "AllProversT", "AllSMT", "AllSMTT", "AllIsa", "AllIsaT",
+            "SetExtensionality", "NoSetContainsEverything", "IsaWithSetExtensionality", "ExpandENABLED",
+            "ExpandCdot", "AutoUSE", "Lambdify", "ENABLEDaxioms", "ENABLEDrewrites", "ENABLEDrules",
+            "LevelComparison", "Trivial",
+        ],
+        &[],
+    ),
+    ("PropositionalTemporalLogic", &[], &["TLAPS"]),
+];
+
+/// A reference to a name with no visible definition.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Diagnostic {
+    pub name: String,
+    pub range: Range,
+}
+
+/// The names modules export, used to resolve `EXTENDS` and `INSTANCE`.
+/// Knows the standard modules to begin with; add the workspace's own with
+/// [Modules::add][]. References in a module importing one it doesn't know
+/// are never reported, since they may well be defined there.
+pub struct Modules {
+    modules: HashMap<String, ModuleExports>,
+}
+
+struct ModuleExports {
+    names: Vec<String>,
+    imports: Vec<String>,
+}
+
+impl Modules {
+    /// Knows the standard modules only.
+    pub fn new() -> Self {
+        let mut modules = HashMap::new();
+        for (name, names, imports) in STANDARD_MODULES.iter() {
+            modules.insert(
+                name.to_string(),
+                ModuleExports {
+                    names: names.iter().map(|name| name.to_string()).collect(),
+                    imports: imports.iter().map(|name| name.to_string()).collect(),
+                },
+            );
+        }
+        Modules { modules }
+    }
+
+    /// Adds the top-level modules of a file, replacing any of the same name.
+    /// A module exports its declarations and non-`LOCAL` definitions, and
+    /// whatever it imports by `EXTENDS` or a non-`LOCAL` unnamed `INSTANCE`.
+    pub fn add(&mut self, tree: &Tree, source: &[u8]) {
+        let empty = Modules {
+            modules: HashMap::new(),
+        };
+        for module in top_level_modules(tree) {
+            let name = match module.child_by_field_name("name") {
+                Some(name) => text(name, source),
+                None => continue,
+            };
+            let mut exports = ModuleExports {
+                names: Vec::new(),
+                imports: Vec::new(),
+            };
+            for node in units_of(module) {
+                if "local_definition" != node.kind() {
+                    let unit = Walker::walk(node, source, &empty);
+                    exports.names.extend(unit.defines);
+                    exports.imports.extend(unit.imports);
+                }
+            }
+            self.modules.insert(name, exports);
+        }
+    }
+
+    /// All names exported by a module, or None if it or any module it
+    /// imports is unknown.
+    pub fn exports(&self, module: &str) -> Option<HashSet<String>> {
+        let mut names = HashSet::new();
+        let mut seen = HashSet::new();
+        let mut pending = vec![module];
+        while let Some(module) = pending.pop() {
+            if seen.insert(module) {
+                let exports = self.modules.get(module)?;
+                names.extend(exports.names.iter().cloned());
+                pending.extend(exports.imports.iter().map(String::as_str));
+            }
+        }
+        Some(names)
+    }
+}
+
+impl Default for Modules {
+    fn default() -> Self {
+        Modules::new()
+    }
+}
+
+/// The unresolved references of a tree, kept up to date across edits.
+pub struct Diagnostics {
+    // The units of each top-level module, in source order.
+    modules: Vec<Vec<Unit>>,
+    edited: Edits,
+    diagnostics: Vec<Diagnostic>,
+}
+
+// A module-level unit, resolved as far as it can be on its own.
+struct Unit {
+    kind_id: u16,
+    range: Range,
+    // Names the unit defines or declares in the module.
+    defines: Vec<String>,
+    // Modules whose exports the unit brings into the module.
+    imports: Vec<String>,
+    // References to names the unit doesn't define itself.
+    free: Vec<Diagnostic>,
+}
+
+impl CachedUnit for Unit {
+    fn key(&self) -> UnitKey {
+        (self.kind_id, self.range.start_byte, self.range.end_byte)
+    }
+}
+
+impl Diagnostics {
+    /// Resolves every reference in the tree.
+    pub fn new(tree: &Tree, source: &[u8], modules: &Modules) -> Self {
+        let mut diagnostics = Diagnostics {
+            modules: Vec::new(),
+            edited: Edits::new(),
+            diagnostics: Vec::new(),
+        };
+        let root = tree.root_node();
+        diagnostics.rebuild(tree, source, modules, &[root.byte_range()]);
+        diagnostics
+    }
+
+    /// The unresolved references in source order.
+    pub fn diagnostics(&self) -> &[Diagnostic] {
+        &self.diagnostics
+    }
+
+    /// Shifts the diagnostics to account for an edit to the source, the same
+    /// way [Tree::edit][] shifts nodes. Call this alongside `Tree::edit` for
+    /// every edit, then [Diagnostics::update][] once the tree has been
+    /// reparsed.
+    ///
+    /// [Tree::edit]: https://docs.rs/tree-sitter/*/tree_sitter/struct.Tree.html#method.edit
+    pub fn edit(&mut self, edit: &InputEdit) {
+        for unit in self.modules.iter_mut().flatten() {
+            edit_range(&mut unit.range, edit);
+            for reference in &mut unit.free {
+                edit_range(&mut reference.range, edit);
+            }
+        }
+        for diagnostic in &mut self.diagnostics {
+            edit_range(&mut diagnostic.range, edit);
+        }
+        self.edited.edit(edit);
+    }
+
+    /// Brings the diagnostics up to date with a tree reparsed after the edits
+    /// passed to [Diagnostics::edit][]. `old_tree` is the edited tree that
+    /// was passed to the parser, and `modules` should be what was used
+    /// before. Only units overlapping an edit or a changed range are walked.
+    pub fn update(&mut self, old_tree: &Tree, new_tree: &Tree, source: &[u8], modules: &Modules) {
+        let dirty = self.edited.dirty(old_tree, new_tree);
+        if !dirty.is_empty() {
+            self.rebuild(new_tree, source, modules, &dirty);
+        }
+    }
+
+    fn rebuild(&mut self, tree: &Tree, source: &[u8], modules: &Modules, dirty: &[ops::Range<usize>]) {
+        let mut cached = UnitCache::new(self.modules.drain(..).flatten(), dirty);
+        for module in top_level_modules(tree) {
+            let units = units_of(module)
+                .map(|node| cached.reuse(node).unwrap_or_else(|| Walker::walk(node, source, modules)))
+                .collect();
+            self.modules.push(units);
+        }
+        self.resolve(modules);
+    }
+
+    // Matches the free references of each unit against the names defined
+    // and imported by the units before it.
+    fn resolve(&mut self, modules: &Modules) {
+        self.diagnostics.clear();
+        for units in &self.modules {
+            let mut names: HashSet<&str> = HashSet::new();
+            let mut imported = HashSet::new();
+            let mut is_open = false;
+            for unit in units {
+                if !is_open {
+                    self.diagnostics.extend(
+                        unit.free
+                            .iter()
+                            .filter(|reference| {
+                                !names.contains(reference.name.as_str()) && !imported.contains(&reference.name)
+                            })
+                            .cloned(),
+                    );
+                }
+                names.extend(unit.defines.iter().map(String::as_str));
+                for module in &unit.imports {
+                    match modules.exports(module) {
+                        Some(exports) => imported.extend(exports),
+                        None => is_open = true,
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Resolves the references of one unit against the scopes inside it.
+struct Walker<'a> {
+    source: &'a [u8],
+    modules: &'a Modules,
+    // The names of each enclosing scope, outermost being the module, and
+    // whether the scope imports an unknown module.
+    scopes: Vec<(HashSet<String>, bool)>,
+    unit: Unit,
+}
+
+impl<'a> Walker<'a> {
+    fn walk(node: Node, source: &'a [u8], modules: &'a Modules) -> Unit {
+        let mut walker = Walker {
+            source,
+            modules,
+            scopes: vec![(HashSet::new(), false)],
+            unit: Unit {
+                kind_id: node.kind_id(),
+                range: node.range(),
+                defines: Vec::new(),
+                imports: Vec::new(),
+                free: Vec::new(),
+            },
+        };
+        // Whether each node on the path from the unit opened a scope.
+        let mut opened = Vec::new();
+        let mut cursor = node.walk();
+        loop {
+            opened.push(walker.enter(cursor.node()));
+            if cursor.goto_first_child() {
+                continue;
+            }
+            loop {
+                if opened.pop().unwrap() {
+                    walker.scopes.pop();
+                }
+                if cursor.node() == node {
+                    let (names, _) = walker.scopes.pop().unwrap();
+                    walker.unit.defines = names.into_iter().collect();
+                    return walker.unit;
+                }
+                if cursor.goto_next_sibling() {
+                    break;
+                }
+                cursor.goto_parent();
+            }
+        }
+    }
+
+    // Handles a node as the walk reaches it, returning whether it opened a
+    // scope.
+    fn enter(&mut self, node: Node) -> bool {
+        let kind = node.kind();
+        if NAMED_KINDS.contains(&kind) {
+            let name = match kind {
+                "theorem" | "assumption" => node.named_child(0),
+                _ => node.child_by_field_name("name"),
+            };
+            if let Some(name) = name.filter(|name| "identifier" == name.kind()) {
+                self.declare(name);
+            }
+        }
+        let opens_scope = SCOPE_KINDS.contains(&kind);
+        if opens_scope {
+            self.scopes.push((HashSet::new(), false));
+            // The map of a set comprehension comes before its generator.
+            if "set_map" == kind {
+                let mut cursor = node.walk();
+                for bound in node.children_by_field_name("generator", &mut cursor) {
+                    for i in 0..bound.named_child_count() {
+                        let child = bound.named_child(i).unwrap();
+                        match child.kind() {
+                            "identifier" => self.declare(child),
+                            "tuple_of_identifiers" => {
+                                for j in 0..child.named_child_count() {
+                                    self.declare(child.named_child(j).unwrap());
+                                }
+                            }
+                            _ => {}
+                        }
+                    }
+                }
+            }
+        }
+
+        let parent = match node.parent() {
+            Some(parent) => parent,
+            None => return opens_scope,
+        };
+        match kind {
+            "identifier" if DECLARING_KINDS.contains(&parent.kind()) => self.declare(node),
+            "identifier_ref" if "extends" == parent.kind() => self.import(text(node, self.source)),
+            "identifier_ref" if "instance" == parent.kind() => {
+                let is_named = parent.parent().map_or(false, |owner| "module_definition" == owner.kind());
+                if !is_named {
+                    self.import(text(node, self.source));
+                }
+            }
+            "identifier_ref" if is_reference(node, parent) => {
+                let name = text(node, self.source);
+                let is_visible = self
+                    .scopes
+                    .iter()
+                    .any(|(names, is_open)| *is_open || names.contains(&name));
+                if !is_visible {
+                    self.unit.free.push(Diagnostic {
+                        name,
+                        range: node.range(),
+                    });
+                }
+            }
+            _ => {}
+        }
+        opens_scope
+    }
+
+    fn declare(&mut self, name: Node) {
+        let name = text(name, self.source);
+        self.scopes.last_mut().unwrap().0.insert(name);
+    }
+
+    // Brings a module's exports into the innermost scope, or, at module level,
+    // leaves that to the module as a whole.
+    fn import(&mut self, module: String) {
+        if 1 == self.scopes.len() {
+            self.unit.imports.push(module);
+            return;
+        }
+        let (names, is_open) = self.scopes.last_mut().unwrap();
+        match self.modules.exports(&module) {
+            Some(exports) => names.extend(exports),
+            None => *is_open = true,
+        }
+    }
+}
+
+// Whether an `identifier_ref` refers to a name in scope where it appears,
+// rather than to a module or to a name inside an instantiated module.
+fn is_reference(node: Node, parent: Node) -> bool {
+    match parent.kind() {
+        "module_ref" => false,
+        "substitution" => parent.named_child(0) != Some(node),
+        "prefixed_op" => false,
+        "subexpr_component" => is_first_component(parent),
+        "bound_op" if parent.child_by_field_name("name") == Some(node) => match parent.parent() {
+            Some(owner) if "prefixed_op" == owner.kind() => false,
+            Some(owner) if "subexpr_component" == owner.kind() => is_first_component(owner),
+            _ => true,
+        },
+        _ => true,
+    }
+}
+
+// In `A!B!C`, only `A` is looked up where it appears.
+fn is_first_component(component: Node) -> bool {
+    component
+        .parent()
+        .map_or(true, |prefix| prefix.named_child(0) == Some(component))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Diagnostics, Modules};
+    use crate::units::reparse;
+    use tree_sitter::Parser;
+
+    fn names(diagnostics: &Diagnostics) -> Vec<&str> {
+        diagnostics
+            .diagnostics()
+            .iter()
+            .map(|diagnostic| diagnostic.name.as_str())
+            .collect()
+    }
+
+    #[test]
+    fn test_scopes() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let mut modules = Modules::new();
+        let other = "---- MODULE Other ----\nEXTENDS Naturals\nShared == 1\nLOCAL Hidden == 2\n====\n";
+        modules.add(&parser.parse(other, None).unwrap(), other.as_bytes());
+        let source = concat!(
+            "---- MODULE Test ----\n",
+            "EXTENDS Sequences\n",
+            "VARIABLE x\n",
+            "INSTANCE Other\n",
+            "O == INSTANCE Other WITH Shared <- x\n",
+            "F(a) == \\A b \\in {a} : b = a /\\ Len(<<>>) = Shared\n",
+            "G == {a + c : c \\in {x}} \\cup {LET y == 1 IN y + z}\n",
+            "H == O!Shared + Hidden + O!Missing\n",
+            "====\n"
+        );
+        let tree = parser.parse(source, None).unwrap();
+        let diagnostics = Diagnostics::new(&tree, source.as_bytes(), &modules);
+        assert_eq!(names(&diagnostics), vec!["a", "z", "Hidden"]);
+    }
+
+    #[test]
+    fn test_update_matches_full_recompute() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let modules = Modules::new();
+        let source = "---- MODULE Test ----\nA == B\nC == 1\n====\n";
+        let mut tree = parser.parse(source, None).unwrap();
+        let mut diagnostics = Diagnostics::new(&tree, source.as_bytes(), &modules);
+        assert_eq!(names(&diagnostics), vec!["B"]);
+
+        // Define B above its use.
+        let offset = source.find("A ==").unwrap();
+        let (new_source, edit, new_tree) = reparse(&mut parser, &mut tree, source, offset..offset, "B == 0\n");
+        diagnostics.edit(&edit);
+        diagnostics.update(&tree, &new_tree, new_source.as_bytes(), &modules);
+
+        assert!(diagnostics.diagnostics().is_empty());
+        let full = Diagnostics::new(&new_tree, new_source.as_bytes(), &modules);
+        assert_eq!(diagnostics.diagnostics(), full.diagnostics());
+    }
+}
@@ -0,0 +1,429 @@
+//! Structural differences between two parse trees.
+//!
+//! [diff][] reports what was added, removed or changed between two
+//! revisions of a spec in terms of the syntax tree — a `conj_item` added to
+//! `Next`, proof step `<2>3` changed — rather than lines of text.
+//!
+//! Each tree is hashed bottom-up in a single pass: a subtree's hash covers
+//! the kinds of its nodes and the text of its leaves, but neither positions,
+//! whitespace nor comments. The two trees are then walked top-down from the
+//! roots, skipping every pair of subtrees with equal hashes, so identical
+//! parts cost nothing beyond hashing. Nodes of the same kind with the same
+//! number of children are compared child by child. The children of modules,
+//! junction lists and proofs, where items are commonly inserted or removed,
+//! are aligned by their hashes instead, allowing up to [ALIGNMENT_BOUND][]
+//! insertions and removals; unmatched children of the same kind are paired
+//! in order and compared in turn. Any other difference is reported as a
+//! change of the smallest node containing it.
+
+use crate::units::text;
+use std::fmt;
+use std::ops;
+use std::rc::Rc;
+use tree_sitter::Tree;
+
+/// The most insertions and removals aligning the children of a list will
+/// look for before pairing them in order.
+pub const ALIGNMENT_BOUND: usize = 64;
+
+// Nodes whose children are aligned rather than compared in order.
+const LIST_KINDS: [&str; 5] = ["source_file", "module", "conj_list", "disj_list", "non_terminal_proof"];
+
+// Nodes named in the context of a change.
+const NAMED_KINDS: [&str; 8] = [
+    "module",
+    "operator_definition",
+    "function_definition",
+    "module_definition",
+    "theorem",
+    "assumption",
+    "proof_step",
+    "qed_step",
+];
+
+/// How a node differs between the two trees.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum ChangeKind {
+    Added,
+    Removed,
+    Changed,
+}
+
+/// A node added, removed or changed.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Change {
+    pub kind: ChangeKind,
+    /// The kind of the node, as in the new tree when changed.
+    pub node_kind: &'static str,
+    /// The name of a definition, theorem or module, or the id of a proof
+    /// step, when the node is one.
+    pub label: Option<String>,
+    /// The byte range of the node in the old tree, unless added.
+    pub old: Option<ops::Range<usize>>,
+    /// The byte range of the node in the new tree, unless removed.
+    pub new: Option<ops::Range<usize>>,
+    /// The labels of the named nodes containing this one, outermost first.
+    pub context: Vec<String>,
+}
+
+impl fmt::Display for Change {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{}", self.node_kind)?;
+        if let Some(label) = &self.label {
+            write!(f, " {}", label)?;
+        }
+        let verb = match self.kind {
+            ChangeKind::Added => "added",
+            ChangeKind::Removed => "removed",
+            ChangeKind::Changed => "changed",
+        };
+        write!(f, " {}", verb)?;
+        if let Some(name) = self.context.last() {
+            write!(f, " in {}", name)?;
+        }
+        Ok(())
+    }
+}
+
+/// The differences between two revisions of a spec, in source order.
+pub fn diff(old_tree: &Tree, old_source: &[u8], new_tree: &Tree, new_source: &[u8]) -> Vec<Change> {
+    let old = Side::new(old_tree, old_source);
+    let new = Side::new(new_tree, new_source);
+    let mut changes = Vec::new();
+    let mut pending = vec![Action::Compare(0, 0, Rc::new(Vec::new()))];
+    while let Some(action) = pending.pop() {
+        match action {
+            Action::Report(change) => changes.push(change),
+            Action::Compare(a, b, context) => {
+                if old.entries[a].hash == new.entries[b].hash {
+                    continue;
+                }
+                let actions = compare(&old, &new, a, b, context);
+                pending.extend(actions.into_iter().rev());
+            }
+        }
+    }
+    changes
+}
+
+enum Action {
+    Compare(usize, usize, Rc<Vec<String>>),
+    Report(Change),
+}
+
+// A subtree, in preorder.
+struct Entry {
+    hash: u64,
+    kind_id: u16,
+    start: u32,
+    end: u32,
+    // The index of the entry after the subtree.
+    next: u32,
+}
+
+struct Side<'a> {
+    tree: &'a Tree,
+    source: &'a [u8],
+    entries: Vec<Entry>,
+}
+
+impl<'a> Side<'a> {
+    fn new(tree: &'a Tree, source: &'a [u8]) -> Self {
+        let mut entries = Vec::new();
+        // The entries whose subtrees are being hashed, and their hashes so far.
+        let mut open: Vec<(usize, u64)> = Vec::new();
+        let mut cursor = tree.walk();
+        'tree: loop {
+            let node = cursor.node();
+            if !node.is_extra() {
+                let mut hash = mix(0, node.kind_id() as u64);
+                if 0 == node.child_count() {
+                    hash = source[node.byte_range()]
+                        .iter()
+                        .fold(hash, |hash, &byte| mix(hash, byte as u64));
+                }
+                open.push((entries.len(), hash));
+                entries.push(Entry {
+                    hash: 0,
+                    kind_id: node.kind_id(),
+                    start: node.start_byte() as u32,
+                    end: node.end_byte() as u32,
+                    next: 0,
+                });
+                if cursor.goto_first_child() {
+                    continue;
+                }
+                close(&mut entries, &mut open);
+            }
+            loop {
+                if cursor.goto_next_sibling() {
+                    break;
+                }
+                if !cursor.goto_parent() {
+                    break 'tree;
+                }
+                close(&mut entries, &mut open);
+            }
+        }
+        Side { tree, source, entries }
+    }
+
+    fn children(&self, i: usize) -> Vec<usize> {
+        let mut children = Vec::new();
+        let mut child = i + 1;
+        while child < self.entries[i].next as usize {
+            children.push(child);
+            child = self.entries[child].next as usize;
+        }
+        children
+    }
+
+    fn kind(&self, i: usize) -> &'static str {
+        self.tree.language().node_kind_for_id(self.entries[i].kind_id).unwrap_or("")
+    }
+
+    fn range(&self, i: usize) -> ops::Range<usize> {
+        self.entries[i].start as usize..self.entries[i].end as usize
+    }
+
+    // The name or step id of a named node.
+    fn label(&self, i: usize) -> Option<String> {
+        let kind = self.kind(i);
+        if !NAMED_KINDS.contains(&kind) {
+            return None;
+        }
+        let range = self.range(i);
+        let mut node = self.tree.root_node().descendant_for_byte_range(range.start, range.end)?;
+        while node.kind_id() != self.entries[i].kind_id || node.byte_range() != range {
+            node = node.parent()?;
+        }
+        let name = match kind {
+            "proof_step" | "qed_step" => node.named_child(0),
+            "theorem" | "assumption" => node.named_child(0).filter(|name| "identifier" == name.kind()),
+            _ => node.child_by_field_name("name"),
+        }?;
+        Some(text(name, self.source).trim_end_matches('.').to_string())
+    }
+
+    fn report(&self, kind: ChangeKind, i: usize, context: &Rc<Vec<String>>) -> Action {
+        let range = Some(self.range(i));
+        let (old, new) = match kind {
+            ChangeKind::Removed => (range, None),
+            _ => (None, range),
+        };
+        Action::Report(Change {
+            kind,
+            node_kind: self.kind(i),
+            label: self.label(i),
+            old,
+            new,
+            context: context.to_vec(),
+        })
+    }
+}
+
+// Records a subtree's hash once all its children are hashed, and adds it to
+// its parent's.
+fn close(entries: &mut [Entry], open: &mut Vec<(usize, u64)>) {
+    let (i, hash) = open.pop().unwrap();
+    entries[i].hash = hash;
+    entries[i].next = entries.len() as u32;
+    if let Some((_, parent)) = open.last_mut() {
+        *parent = mix(*parent, hash);
+    }
+}
+
+fn mix(hash: u64, value: u64) -> u64 {
+    (hash.rotate_left(5) ^ value).wrapping_mul(0x517c_c1b7_2722_0a95)
+}
+
+// What to do about a pair of differing subtrees, in source order.
+fn compare(old: &Side, new: &Side, a: usize, b: usize, context: Rc<Vec<String>>) -> Vec<Action> {
+    if old.entries[a].kind_id != new.entries[b].kind_id {
+        return vec![changed(old, new, a, b, &context)];
+    }
+    let (old_children, new_children) = (old.children(a), new.children(b));
+    let inner = match new.label(b) {
+        Some(label) => {
+            let mut inner = context.to_vec();
+            inner.push(label);
+            Rc::new(inner)
+        }
+        None => Rc::clone(&context),
+    };
+    if LIST_KINDS.contains(&old.kind(a)) {
+        align(old, new, &old_children, &new_children, &inner)
+    } else if old_children.len() == new_children.len() && !old_children.is_empty() {
+        old_children
+            .into_iter()
+            .zip(new_children)
+            .map(|(a, b)| Action::Compare(a, b, Rc::clone(&inner)))
+            .collect()
+    } else {
+        vec![changed(old, new, a, b, &context)]
+    }
+}
+
+fn changed(old: &Side, new: &Side, a: usize, b: usize, context: &Rc<Vec<String>>) -> Action {
+    let mut action = new.report(ChangeKind::Changed, b, context);
+    if let Action::Report(change) = &mut action {
+        change.old = Some(old.range(a));
+    }
+    action
+}
+
+// Matches the children of two lists by hash, then pairs the unmatched ones
+// between each match in order.
+fn align(old: &Side, new: &Side, a: &[usize], b: &[usize], context: &Rc<Vec<String>>) -> Vec<Action> {
+    let old_hashes: Vec<u64> = a.iter().map(|&i| old.entries[i].hash).collect();
+    let new_hashes: Vec<u64> = b.iter().map(|&i| new.entries[i].hash).collect();
+    let prefix = old_hashes.iter().zip(&new_hashes).take_while(|(a, b)| a == b).count();
+    let suffix = old_hashes[prefix..]
+        .iter()
+        .rev()
+        .zip(new_hashes[prefix..].iter().rev())
+        .take_while(|(a, b)| a == b)
+        .count();
+    let (old_end, new_end) = (a.len() - suffix, b.len() - suffix);
+    let mut matches: Vec<(usize, usize)> = myers(&old_hashes[prefix..old_end], &new_hashes[prefix..new_end])
+        .unwrap_or_default()
+        .into_iter()
+        .map(|(i, j)| (prefix + i, prefix + j))
+        .collect();
+    matches.push((old_end, new_end));
+
+    let mut actions = Vec::new();
+    let (mut i, mut j) = (prefix, prefix);
+    for (next_i, next_j) in matches {
+        let (removed, added) = (&a[i..next_i], &b[j..next_j]);
+        let paired = removed.len().min(added.len());
+        for (&a, &b) in removed.iter().zip(added) {
+            if old.entries[a].kind_id == new.entries[b].kind_id {
+                actions.push(Action::Compare(a, b, Rc::clone(context)));
+            } else {
+                actions.push(old.report(ChangeKind::Removed, a, context));
+                actions.push(new.report(ChangeKind::Added, b, context));
+            }
+        }
+        actions.extend(removed[paired..].iter().map(|&a| old.report(ChangeKind::Removed, a, context)));
+        actions.extend(added[paired..].iter().map(|&b| new.report(ChangeKind::Added, b, context)));
+        i = next_i + 1;
+        j = next_j + 1;
+    }
+    actions
+}
+
+// The pairs of equal elements of a longest common subsequence, found with
+// Myers' algorithm, or None if more than ALIGNMENT_BOUND insertions and
+// removals are needed.
+fn myers(a: &[u64], b: &[u64]) -> Option<Vec<(usize, usize)>> {
+    let (n, m) = (a.len() as isize, b.len() as isize);
+    let offset = ALIGNMENT_BOUND as isize + 1;
+    let index = |k: isize| (offset + k) as usize;
+    let mut v = vec![0isize; 2 * ALIGNMENT_BOUND + 3];
+    let mut trace = Vec::new();
+    for d in 0..=ALIGNMENT_BOUND as isize {
+        trace.push(v.clone());
+        for k in (-d..=d).step_by(2) {
+            let mut x = if k == -d || (k != d && v[index(k - 1)] < v[index(k + 1)]) {
+                v[index(k + 1)]
+            } else {
+                v[index(k - 1)] + 1
+            };
+            let mut y = x - k;
+            while x < n && y < m && a[x as usize] == b[y as usize] {
+                x += 1;
+                y += 1;
+            }
+            v[index(k)] = x;
+            if x >= n && y >= m {
+                return Some(backtrack(&trace, n, m, index));
+            }
+        }
+    }
+    None
+}
+
+fn backtrack(trace: &[Vec<isize>], n: isize, m: isize, index: impl Fn(isize) -> usize) -> Vec<(usize, usize)> {
+    let mut matches = Vec::new();
+    let (mut x, mut y) = (n, m);
+    for (d, v) in trace.iter().enumerate().rev() {
+        let d = d as isize;
+        let k = x - y;
+        let previous_k = if k == -d || (k != d && v[index(k - 1)] < v[index(k + 1)]) {
+            k + 1
+        } else {
+            k - 1
+        };
+        let previous_x = v[index(previous_k)];
+        let previous_y = previous_x - previous_k;
+        while x > previous_x && y > previous_y {
+            x -= 1;
+            y -= 1;
+            matches.push((x as usize, y as usize));
+        }
+        if d > 0 {
+            x = previous_x;
+            y = previous_y;
+        }
+    }
+    matches.reverse();
+    matches
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{diff, myers};
+    use tree_sitter::Parser;
+
+    fn describe(old: &str, new: &str) -> Vec<String> {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let old_tree = parser.parse(old, None).unwrap();
+        let new_tree = parser.parse(new, None).unwrap();
+        diff(&old_tree, old.as_bytes(), &new_tree, new.as_bytes())
+            .iter()
+            .map(|change| change.to_string())
+            .collect()
+    }
+
+    #[test]
+    fn test_diff_specs() {
+        let old = concat!(
+            "---- MODULE Test ----\n",
+            "Init == x = 0\n",
+            "Next ==\n",
+            "  /\\ x' = x + 1\n",
+            "  /\\ y' = y\n",
+            "THEOREM Thm == TRUE\n",
+            "<1>1. TRUE OBVIOUS\n",
+            "<1>2. TRUE OBVIOUS\n",
+            "<1> QED BY <1>1, <1>2\n",
+            "====\n",
+        );
+        // Whitespace and comments aren't differences.
+        let reformatted = old.replace("Init == x = 0", "Init ==  x = 0 \\* start");
+        assert!(describe(old, &reformatted).is_empty());
+
+        let new = old
+            .replace("  /\\ y' = y\n", "  /\\ y' = y\n  /\\ z' = z\n")
+            .replace("<1>2. TRUE OBVIOUS", "<1>2. TRUE BY <1>1")
+            .replace("Init == x = 0\n", "");
+        assert_eq!(
+            vec![
+                "operator_definition Init removed in Test",
+                "conj_item added in Next",
+                "terminal_proof changed in <1>2",
+            ],
+            describe(old, &new)
+        );
+    }
+
+    #[test]
+    fn test_myers_alignment() {
+        assert_eq!(Some(vec![(0, 0), (2, 1), (3, 3)]), myers(&[1, 2, 3, 4], &[1, 3, 5, 4]));
+        assert_eq!(Some(vec![]), myers(&[], &[1, 2]));
+        let long: Vec<u64> = (0..1000).collect();
+        assert_eq!(None, myers(&long, &[]));
+    }
+}
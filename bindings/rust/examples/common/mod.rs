@@ -0,0 +1,36 @@
+//! Helpers shared by the examples.
+
+use std::fs;
+use std::path::{Component, Path, PathBuf};
+
+/// Adds the `.tla` files at a path to `paths`: the path itself if it is one,
+/// or those found under it, in sorted order, if it is a directory.
+pub fn collect(path: &Path, paths: &mut Vec<PathBuf>) {
+    if path.is_dir() {
+        let mut entries: Vec<PathBuf> = fs::read_dir(path)
+            .unwrap()
+            .map(|entry| entry.unwrap().path())
+            .collect();
+        entries.sort();
+        for entry in entries {
+            collect(&entry, paths);
+        }
+    } else if path.extension().map_or(false, |extension| "tla" == extension) {
+        paths.push(path.to_path_buf());
+    }
+}
+
+/// Where to write the output for a file within an output directory: its
+/// path as given, without any root, `.` or `..` components, so files of the
+/// same name in different directories don't overwrite each other.
+#[allow(dead_code)]
+pub fn out_path(out_dir: &Path, path: &Path, extension: &str) -> PathBuf {
+    let mut out_path = out_dir.to_path_buf();
+    for component in path.components() {
+        if let Component::Normal(name) = component {
+            out_path.push(name);
+        }
+    }
+    out_path.set_extension(extension);
+    out_path
+}
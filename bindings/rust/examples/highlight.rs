@@ -0,0 +1,76 @@
+//! Highlights specs as HTML or ANSI-colored text.
+//!
+//! Usage: `cargo run --release --example highlight -- [--html | --ansi]
+//! [--out-dir <directory>] <file or directory>...`
+//!
+//! Every `.tla` file found is highlighted, on as many threads as there are
+//! cores. With `--out-dir`, each file is written under that directory at its
+//! own path with the extension `.html` or `.ansi`, so `specs/a/M.tla` goes to
+//! `<directory>/specs/a/M.html`, HTML wrapped in a `<pre>` element; otherwise
+//! all files are written to standard output. Each file is written as soon
+//! as it is highlighted, so files come out in the order they finish.
+
+mod common;
+
+use std::env;
+use std::fs;
+use std::io::{self, Write};
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::atomic::{AtomicBool, Ordering};
+use tree_sitter_tlaplus::highlight::{highlight_files, Format, Highlighter};
+
+fn main() {
+    let mut format = Format::Html;
+    let mut out_dir = None;
+    let mut paths = Vec::new();
+    let mut args = env::args().skip(1);
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--html" => format = Format::Html,
+            "--ansi" => format = Format::Ansi,
+            "--out-dir" => out_dir = args.next().map(PathBuf::from),
+            _ => common::collect(Path::new(&arg), &mut paths),
+        }
+    }
+    if paths.is_empty() {
+        eprintln!("usage: highlight [--html | --ansi] [--out-dir <directory>] <file or directory>...");
+        process::exit(1);
+    }
+
+    let highlighter = Highlighter::new();
+    let failed = AtomicBool::new(false);
+    highlight_files(&highlighter, &paths, format, |path, output| {
+        let output = match output {
+            Ok(output) => output,
+            Err(error) => {
+                eprintln!("{}: {}", path.display(), error);
+                failed.store(true, Ordering::Relaxed);
+                return;
+            }
+        };
+        let (prefix, suffix): (&[u8], &[u8]) = match format {
+            Format::Html => (b"<pre class=\"tlaplus\">", b"</pre>\n"),
+            Format::Ansi => (b"", b""),
+        };
+        match &out_dir {
+            Some(out_dir) => {
+                let extension = if Format::Html == format { "html" } else { "ansi" };
+                let out_path = common::out_path(out_dir, path, extension);
+                fs::create_dir_all(out_path.parent().unwrap()).unwrap();
+                fs::write(&out_path, [prefix, &output, suffix].concat()).unwrap();
+            }
+            None => {
+                // Each file is written under one lock, so files don't interleave.
+                let stdout = io::stdout();
+                let mut stdout = stdout.lock();
+                stdout.write_all(prefix).unwrap();
+                stdout.write_all(&output).unwrap();
+                stdout.write_all(suffix).unwrap();
+            }
+        }
+    });
+    if failed.into_inner() {
+        process::exit(1);
+    }
+}
@@ -0,0 +1,113 @@
+//! Reports parse throughput, GLR fork counts and tree size over a corpus of
+//! specs.
+//!
+//! Usage: `cargo run --release --example parse_stats -- <file or directory>...`
+//!
+//! Every `.tla` file found is parsed twice: once plainly to measure
+//! throughput, and once with the debug log attached to count stack versions.
+//! Run it on the tlaplus/examples corpus before and after a grammar change to
+//! see its effect on each. Tree size is reported as nodes per KiB of source
+//! and an estimate of the bytes taken by the nodes, and the external
+//! scanner's work as the codepoints it advances over per byte of source.
+
+mod common;
+
+use std::env;
+use std::fs;
+use std::path::Path;
+use std::time::{Duration, Instant};
+use tree_sitter::Parser;
+use tree_sitter_tlaplus::stats::{parse_with_stats, ParseStats, TreeStats};
+
+fn main() {
+    let mut paths = Vec::new();
+    for arg in env::args().skip(1) {
+        common::collect(Path::new(&arg), &mut paths);
+    }
+    if paths.is_empty() {
+        eprintln!("usage: parse_stats <file or directory>...");
+        std::process::exit(1);
+    }
+
+    let mut parser = Parser::new();
+    parser.set_language(tree_sitter_tlaplus::language()).unwrap();
+    let mut total = ParseStats::default();
+    let mut total_tree = TreeStats::default();
+    let mut bytes = 0;
+    let mut elapsed = Duration::default();
+    let mut errors = 0;
+    for path in &paths {
+        let source = fs::read(path).unwrap();
+        let start = Instant::now();
+        let tree = parser.parse(&source, None).unwrap();
+        elapsed += start.elapsed();
+        bytes += source.len();
+        if tree.root_node().has_error() {
+            errors += 1;
+        }
+        let tree_stats = TreeStats::new(&tree, source.len());
+
+        let (_, stats) = parse_with_stats(&mut parser, &source, None);
+        println!(
+            "{:>8} B {:>7} steps {:>6.2}% forked {:>6} forks {:>3} max {:>7.1} nodes/KiB  {}",
+            source.len(),
+            stats.steps,
+            percent(stats.forked_steps, stats.steps),
+            stats.forks,
+            stats.max_versions,
+            tree_stats.nodes_per_kib(),
+            path.display()
+        );
+        total.add(&stats);
+        total_tree.add(&tree_stats);
+    }
+
+    println!();
+    println!("files:          {} ({} with errors)", paths.len(), errors);
+    println!(
+        "throughput:     {:.2} MiB/s ({} B in {:.3} s)",
+        bytes as f64 / (1024.0 * 1024.0) / elapsed.as_secs_f64(),
+        bytes,
+        elapsed.as_secs_f64()
+    );
+    println!(
+        "steps:          {} ({:.2}% with more than one stack version)",
+        total.steps,
+        percent(total.forked_steps, total.steps)
+    );
+    println!("forks:          {} ({} merges)", total.forks, total.merges);
+    println!("max versions:   {}", total.max_versions);
+    println!(
+        "scanner:        {} calls, {} codepoints advanced ({:.2} per source byte)",
+        total.external_scans,
+        total.external_advances,
+        total.external_advances as f64 / bytes.max(1) as f64
+    );
+    println!(
+        "nodes:          {} ({} named), {:.1} per KiB of source",
+        total_tree.nodes,
+        total_tree.named_nodes,
+        total_tree.nodes_per_kib()
+    );
+    println!(
+        "tree bytes:     ~{} ({:.2} per source byte)",
+        total_tree.estimated_bytes,
+        total_tree.estimated_bytes as f64 / bytes.max(1) as f64
+    );
+    println!("hottest fork states:");
+    for (state, count) in total.hottest_fork_states().iter().take(10) {
+        println!("  state {:>5}: {:>8} forks", state, count);
+    }
+    println!("most frequent node kinds:");
+    for (kind, count) in total_tree.most_frequent_kinds().iter().take(20) {
+        println!("  {:<24} {:>8}", kind, count);
+    }
+}
+
+fn percent(part: usize, whole: usize) -> f64 {
+    if 0 == whole {
+        0.0
+    } else {
+        100.0 * part as f64 / whole as f64
+    }
+}
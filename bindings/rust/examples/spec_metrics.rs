@@ -0,0 +1,39 @@
+//! Writes size and complexity metrics of a corpus of specs as JSON lines.
+//!
+//! Usage: `cargo run --release --example spec_metrics -- <file or directory>...`
+//!
+//! Every `.tla` file found is parsed and measured, files being spread over
+//! all cores, and one JSON object is written per file to standard output in
+//! path order. Files that cannot be read are reported on standard error.
+
+mod common;
+
+use std::env;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+use std::time::Instant;
+use tree_sitter_tlaplus::metrics::collect;
+
+fn main() {
+    let mut paths = Vec::new();
+    for arg in env::args().skip(1) {
+        common::collect(Path::new(&arg), &mut paths);
+    }
+    if paths.is_empty() {
+        eprintln!("usage: spec_metrics <file or directory>...");
+        std::process::exit(1);
+    }
+
+    let start = Instant::now();
+    let results = collect(&paths);
+    let stdout = io::stdout();
+    let mut out = BufWriter::new(stdout.lock());
+    for (path, result) in paths.iter().zip(results) {
+        match result {
+            Ok(metrics) => writeln!(out, "{}", metrics.to_json_line(path)).unwrap(),
+            Err(error) => eprintln!("{}: {}", path.display(), error),
+        }
+    }
+    out.flush().unwrap();
+    eprintln!("{} files in {:.3} s", paths.len(), start.elapsed().as_secs_f64());
+}
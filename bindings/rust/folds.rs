@@ -0,0 +1,241 @@
+//! Incrementally-maintained fold ranges.
+//!
+//! Computes the same folds as `nvim/queries/tlaplus/folds.scm` directly from
+//! the tree. Rather than re-running a query over the whole file after every
+//! reparse, a [FoldSet][] is told about each edit and then about the new
+//! tree; it only revisits the parts of the tree that the edits and
+//! tree-sitter's changed ranges touch, and keeps every other fold as it was.
+//! The folds are kept sorted, so both steps find the folds they affect by
+//! binary search: an edit shifts only the folds starting at or after it,
+//! and an update splices the recomputed folds into the span they replace.
+
+use crate::units::{edit_range, overlaps_any, Edits};
+use std::ops;
+use tree_sitter::{InputEdit, Node, Range, Tree};
+
+/// The kind of node a fold covers.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum FoldKind {
+    ExtramodularText,
+    BlockComment,
+    Proof,
+}
+
+/// A foldable region spanning more than one line.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct Fold {
+    pub kind: FoldKind,
+    pub range: Range,
+}
+
+/// The folds of a tree, kept up to date across edits.
+pub struct FoldSet {
+    // Sorted by start byte, outer folds before the folds they contain.
+    folds: Vec<Fold>,
+    edited: Edits,
+    kind_ids: [u16; 3],
+}
+
+const FOLD_KINDS: [(&str, FoldKind); 3] = [
+    ("extramodular_text", FoldKind::ExtramodularText),
+    ("block_comment", FoldKind::BlockComment),
+    ("non_terminal_proof", FoldKind::Proof),
+];
+
+impl FoldSet {
+    /// Computes the folds of the entire tree.
+    pub fn new(tree: &Tree) -> Self {
+        let language = tree.language();
+        let mut kind_ids = [0; 3];
+        for (kind_id, (kind, _)) in kind_ids.iter_mut().zip(FOLD_KINDS.iter()) {
+            *kind_id = language.id_for_node_kind(kind, true);
+        }
+        let mut fold_set = FoldSet {
+            folds: Vec::new(),
+            edited: Edits::new(),
+            kind_ids,
+        };
+        let root = tree.root_node();
+        fold_set.folds = fold_set.collect(root, &[root.byte_range()]).0;
+        fold_set
+    }
+
+    /// The folds in source order.
+    pub fn folds(&self) -> &[Fold] {
+        &self.folds
+    }
+
+    /// Shifts the folds to account for an edit to the source, the same way
+    /// [Tree::edit][] shifts nodes. Call this alongside `Tree::edit` for every
+    /// edit, then [FoldSet::update][] once the tree has been reparsed.
+    ///
+    /// Folds enclosing the edit are left as they were until the update,
+    /// which replaces them.
+    ///
+    /// [Tree::edit]: https://docs.rs/tree-sitter/*/tree_sitter/struct.Tree.html#method.edit
+    pub fn edit(&mut self, edit: &InputEdit) {
+        let first = self
+            .folds
+            .partition_point(|fold| fold.range.start_byte < edit.start_byte);
+        for fold in &mut self.folds[first..] {
+            edit_range(&mut fold.range, edit);
+        }
+        self.edited.edit(edit);
+    }
+
+    /// Brings the folds up to date with a tree reparsed after the edits
+    /// passed to [FoldSet::edit][]. `old_tree` is the edited tree that was
+    /// passed to the parser. Only folds overlapping an edit or a changed range
+    /// are recomputed, and only the nodes overlapping them are visited.
+    pub fn update(&mut self, old_tree: &Tree, new_tree: &Tree) {
+        let dirty = self.edited.dirty(old_tree, new_tree);
+        if dirty.is_empty() {
+            return;
+        }
+
+        // Every fold to replace starts within the dirty ranges, or at a
+        // foldable node overlapping them, so it lies in the span of folds
+        // starting from there up to the end of the last dirty range.
+        let (fresh, start) = self.collect(new_tree.root_node(), &dirty);
+        let start = dirty.iter().map(|range| range.start).fold(start, usize::min);
+        let end = dirty.iter().map(|range| range.end).max().unwrap();
+        let first = self.folds.partition_point(|fold| fold.range.start_byte < start);
+        let last = self.folds.partition_point(|fold| fold.range.start_byte <= end);
+
+        let mut kept = self.folds[first..last]
+            .iter()
+            .filter(|fold| !overlaps_any(fold.range.start_byte..fold.range.end_byte, &dirty))
+            .copied()
+            .peekable();
+        let mut fresh = fresh.into_iter().peekable();
+        let mut merged = Vec::with_capacity(last - first + fresh.len());
+        while let (Some(a), Some(b)) = (kept.peek(), fresh.peek()) {
+            if order(a) <= order(b) {
+                merged.extend(kept.next());
+            } else {
+                merged.extend(fresh.next());
+            }
+        }
+        merged.extend(kept.chain(fresh));
+        self.folds.splice(first..last, merged);
+    }
+
+    /// Finds the folds of all nodes overlapping any of the given ranges, in
+    /// order, and the smallest start byte of the foldable nodes among them,
+    /// whether or not they span more than one line.
+    fn collect(&self, root: Node, ranges: &[ops::Range<usize>]) -> (Vec<Fold>, usize) {
+        let mut folds = Vec::new();
+        let mut start = usize::MAX;
+        let mut cursor = root.walk();
+        loop {
+            let node = cursor.node();
+            let relevant = overlaps_any(node.byte_range(), ranges);
+            if relevant {
+                if let Some(kind) = self.fold_kind(node) {
+                    start = start.min(node.start_byte());
+                    if node.end_position().row > node.start_position().row {
+                        folds.push(Fold {
+                            kind,
+                            range: node.range(),
+                        });
+                    }
+                }
+            }
+            if relevant && cursor.goto_first_child() {
+                continue;
+            }
+            loop {
+                if cursor.goto_next_sibling() {
+                    break;
+                }
+                if !cursor.goto_parent() {
+                    return (folds, start);
+                }
+            }
+        }
+    }
+
+    fn fold_kind(&self, node: Node) -> Option<FoldKind> {
+        let kind_id = node.kind_id();
+        self.kind_ids
+            .iter()
+            .position(|&id| id == kind_id)
+            .map(|i| FOLD_KINDS[i].1)
+    }
+}
+
+// The order of folds: by start byte, outer folds before the folds they
+// contain.
+fn order(fold: &Fold) -> (usize, std::cmp::Reverse<usize>) {
+    (fold.range.start_byte, std::cmp::Reverse(fold.range.end_byte))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::FoldSet;
+    use crate::units::reparse;
+    use tree_sitter::Parser;
+
+    #[test]
+    fn test_update_matches_full_recompute() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let source = concat!(
+            "text\nmore text\n",
+            "---- MODULE Test ----\n",
+            "(* a\n   comment *)\n",
+            "THEOREM TRUE\n",
+            "<1>1. TRUE\n",
+            "  OBVIOUS\n",
+            "<1>2. QED\n",
+            "====\n"
+        );
+        let mut tree = parser.parse(source, None).unwrap();
+        let mut folds = FoldSet::new(&tree);
+
+        // Insert a line above the comment.
+        let offset = source.find("(*").unwrap();
+        let (_, edit, new_tree) = reparse(&mut parser, &mut tree, source, offset..offset, "x == 1\n");
+        folds.edit(&edit);
+        folds.update(&tree, &new_tree);
+
+        assert_eq!(folds.folds().len(), 3);
+        assert_eq!(folds.folds(), FoldSet::new(&new_tree).folds());
+    }
+
+    #[test]
+    fn test_update_enclosing_and_collapsed_folds() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let source = concat!(
+            "---- MODULE Test ----\n",
+            "THEOREM TRUE\n",
+            "<1>1. TRUE\n",
+            "  (* a\n     comment *)\n",
+            "  OBVIOUS\n",
+            "<1>2. QED\n",
+            "====\n"
+        );
+        let mut tree = parser.parse(source, None).unwrap();
+        let mut folds = FoldSet::new(&tree);
+        assert_eq!(2, folds.folds().len());
+
+        // Join the comment's lines, inside the proof enclosing it.
+        let offset = source.find("\n     comment").unwrap();
+        let (source, edit, new_tree) = reparse(&mut parser, &mut tree, source, offset..offset + 6, " ");
+        folds.edit(&edit);
+        folds.update(&tree, &new_tree);
+        assert_eq!(folds.folds(), FoldSet::new(&new_tree).folds());
+        assert_eq!(1, folds.folds().len());
+
+        // Lengthen the proof from within, adding a proof nested in it.
+        let mut tree = new_tree;
+        let range = source.find("  OBVIOUS").unwrap()..source.find("\n<1>2").unwrap();
+        let (_, edit, new_tree) =
+            reparse(&mut parser, &mut tree, &source, range, "  <2>1. TRUE\n  <2> QED OBVIOUS");
+        folds.edit(&edit);
+        folds.update(&tree, &new_tree);
+        assert_eq!(folds.folds(), FoldSet::new(&new_tree).folds());
+        assert_eq!(2, folds.folds().len());
+    }
+}
@@ -0,0 +1,440 @@
+//! Layout of conjunction and disjunction lists.
+//!
+//! The meaning of a jlist depends on the column of its bullets: the external
+//! scanner ends the list at the first token found at or left of the column
+//! of its first bullet, measured in codepoints. A formatter that counts bytes,
+//! or that moves one bullet without moving the lines around it, changes the
+//! parse. [format][] instead works from the tree: it finds each list, shifts
+//! it and everything inside it as a block, and measures every column in
+//! codepoints, the way the scanner does, except that tabs advance to the next
+//! tab stop, the way the reader sees them. Its output is only returned once a
+//! reparse confirms the lists are unchanged.
+//!
+//! The layout it produces is:
+//! * a list starting mid-line is separated from the preceding token by a
+//!   single space, and the rest of the list moves with it;
+//! * lines inside a list are indented with spaces only, tabs expanded, so the
+//!   column the parser sees is the column the reader sees;
+//! * lines continuing a multi-line block comment are left as they are.
+
+use std::error;
+use std::fmt;
+use std::ops;
+use tree_sitter::{InputEdit, Node, Parser, Point, Tree};
+
+/// Replacement of a byte range of the source with new text.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Edit {
+    pub range: ops::Range<usize>,
+    pub text: String,
+}
+
+/// Reasons formatting can fail; in either case the source should be left
+/// untouched.
+#[derive(Debug, PartialEq, Eq)]
+pub enum FormatError {
+    /// The source has syntax errors, so its lists can't be trusted.
+    SyntaxError,
+    /// The formatted source parses to different jlists than the original.
+    StructureChanged,
+}
+
+impl fmt::Display for FormatError {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        match self {
+            FormatError::SyntaxError => write!(f, "source has syntax errors"),
+            FormatError::StructureChanged => write!(f, "formatting would change the structure of a jlist"),
+        }
+    }
+}
+
+impl error::Error for FormatError {}
+
+/// Computes the edits laying out every jlist in the source, which must be
+/// the source the tree was parsed from. Edits are ordered by position, do
+/// not overlap, and only ever touch whitespace.
+///
+/// Tab stops are every `tab_width` columns; a width of 1 counts a tab as a
+/// single column, as the scanner does.
+///
+/// The result is checked by applying the edits to the tree and reparsing
+/// incrementally with the given parser. If block-shifting lists changes the
+/// structure, the shifts are dropped and only indentation is normalized; if
+/// even that changes the structure, an error is returned.
+pub fn format(
+    parser: &mut Parser,
+    tree: &Tree,
+    source: &str,
+    tab_width: usize,
+) -> Result<Vec<Edit>, FormatError> {
+    if tree.root_node().has_error() {
+        return Err(FormatError::SyntaxError);
+    }
+
+    let lines = Lines::new(source, tab_width);
+    let lists = collect_lists(tree);
+    let in_comment = comment_rows(tree, lines.count());
+    let expected = signature(tree);
+    for &shift_lists in &[true, false] {
+        let edits = layout(&lines, &lists, &in_comment, shift_lists);
+        if edits.is_empty() {
+            return Ok(edits);
+        }
+        if signature(&reparse(parser, tree, &lines, &edits)) == expected {
+            return Ok(edits);
+        }
+    }
+
+    Err(FormatError::StructureChanged)
+}
+
+/// Applies edits produced by [format][] to the source they were computed
+/// against.
+pub fn apply(source: &str, edits: &[Edit]) -> String {
+    let mut result = String::with_capacity(source.len());
+    let mut offset = 0;
+    for edit in edits {
+        result.push_str(&source[offset..edit.range.start]);
+        result.push_str(&edit.text);
+        offset = edit.range.end;
+    }
+    result.push_str(&source[offset..]);
+    result
+}
+
+// A jlist, by the rows it spans and the position of its first bullet.
+struct List {
+    start_row: usize,
+    end_row: usize,
+    bullet: usize,
+}
+
+fn is_jlist(node: Node) -> bool {
+    matches!(node.kind(), "conj_list" | "disj_list")
+}
+
+/// Finds all jlists in the tree, outermost first.
+fn collect_lists(tree: &Tree) -> Vec<List> {
+    let mut lists = Vec::new();
+    let mut cursor = tree.walk();
+    loop {
+        let node = cursor.node();
+        if is_jlist(node) {
+            // The list itself runs on to the dedent, which sits on the line
+            // of the token that ended it.
+            let last_item = node.named_child(node.named_child_count() - 1).unwrap();
+            lists.push(List {
+                start_row: node.start_position().row,
+                end_row: last_item.end_position().row,
+                bullet: first_bullet(node).start_byte(),
+            });
+        }
+        if !node.is_error() && cursor.goto_first_child() {
+            continue;
+        }
+        while !cursor.goto_next_sibling() {
+            if !cursor.goto_parent() {
+                return lists;
+            }
+        }
+    }
+}
+
+/// Marks the rows continuing a multi-line block comment, whose leading
+/// whitespace is part of the comment.
+fn comment_rows(tree: &Tree, row_count: usize) -> Vec<bool> {
+    let mut in_comment = vec![false; row_count];
+    let mut cursor = tree.walk();
+    loop {
+        let node = cursor.node();
+        let (start_row, end_row) = (node.start_position().row, node.end_position().row);
+        if "block_comment" == node.kind() {
+            for row in &mut in_comment[start_row + 1..=end_row] {
+                *row = true;
+            }
+        } else if start_row < end_row && cursor.goto_first_child() {
+            continue;
+        }
+        while !cursor.goto_next_sibling() {
+            if !cursor.goto_parent() {
+                return in_comment;
+            }
+        }
+    }
+}
+
+fn first_bullet(list: Node) -> Node {
+    let item = list.named_child(0).unwrap_or(list);
+    item.child(0).unwrap_or(item)
+}
+
+/// The shape of every jlist in the tree: kind, rows spanned and item count.
+/// Formatting only changes whitespace within lines, so rows are comparable.
+fn signature(tree: &Tree) -> Vec<(u16, usize, usize, usize)> {
+    let mut shape = Vec::new();
+    let mut cursor = tree.walk();
+    loop {
+        let node = cursor.node();
+        if is_jlist(node) {
+            shape.push((
+                node.kind_id(),
+                node.start_position().row,
+                node.end_position().row,
+                node.named_child_count(),
+            ));
+        }
+        if cursor.goto_first_child() {
+            continue;
+        }
+        while !cursor.goto_next_sibling() {
+            if !cursor.goto_parent() {
+                return shape;
+            }
+        }
+    }
+}
+
+fn layout(lines: &Lines, lists: &[List], in_comment: &[bool], shift_lists: bool) -> Vec<Edit> {
+    let mut edits = Vec::new();
+    let mut shifts = vec![0isize; lines.count()];
+    let mut in_list = vec![false; lines.count()];
+    // Change in width of a row from the gaps normalized on it so far; lists
+    // are visited in order of position, so rows come in order too.
+    let mut row_delta = (usize::MAX, 0isize);
+
+    for list in lists {
+        for row in list.start_row..=list.end_row {
+            in_list[row] = true;
+        }
+
+        let row = list.start_row;
+        if row != row_delta.0 {
+            row_delta = (row, 0);
+        }
+        let line = lines.text(row);
+        let bullet = list.bullet - lines.start(row);
+        let column = lines.columns(&line[..bullet], 0) as isize;
+        let gap_start = line[..bullet].trim_end_matches(is_space).len();
+        let gap = &line[gap_start..bullet];
+        let gap_width = column - lines.columns(&line[..gap_start], 0) as isize;
+
+        // A list starting its line keeps its column; its indentation is
+        // handled with the other rows below.
+        let mut delta = if shift_lists && 0 != gap_start { 1 - gap_width } else { 0 };
+        if 0 != delta && !can_shift(lines, &shifts, list, column, row_delta.1 + delta) {
+            delta = 0;
+        }
+
+        if 0 != gap_start {
+            let text = " ".repeat((gap_width + delta) as usize);
+            if text != gap {
+                edits.push(Edit {
+                    range: lines.start(row) + gap_start..list.bullet,
+                    text,
+                });
+            }
+        }
+        row_delta.1 += delta;
+
+        // The rest of the list moves with its first bullet.
+        if row < list.end_row {
+            let adjust = shifts[row] + row_delta.1 - shifts[row + 1];
+            for shift in &mut shifts[row + 1..=list.end_row] {
+                *shift += adjust;
+            }
+        }
+    }
+
+    for row in 0..lines.count() {
+        if !in_list[row] || in_comment[row] {
+            continue;
+        }
+        let line = lines.text(row);
+        let body = line.trim_start_matches(is_space);
+        if body.is_empty() {
+            continue;
+        }
+        let indent = &line[..line.len() - body.len()];
+        let width = lines.columns(indent, 0) as isize + shifts[row];
+        if width < 0 || (0 == shifts[row] && indent.bytes().all(|c| b' ' == c)) {
+            continue;
+        }
+        let start = lines.start(row);
+        edits.push(Edit {
+            range: start..start + indent.len(),
+            text: " ".repeat(width as usize),
+        });
+    }
+
+    edits.sort_by_key(|edit| edit.range.start);
+    edits
+}
+
+/// Checks that moving a list's first bullet by the given amount beyond the
+/// shift of its row, and the rest of the list with it, keeps the line after
+/// the list on the same side of the list's column.
+fn can_shift(lines: &Lines, shifts: &[isize], list: &List, column: isize, delta: isize) -> bool {
+    let new_column = column + shifts[list.start_row] + delta;
+    let next_row = (list.end_row + 1..lines.count()).find(|&row| lines.indent(row).is_some());
+    match next_row {
+        Some(row) => {
+            let indent = lines.indent(row).unwrap() as isize;
+            (indent <= column) == (indent + shifts[row] <= new_column)
+        }
+        None => true,
+    }
+}
+
+/// Applies the edits to a copy of the tree and reparses the edited source.
+fn reparse(parser: &mut Parser, tree: &Tree, lines: &Lines, edits: &[Edit]) -> Tree {
+    let mut old_tree = tree.clone();
+    // Edits only change columns, so applying them back to front keeps the
+    // positions of the earlier ones valid.
+    for edit in edits.iter().rev() {
+        let row = lines.row(edit.range.start);
+        let line_start = lines.start(row);
+        old_tree.edit(&InputEdit {
+            start_byte: edit.range.start,
+            old_end_byte: edit.range.end,
+            new_end_byte: edit.range.start + edit.text.len(),
+            start_position: Point::new(row, edit.range.start - line_start),
+            old_end_position: Point::new(row, edit.range.end - line_start),
+            new_end_position: Point::new(row, edit.range.start + edit.text.len() - line_start),
+        });
+    }
+
+    let source = apply(lines.source, edits);
+    parser
+        .parse(&source, Some(&old_tree))
+        .expect("Parser has no language or was cancelled")
+}
+
+// Whitespace as the external scanner sees it, excluding line breaks.
+fn is_space(c: char) -> bool {
+    c.is_whitespace() && '\n' != c
+}
+
+struct Lines<'a> {
+    source: &'a str,
+    starts: Vec<usize>,
+    tab_width: usize,
+}
+
+impl<'a> Lines<'a> {
+    fn new(source: &'a str, tab_width: usize) -> Self {
+        let mut starts = vec![0];
+        starts.extend(source.match_indices('\n').map(|(i, _)| i + 1));
+        Lines {
+            source,
+            starts,
+            tab_width: tab_width.max(1),
+        }
+    }
+
+    // The column reached after text starting at the given column: one per
+    // codepoint, as the external scanner counts, tabs aside.
+    fn columns(&self, text: &str, column: usize) -> usize {
+        text.chars().fold(column, |column, c| {
+            if '\t' == c {
+                (column / self.tab_width + 1) * self.tab_width
+            } else {
+                column + 1
+            }
+        })
+    }
+
+    fn count(&self) -> usize {
+        self.starts.len()
+    }
+
+    fn start(&self, row: usize) -> usize {
+        self.starts[row]
+    }
+
+    fn row(&self, byte: usize) -> usize {
+        self.starts.partition_point(|&start| start <= byte) - 1
+    }
+
+    fn text(&self, row: usize) -> &'a str {
+        let end = self
+            .starts
+            .get(row + 1)
+            .map_or(self.source.len(), |&next| next - 1);
+        &self.source[self.starts[row]..end]
+    }
+
+    // Width of the indentation of a row, or None if it is blank.
+    fn indent(&self, row: usize) -> Option<usize> {
+        let line = self.text(row);
+        let body = line.trim_start_matches(is_space);
+        if body.is_empty() {
+            None
+        } else {
+            Some(self.columns(&line[..line.len() - body.len()], 0))
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{apply, format, Lines};
+    use tree_sitter::Parser;
+
+    fn format_source(source: &str, tab_width: usize) -> String {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(source, None).unwrap();
+        apply(source, &format(&mut parser, &tree, source, tab_width).unwrap())
+    }
+
+    #[test]
+    fn test_format_shifts_nested_lists() {
+        let source = concat!(
+            "---- MODULE Test ----\n",
+            "Init ==   /\\ x = 1\n",
+            "          /\\ \\/ y = 2\n",
+            "             \\/ y = 3\n",
+            "====\n"
+        );
+        let expected = concat!(
+            "---- MODULE Test ----\n",
+            "Init == /\\ x = 1\n",
+            "        /\\ \\/ y = 2\n",
+            "           \\/ y = 3\n",
+            "====\n"
+        );
+        assert_eq!(format_source(source, 8), expected);
+        assert_eq!(format_source(expected, 8), expected);
+    }
+
+    #[test]
+    fn test_format_expands_tabs() {
+        let lines = Lines::new("", 4);
+        assert_eq!(4, lines.columns("\t", 0));
+        assert_eq!(8, lines.columns("ab\t", 5));
+        assert_eq!(6, lines.columns("\t\u{2227}\u{2227}", 1));
+        assert_eq!(3, Lines::new("", 1).columns(" \t\t", 0));
+
+        // The continuation of the comment is left alone.
+        let source = concat!(
+            "---- MODULE Test ----\n",
+            "Next ==\n",
+            "\t/\\ a\n",
+            "\t/\\ b (* x\n",
+            "\t y *)\n",
+            "\t/\\ c\n",
+            "====\n"
+        );
+        let expected = concat!(
+            "---- MODULE Test ----\n",
+            "Next ==\n",
+            "    /\\ a\n",
+            "    /\\ b (* x\n",
+            "\t y *)\n",
+            "    /\\ c\n",
+            "====\n"
+        );
+        assert_eq!(format_source(source, 4), expected);
+        assert_eq!(format_source(source, 1), expected.replace("    ", " "));
+    }
+}
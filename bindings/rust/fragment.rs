@@ -0,0 +1,263 @@
+//! Parsing of expressions and proof steps outside of a module.
+//!
+//! The grammar only accepts whole modules, so a bare expression from a TLC
+//! trace or error message has to be wrapped in one before it can be parsed.
+//! Rather than building that wrapper as a new string for every expression,
+//! the functions here hand the parser the wrapper and the fragments as
+//! separate slices through its input callback, so fragments are never
+//! copied. Many expressions can be parsed as a batch, as the definitions of
+//! a single module, paying for one parse instead of one per expression.
+//!
+//! Each fragment starts on a line of its own, so the columns of its nodes
+//! are the same as in the fragment text; only rows and bytes are offset,
+//! by [Fragments::start_row][] and [Fragments::start_byte][].
+
+use tree_sitter::{Node, Parser, Tree};
+
+const MODULE_HEADER: &str = "---- MODULE Fragment ----\n";
+const DEFINITION_HEADER: &str = "E ==\n";
+const THEOREM_HEADER: &str = "THEOREM TRUE\n";
+const MODULE_FOOTER: &str = "====\n";
+
+/// A parsed batch of fragments.
+pub struct Fragments {
+    tree: Tree,
+    starts: Vec<(usize, usize)>,
+    /// Byte at which the node wrapping or being each fragment starts: the
+    /// definition header of an expression, or the first token of a step.
+    anchors: Vec<usize>,
+    kind: FragmentKind,
+}
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+enum FragmentKind {
+    Expression,
+    ProofStep,
+}
+
+impl Fragments {
+    /// The tree of the module wrapping the fragments.
+    pub fn tree(&self) -> &Tree {
+        &self.tree
+    }
+
+    /// Number of fragments in the batch.
+    pub fn len(&self) -> usize {
+        self.starts.len()
+    }
+
+    /// Whether the batch is empty.
+    pub fn is_empty(&self) -> bool {
+        self.starts.is_empty()
+    }
+
+    /// Byte offset of the given fragment within the tree.
+    pub fn start_byte(&self, index: usize) -> usize {
+        self.starts[index].0
+    }
+
+    /// Row of the first line of the given fragment within the tree.
+    pub fn start_row(&self, index: usize) -> usize {
+        self.starts[index].1
+    }
+
+    /// The root node of each fragment, in the order the fragments were given:
+    /// the expression, or the `proof_step` or `qed_step`. A fragment that did
+    /// not parse cleanly on its own is `None`.
+    pub fn nodes(&self) -> Vec<Option<Node<'_>>> {
+        let mut nodes = vec![None; self.starts.len()];
+        let parent = match self.kind {
+            FragmentKind::Expression => self.tree.root_node().named_child(0),
+            FragmentKind::ProofStep => self
+                .tree
+                .root_node()
+                .named_child(0)
+                .and_then(|module| find_child(module, "theorem"))
+                .and_then(|theorem| find_child(theorem, "non_terminal_proof")),
+        };
+        let parent = match parent {
+            Some(parent) => parent,
+            None => return nodes,
+        };
+
+        // Match children to fragments by start byte; anything in between other
+        // than a comment means a fragment spilled over into the next one.
+        let mut candidate: Option<(usize, Node)> = None;
+        let mut cursor = parent.walk();
+        for child in parent.named_children(&mut cursor) {
+            if matches!(child.kind(), "comment" | "block_comment") {
+                continue;
+            }
+            if let Some((index, node)) = candidate.take() {
+                nodes[index] = Some(node);
+            }
+            let index = self.anchors.partition_point(|&anchor| anchor < child.start_byte());
+            let starts_fragment = self
+                .anchors
+                .get(index)
+                .map_or(false, |&anchor| anchor == child.start_byte());
+            if !starts_fragment || child.has_error() {
+                continue;
+            }
+            let node = match self.kind {
+                FragmentKind::Expression if "operator_definition" == child.kind() => {
+                    child.child_by_field_name("definition")
+                }
+                FragmentKind::ProofStep if matches!(child.kind(), "proof_step" | "qed_step") => Some(child),
+                _ => None,
+            };
+            candidate = node.map(|node| (index, node));
+        }
+        if let Some((index, node)) = candidate {
+            nodes[index] = Some(node);
+        }
+        nodes
+    }
+}
+
+fn find_child<'tree>(node: Node<'tree>, kind: &str) -> Option<Node<'tree>> {
+    let mut cursor = node.walk();
+    let child = node.named_children(&mut cursor).find(|child| child.kind() == kind);
+    child
+}
+
+/// Parses a batch of expressions, each as the body of a definition in one
+/// module. An expression with a syntax error generally only affects its own
+/// node, but may take its neighbours with it; reparse those that come back
+/// `None` one at a time to isolate the error.
+pub fn parse_expressions<S: AsRef<str>>(parser: &mut Parser, expressions: &[S]) -> Option<Fragments> {
+    let mut segments = Vec::with_capacity(3 * expressions.len() + 2);
+    segments.push(MODULE_HEADER.as_bytes());
+    for expression in expressions {
+        segments.push(DEFINITION_HEADER.as_bytes());
+        segments.push(expression.as_ref().as_bytes());
+        segments.push(b"\n");
+    }
+    segments.push(MODULE_FOOTER.as_bytes());
+
+    // Each expression follows the module header and its definition header.
+    let (tree, starts) = parse_segments(parser, &segments)?;
+    let anchors = starts.iter().skip(1).step_by(3).take(expressions.len());
+    let anchors = anchors.map(|&(byte, _)| byte).collect();
+    let starts = starts.into_iter().skip(2).step_by(3).take(expressions.len()).collect();
+    Some(Fragments {
+        tree,
+        starts,
+        anchors,
+        kind: FragmentKind::Expression,
+    })
+}
+
+/// Parses a single expression.
+pub fn parse_expression(parser: &mut Parser, expression: &str) -> Option<Fragments> {
+    parse_expressions(parser, &[expression])
+}
+
+/// Parses a single proof step, such as `<1>2. x \in Nat BY DEF Init`, as the
+/// first step of a proof. Unless the step is itself a QED step, a QED step
+/// of the same level is added after it to complete the proof. Leading
+/// whitespace is kept, so the step's columns match its text.
+pub fn parse_proof_step(parser: &mut Parser, step: &str) -> Option<Fragments> {
+    let level = step.trim_start().splitn(2, '>').next().unwrap_or("<*");
+    let indent = step.len() - step.trim_start().len();
+    let is_qed = step
+        .split_whitespace()
+        .nth(1)
+        .map_or(false, |word| "QED" == word);
+    let qed = if is_qed {
+        String::new()
+    } else {
+        match level {
+            "<+" | "<*" => "<*> QED\n".to_string(),
+            level => format!("{}> QED\n", level),
+        }
+    };
+
+    let segments = [
+        MODULE_HEADER.as_bytes(),
+        THEOREM_HEADER.as_bytes(),
+        step.as_bytes(),
+        b"\n",
+        qed.as_bytes(),
+        MODULE_FOOTER.as_bytes(),
+    ];
+    let (tree, starts) = parse_segments(parser, &segments)?;
+    Some(Fragments {
+        tree,
+        starts: vec![starts[2]],
+        anchors: vec![starts[2].0 + indent],
+        kind: FragmentKind::ProofStep,
+    })
+}
+
+/// Parses the concatenation of the segments without concatenating them,
+/// returning the tree and the byte offset and row at which each segment
+/// starts.
+fn parse_segments(parser: &mut Parser, segments: &[&[u8]]) -> Option<(Tree, Vec<(usize, usize)>)> {
+    let mut starts = Vec::with_capacity(segments.len());
+    let mut byte = 0;
+    let mut row = 0;
+    for segment in segments {
+        starts.push((byte, row));
+        byte += segment.len();
+        row += segment.iter().filter(|&&c| b'\n' == c).count();
+    }
+
+    let tree = parser.parse_with(
+        &mut |offset, _| {
+            let index = starts.partition_point(|&(start, _)| start <= offset);
+            if 0 == index || offset >= byte {
+                return &[] as &[u8];
+            }
+            let (start, _) = starts[index - 1];
+            &segments[index - 1][offset - start..]
+        },
+        None,
+    )?;
+    Some((tree, starts))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{parse_expression, parse_expressions, parse_proof_step};
+    use tree_sitter::Parser;
+
+    fn new_parser() -> Parser {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        parser
+    }
+
+    #[test]
+    fn test_parse_expressions() {
+        let mut parser = new_parser();
+        let expressions = ["x + 1", "/\\ a = <<1, 2>>\n/\\ b = {}"];
+        let fragments = parse_expressions(&mut parser, &expressions).unwrap();
+        let nodes = fragments.nodes();
+        assert_eq!(nodes.len(), 2);
+        assert_eq!(nodes[0].unwrap().kind(), "bound_infix_op");
+        let list = nodes[1].unwrap();
+        assert_eq!(list.kind(), "conj_list");
+        assert_eq!(list.start_byte() - fragments.start_byte(1), 0);
+        assert_eq!(list.start_position().row - fragments.start_row(1), 0);
+        assert_eq!(list.start_position().column, 0);
+
+        let fragments = parse_expression(&mut parser, "[x EXCEPT ![1] =").unwrap();
+        assert!(fragments.nodes()[0].is_none());
+    }
+
+    #[test]
+    fn test_parse_proof_step() {
+        let mut parser = new_parser();
+        let fragments = parse_proof_step(&mut parser, "<2>3. x \\in Nat BY DEF Init").unwrap();
+        let step = fragments.nodes()[0].unwrap();
+        assert_eq!(step.kind(), "proof_step");
+        assert_eq!(step.start_byte(), fragments.start_byte(0));
+
+        let fragments = parse_proof_step(&mut parser, "  <2>4. QED").unwrap();
+        let step = fragments.nodes()[0].unwrap();
+        assert_eq!(step.kind(), "qed_step");
+        assert_eq!(step.start_byte(), fragments.start_byte(0) + 2);
+        assert_eq!(step.start_position().column, 2);
+    }
+}
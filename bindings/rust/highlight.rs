@@ -0,0 +1,382 @@
+//! Syntax highlighting to HTML or ANSI-colored text.
+//!
+//! Most patterns in `queries/highlights.scm` capture a node by its kind
+//! alone, whatever its surroundings: every `nat_number` is a number, every
+//! `"THEOREM"` a keyword. A [Highlighter][] resolves those patterns once into
+//! a table from grammar symbol to capture, and only runs the query for the
+//! remaining patterns, which depend on a node's parent or field. The output
+//! is then written in one walk over the tree, with each node taking the
+//! capture of the earliest pattern matching it, as tree-sitter's own
+//! highlighter does, and nodes without one taking that of their parent.
+
+use crate::parallel;
+use std::collections::HashMap;
+use std::fs;
+use std::io::{self, Write};
+use std::iter;
+use std::path::Path;
+use tree_sitter::{Node, Parser, Query, QueryCursor, Tree};
+
+/// The kind of output to produce.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Format {
+    /// Escaped HTML, with each highlighted span in a `<span>` whose classes
+    /// are the parts of its capture name: `variable.parameter` becomes
+    /// `class="variable parameter"`.
+    Html,
+    /// Text with ANSI color escape sequences, for terminals.
+    Ansi,
+}
+
+// A capture, by the index of the pattern it came from and its own index.
+// Lower pattern indices take precedence.
+type Capture = (usize, u32);
+
+/// Highlights trees using the grammar's highlight query.
+pub struct Highlighter {
+    // Only the patterns that depend on a node's context are enabled.
+    query: Query,
+    // The capture of each grammar symbol, from patterns matching on kind alone.
+    symbol_captures: Vec<Option<Capture>>,
+    has_context_patterns: bool,
+}
+
+impl Highlighter {
+    /// Builds the symbol table from `queries/highlights.scm`.
+    pub fn new() -> Self {
+        let language = crate::language();
+        let mut query = Query::new(language, crate::HIGHLIGHTS_QUERY).expect("Error loading highlights query");
+        let mut kinds: HashMap<(&str, bool), Capture> = HashMap::new();
+        let mut has_context_patterns = false;
+        for pattern in 0..query.pattern_count() {
+            let start = query.start_byte_for_pattern(pattern);
+            let end = if pattern + 1 < query.pattern_count() {
+                query.start_byte_for_pattern(pattern + 1)
+            } else {
+                crate::HIGHLIGHTS_QUERY.len()
+            };
+            match context_free_pattern(&crate::HIGHLIGHTS_QUERY[start..end]) {
+                Some((pattern_kinds, capture_name)) => {
+                    let capture = query
+                        .capture_index_for_name(capture_name)
+                        .expect("capture of a pattern is in the query");
+                    for kind in pattern_kinds {
+                        kinds.entry(kind).or_insert((pattern, capture));
+                    }
+                    query.disable_pattern(pattern);
+                }
+                None => has_context_patterns = true,
+            }
+        }
+
+        // A kind name can belong to several symbols, such as aliases.
+        let symbol_captures = (0..language.node_kind_count() as u16)
+            .map(|id| {
+                let kind = language.node_kind_for_id(id)?;
+                kinds.get(&(kind, language.node_kind_is_named(id))).copied()
+            })
+            .collect();
+        Highlighter {
+            query,
+            symbol_captures,
+            has_context_patterns,
+        }
+    }
+
+    /// Names of the captures, indexed by capture index.
+    pub fn capture_names(&self) -> &[String] {
+        self.query.capture_names()
+    }
+
+    /// Writes the highlighted source the tree was parsed from.
+    pub fn highlight<W: Write>(&self, tree: &Tree, source: &[u8], format: Format, out: &mut W) -> io::Result<()> {
+        let mut context_captures: HashMap<usize, Capture> = HashMap::new();
+        if self.has_context_patterns {
+            let mut cursor = QueryCursor::new();
+            let text = |node: Node| iter::once(&source[node.byte_range()]);
+            for (query_match, index) in cursor.captures(&self.query, tree.root_node(), text) {
+                let capture = query_match.captures[index];
+                let entry = context_captures
+                    .entry(capture.node.id())
+                    .or_insert((query_match.pattern_index, capture.index));
+                *entry = (*entry).min((query_match.pattern_index, capture.index));
+            }
+        }
+
+        let mut output = Output {
+            out,
+            format,
+            names: self.capture_names(),
+            open: None,
+        };
+        let mut stack: Vec<Option<u32>> = vec![None];
+        let mut position = 0;
+        let mut cursor = tree.walk();
+        loop {
+            let node = cursor.node();
+            let table_capture = self
+                .symbol_captures
+                .get(node.kind_id() as usize)
+                .copied()
+                .flatten();
+            let capture = match (table_capture, context_captures.get(&node.id())) {
+                (Some(a), Some(&b)) => Some(a.min(b)),
+                (a, b) => a.or(b.copied()),
+            };
+            let parent = *stack.last().unwrap();
+            let start = node.start_byte().max(position);
+            output.write(&source[position..start], parent)?;
+            position = start;
+            stack.push(capture.map(|(_, index)| index).or(parent));
+
+            if cursor.goto_first_child() {
+                continue;
+            }
+            loop {
+                // Leave the current node.
+                let end = cursor.node().end_byte().max(position);
+                output.write(&source[position..end], stack.pop().unwrap())?;
+                position = end;
+                if cursor.goto_next_sibling() {
+                    break;
+                }
+                if !cursor.goto_parent() {
+                    output.write(&source[position..], None)?;
+                    return output.close();
+                }
+            }
+        }
+    }
+}
+
+impl Default for Highlighter {
+    fn default() -> Self {
+        Highlighter::new()
+    }
+}
+
+/// Reads, parses and highlights each file on a pool of threads, passing
+/// each file's output to `sink` on its worker as soon as it is done. Files
+/// finish in no particular order, so the sink is given the path with the
+/// output, and should write it out rather than hold on to it.
+pub fn highlight_files<P, F>(highlighter: &Highlighter, paths: &[P], format: Format, sink: F)
+where
+    P: AsRef<Path> + Sync,
+    F: Fn(&P, io::Result<Vec<u8>>) + Sync,
+{
+    let new_parser = || {
+        let mut parser = Parser::new();
+        parser
+            .set_language(crate::language())
+            .expect("Error loading tlaplus grammar");
+        parser
+    };
+    parallel::map(paths, new_parser, |parser, path| {
+        sink(path, highlight_file(highlighter, parser, path.as_ref(), format))
+    });
+}
+
+fn highlight_file(highlighter: &Highlighter, parser: &mut Parser, path: &Path, format: Format) -> io::Result<Vec<u8>> {
+    let source = fs::read(path)?;
+    let tree = parser
+        .parse(&source, None)
+        .ok_or_else(|| io::Error::new(io::ErrorKind::Other, "parse cancelled"))?;
+    let mut out = Vec::with_capacity(source.len() * 2);
+    highlighter.highlight(&tree, &source, format, &mut out)?;
+    Ok(out)
+}
+
+struct Output<'a, W: Write> {
+    out: &'a mut W,
+    format: Format,
+    names: &'a [String],
+    // Capture of the span currently open in the output.
+    open: Option<u32>,
+}
+
+impl<'a, W: Write> Output<'a, W> {
+    fn write(&mut self, text: &[u8], capture: Option<u32>) -> io::Result<()> {
+        if text.is_empty() {
+            return Ok(());
+        }
+        if capture != self.open {
+            self.close()?;
+            if let Some(index) = capture {
+                let name = &self.names[index as usize];
+                match self.format {
+                    Format::Html => write!(self.out, "<span class=\"{}\">", name.replace('.', " "))?,
+                    Format::Ansi => write!(self.out, "\x1b[{}m", ansi_style(name))?,
+                }
+            }
+            self.open = capture;
+        }
+        match self.format {
+            Format::Html => write_escaped_html(self.out, text),
+            Format::Ansi => self.out.write_all(text),
+        }
+    }
+
+    fn close(&mut self) -> io::Result<()> {
+        if self.open.take().is_some() {
+            match self.format {
+                Format::Html => self.out.write_all(b"</span>")?,
+                Format::Ansi => self.out.write_all(b"\x1b[0m")?,
+            }
+        }
+        Ok(())
+    }
+}
+
+fn write_escaped_html<W: Write>(out: &mut W, text: &[u8]) -> io::Result<()> {
+    let mut start = 0;
+    for (i, &c) in text.iter().enumerate() {
+        let escaped: &[u8] = match c {
+            b'&' => b"&amp;",
+            b'<' => b"&lt;",
+            b'>' => b"&gt;",
+            b'"' => b"&quot;",
+            b'\'' => b"&#39;",
+            _ => continue,
+        };
+        out.write_all(&text[start..i])?;
+        out.write_all(escaped)?;
+        start = i + 1;
+    }
+    out.write_all(&text[start..])
+}
+
+// SGR parameters for a capture, chosen by the first part of its name.
+fn ansi_style(name: &str) -> &'static str {
+    match name.split('.').next().unwrap_or(name) {
+        "keyword" => "35",
+        "number" => "33",
+        "string" => "32",
+        "comment" => "90",
+        "type" => "36",
+        "constant" => "36",
+        "function" => "34",
+        "operator" => "1;34",
+        "variable" => "37",
+        _ => "0",
+    }
+}
+
+/// If a pattern matches nodes by kind alone, returns those kinds, as pairs
+/// of kind name and whether it is named, and the name of its capture. Such
+/// patterns are a single `(kind)` or `"token"`, or an alternation of them,
+/// followed by one capture.
+fn context_free_pattern(text: &str) -> Option<(Vec<(&str, bool)>, &str)> {
+    let tokens = query_tokens(text)?;
+    let (capture, body) = tokens.split_last()?;
+    let capture = capture.strip_prefix('@')?;
+    let body = match body {
+        ["[", items @ .., "]"] => items,
+        items => items,
+    };
+
+    let mut kinds = Vec::new();
+    let mut rest = body;
+    while !rest.is_empty() {
+        match rest {
+            ["(", kind, ")", tail @ ..] if is_kind_name(kind) => {
+                kinds.push((*kind, true));
+                rest = tail;
+            }
+            [literal, tail @ ..] if literal.starts_with('"') => {
+                kinds.push((&literal[1..literal.len() - 1], false));
+                rest = tail;
+            }
+            _ => return None,
+        }
+    }
+    if kinds.is_empty() {
+        return None;
+    }
+    Some((kinds, capture))
+}
+
+fn is_kind_name(token: &str) -> bool {
+    "_" != token && token.bytes().all(|c| c.is_ascii_alphanumeric() || b'_' == c)
+}
+
+// Splits query source into parentheses, brackets, string literals and
+// other words, dropping comments. Returns None for strings with escapes,
+// which never name a kind that matters here.
+fn query_tokens(text: &str) -> Option<Vec<&str>> {
+    let bytes = text.as_bytes();
+    let mut tokens = Vec::new();
+    let mut i = 0;
+    while i < bytes.len() {
+        let start = i;
+        match bytes[i] {
+            b';' => {
+                while i < bytes.len() && b'\n' != bytes[i] {
+                    i += 1;
+                }
+                continue;
+            }
+            c if c.is_ascii_whitespace() => {
+                i += 1;
+                continue;
+            }
+            b'(' | b')' | b'[' | b']' => i += 1,
+            b'"' => {
+                i += 1;
+                while i < bytes.len() && b'"' != bytes[i] {
+                    if b'\\' == bytes[i] {
+                        return None;
+                    }
+                    i += 1;
+                }
+                i += 1;
+            }
+            _ => {
+                while i < bytes.len()
+                    && !bytes[i].is_ascii_whitespace()
+                    && !matches!(bytes[i], b'(' | b')' | b'[' | b']' | b'"' | b';')
+                {
+                    i += 1;
+                }
+            }
+        }
+        tokens.push(text.get(start..i.min(bytes.len()))?);
+    }
+    Some(tokens)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{context_free_pattern, Format, Highlighter};
+    use tree_sitter::Parser;
+
+    #[test]
+    fn test_context_free_pattern() {
+        assert_eq!(
+            context_free_pattern("(nat_number) @number\n"),
+            Some((vec![("nat_number", true)], "number"))
+        );
+        assert_eq!(
+            context_free_pattern("[\n  \"LET\" ; comment\n  (def_eq)\n] @keyword\n\n"),
+            Some((vec![("LET", false), ("def_eq", true)], "keyword"))
+        );
+        assert_eq!(context_free_pattern("(proof_step_id (level) @number)\n"), None);
+        assert_eq!(context_free_pattern("(operator_definition name: (_) @operator)\n"), None);
+    }
+
+    #[test]
+    fn test_highlight_html() {
+        let source = "---- MODULE Test ----\nop(x) == x < 1\n====\n";
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(source, None).unwrap();
+        let mut out = Vec::new();
+        Highlighter::new()
+            .highlight(&tree, source.as_bytes(), Format::Html, &mut out)
+            .unwrap();
+        let html = String::from_utf8(out).unwrap();
+        assert!(html.contains("<span class=\"keyword\">MODULE</span>"));
+        assert!(html.contains("<span class=\"operator\">op</span>"));
+        assert!(html.contains("<span class=\"variable parameter\">x</span>"));
+        assert!(html.contains("<span class=\"function builtin\">&lt;</span> <span class=\"number\">1</span>"));
+    }
+}
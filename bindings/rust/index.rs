@@ -0,0 +1,526 @@
+//! Workspace index of identifier references.
+//!
+//! Finding every reference to a name across a large tree of specs by parsing
+//! and querying each file in turn takes seconds. An [Index][] parses each
+//! file once, on a pool of threads, and keeps an inverted index from each
+//! interned identifier to its `identifier_ref` nodes: the file, byte range
+//! and enclosing definition of each. A changed file is re-indexed on its own,
+//! touching only the entries of the identifiers it references. The index can
+//! be saved to a file which [MappedIndex][] maps back into memory and
+//! searches in place, so lookups need neither a parse nor a load step.
+
+use crate::parallel;
+use std::borrow::Cow;
+use std::collections::HashMap;
+use std::convert::TryFrom;
+use std::fs;
+use std::io;
+use std::ops;
+use std::path::{Path, PathBuf};
+use tree_sitter::{Parser, Tree};
+
+#[cfg(unix)]
+use crate::mapped::MappedFile;
+
+// Kinds of the definitions references are attributed to, all of which have a
+// `name` field.
+const DEFINITION_KINDS: [&str; 3] = ["operator_definition", "function_definition", "module_definition"];
+
+// Start of the saved index format; the last byte is its version.
+const MAGIC: &[u8; 8] = b"TLAIDX\0\x01";
+
+/// An interned identifier.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct Symbol(u32);
+
+/// A file known to an [Index][].
+#[derive(Clone, Copy, Debug, PartialEq, Eq, Hash, PartialOrd, Ord)]
+pub struct FileId(u32);
+
+/// An `identifier_ref` node.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Reference {
+    pub file: FileId,
+    pub byte_range: ops::Range<usize>,
+    /// The name of the innermost operator, function or module definition
+    /// containing the reference, if any.
+    pub definition: Option<Symbol>,
+}
+
+// A reference as found in a file, before its names are interned.
+type Occurrence = (String, ops::Range<usize>, Option<String>);
+
+/// An inverted index from identifiers to their references across files.
+#[derive(Default)]
+pub struct Index {
+    names: Vec<String>,
+    symbols: HashMap<String, Symbol>,
+    paths: Vec<PathBuf>,
+    file_ids: HashMap<PathBuf, FileId>,
+    // The references to each symbol, by symbol.
+    postings: Vec<Vec<Reference>>,
+    // The symbols referenced in each file, by file.
+    file_symbols: Vec<Vec<Symbol>>,
+}
+
+impl Index {
+    /// Creates an empty index.
+    pub fn new() -> Self {
+        Index::default()
+    }
+
+    /// Reads, parses and indexes each file on a pool of threads, replacing
+    /// whatever was indexed for it before. Returns the outcome for each file
+    /// in the order given.
+    pub fn index_files<P: AsRef<Path> + Sync>(&mut self, paths: &[P]) -> Vec<io::Result<()>> {
+        let new_parser = || {
+            let mut parser = Parser::new();
+            parser
+                .set_language(crate::language())
+                .expect("Error loading tlaplus grammar");
+            parser
+        };
+        let results = parallel::map(paths, new_parser, |parser, path| {
+            let source = fs::read(path)?;
+            let tree = parser
+                .parse(&source, None)
+                .ok_or_else(|| io::Error::new(io::ErrorKind::Other, "parse cancelled"))?;
+            Ok(occurrences(&tree, &source))
+        });
+        paths
+            .iter()
+            .zip(results)
+            .map(|(path, result)| result.map(|found| self.replace(path.as_ref(), found)))
+            .collect()
+    }
+
+    /// Re-indexes a file from its current tree and source, as after an edit.
+    pub fn update_file(&mut self, path: impl AsRef<Path>, tree: &Tree, source: &[u8]) {
+        self.replace(path.as_ref(), occurrences(tree, source));
+    }
+
+    /// Drops the references of a file, as after it is deleted.
+    pub fn remove_file(&mut self, path: impl AsRef<Path>) {
+        self.replace(path.as_ref(), Vec::new());
+    }
+
+    /// Looks up an interned identifier.
+    pub fn symbol(&self, name: &str) -> Option<Symbol> {
+        self.symbols.get(name).copied()
+    }
+
+    /// The name of an interned identifier.
+    pub fn name(&self, symbol: Symbol) -> &str {
+        &self.names[symbol.0 as usize]
+    }
+
+    /// The path of a file.
+    pub fn path(&self, file: FileId) -> &Path {
+        &self.paths[file.0 as usize]
+    }
+
+    /// All references to the given name, grouped by file.
+    pub fn references(&self, name: &str) -> &[Reference] {
+        match self.symbol(name) {
+            Some(symbol) => &self.postings[symbol.0 as usize],
+            None => &[],
+        }
+    }
+
+    /// Writes the index to a file for [MappedIndex][] to open. Counts and
+    /// byte offsets are stored in 32 bits, so an index with more than 4 GiB
+    /// of names and paths, or references past 4 GiB into a file, can't be
+    /// saved. Paths are stored as UTF-8, lossily converted.
+    pub fn save(&self, path: impl AsRef<Path>) -> io::Result<()> {
+        let word = |value: usize| {
+            u32::try_from(value)
+                .map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "index too large to save"))
+        };
+        let mut sorted: Vec<Symbol> = (0..self.names.len() as u32)
+            .map(Symbol)
+            .filter(|symbol| !self.postings[symbol.0 as usize].is_empty())
+            .collect();
+        sorted.sort_by(|a, b| self.name(*a).cmp(self.name(*b)));
+        let reference_count = sorted
+            .iter()
+            .map(|symbol| self.postings[symbol.0 as usize].len())
+            .sum::<usize>();
+
+        let mut words = vec![
+            word(self.names.len())?,
+            word(self.paths.len())?,
+            word(sorted.len())?,
+            word(reference_count)?,
+        ];
+        let mut strings = Vec::new();
+        let names = self.names.iter().map(|name| Cow::from(name.as_str()));
+        for string in names.chain(self.paths.iter().map(|path| path.to_string_lossy())) {
+            strings.extend_from_slice(string.as_bytes());
+            words.push(word(strings.len())?);
+        }
+        let mut reference_end = 0;
+        for symbol in &sorted {
+            reference_end += self.postings[symbol.0 as usize].len();
+            words.push(symbol.0);
+            words.push(word(reference_end)?);
+        }
+        for symbol in &sorted {
+            for reference in &self.postings[symbol.0 as usize] {
+                words.push(reference.file.0);
+                words.push(word(reference.byte_range.start)?);
+                words.push(word(reference.byte_range.end)?);
+                words.push(reference.definition.map_or(0, |definition| definition.0 + 1));
+            }
+        }
+
+        let mut bytes = Vec::with_capacity(MAGIC.len() + 4 * words.len() + strings.len());
+        bytes.extend_from_slice(MAGIC);
+        for word in words {
+            bytes.extend_from_slice(&word.to_le_bytes());
+        }
+        bytes.extend_from_slice(&strings);
+        fs::write(path, bytes)
+    }
+
+    fn replace(&mut self, path: &Path, found: Vec<Occurrence>) {
+        let file = match self.file_ids.get(path) {
+            Some(&file) => file,
+            None => {
+                let file = FileId(self.paths.len() as u32);
+                self.paths.push(path.to_path_buf());
+                self.file_ids.insert(path.to_path_buf(), file);
+                self.file_symbols.push(Vec::new());
+                file
+            }
+        };
+        for symbol in self.file_symbols[file.0 as usize].drain(..) {
+            self.postings[symbol.0 as usize].retain(|reference| reference.file != file);
+        }
+
+        let mut file_symbols = Vec::new();
+        for (name, byte_range, definition) in found {
+            let symbol = self.intern(name);
+            let definition = definition.map(|definition| self.intern(definition));
+            let postings = &mut self.postings[symbol.0 as usize];
+            if postings.last().map_or(true, |reference| reference.file != file) {
+                file_symbols.push(symbol);
+            }
+            postings.push(Reference {
+                file,
+                byte_range,
+                definition,
+            });
+        }
+        self.file_symbols[file.0 as usize] = file_symbols;
+    }
+
+    fn intern(&mut self, name: String) -> Symbol {
+        if let Some(&symbol) = self.symbols.get(&name) {
+            return symbol;
+        }
+        let symbol = Symbol(self.names.len() as u32);
+        self.names.push(name.clone());
+        self.symbols.insert(name, symbol);
+        self.postings.push(Vec::new());
+        symbol
+    }
+}
+
+/// The `identifier_ref` nodes of a tree, with their names and the names of
+/// the definitions enclosing them, in source order.
+fn occurrences(tree: &Tree, source: &[u8]) -> Vec<Occurrence> {
+    let text = |range: ops::Range<usize>| String::from_utf8_lossy(&source[range]).into_owned();
+    let mut found = Vec::new();
+    // The innermost enclosing definition at each depth of the walk.
+    let mut definitions: Vec<Option<String>> = vec![None];
+    let mut cursor = tree.walk();
+    loop {
+        let node = cursor.node();
+        let mut definition = definitions.last().unwrap().clone();
+        if "identifier_ref" == node.kind() {
+            found.push((text(node.byte_range()), node.byte_range(), definition.clone()));
+        } else if DEFINITION_KINDS.contains(&node.kind()) {
+            if let Some(name) = node.child_by_field_name("name") {
+                definition = Some(text(name.byte_range()));
+            }
+        }
+
+        if cursor.goto_first_child() {
+            definitions.push(definition);
+            continue;
+        }
+        while !cursor.goto_next_sibling() {
+            if !cursor.goto_parent() {
+                return found;
+            }
+            definitions.pop();
+        }
+    }
+}
+
+/// A reference read from a [MappedIndex][].
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct MappedReference<'a> {
+    pub path: &'a str,
+    pub byte_range: ops::Range<usize>,
+    pub definition: Option<&'a str>,
+}
+
+/// An index saved by [Index::save][], mapped into memory and searched in
+/// place by binary search over its sorted identifiers.
+#[cfg(unix)]
+pub struct MappedIndex {
+    file: MappedFile,
+    name_count: usize,
+    // Word offsets of the tables following the header.
+    string_ends: usize,
+    symbols: usize,
+    references: usize,
+    strings: usize,
+}
+
+#[cfg(unix)]
+impl MappedIndex {
+    /// Maps a saved index, checking its format, and that its tables fill the
+    /// file and only hold offsets and ids within bounds. This reads the whole
+    /// file once, but lookups can then neither fail nor panic.
+    ///
+    /// # Safety
+    ///
+    /// As for [MappedFile::open][]: nothing may modify or truncate the file
+    /// until the index is dropped, which would also void the checks made here.
+    pub unsafe fn open(path: impl AsRef<Path>) -> io::Result<Self> {
+        let invalid = || io::Error::new(io::ErrorKind::InvalidData, "not a tlaplus reference index");
+        let file = MappedFile::open(path)?;
+        let bytes = file.as_bytes();
+        if bytes.len() < MAGIC.len() + 16 || &bytes[..MAGIC.len()] != MAGIC {
+            return Err(invalid());
+        }
+        let header = |i| read_word(bytes, i) as usize;
+        let (name_count, file_count, symbol_count, reference_count) = (header(0), header(1), header(2), header(3));
+        let string_ends = 4;
+        // Counts are checked against the file size before they're trusted.
+        let layout = || {
+            let symbols = string_ends + name_count.checked_add(file_count)?;
+            let references = symbols.checked_add(symbol_count.checked_mul(2)?)?;
+            let words = references.checked_add(reference_count.checked_mul(4)?)?;
+            let strings = MAGIC.len().checked_add(words.checked_mul(4)?)?;
+            Some((symbols, references, strings)).filter(|_| strings <= bytes.len())
+        };
+        let (symbols, references, strings) = layout().ok_or_else(invalid)?;
+        let index = MappedIndex {
+            file,
+            name_count,
+            string_ends,
+            symbols,
+            references,
+            strings,
+        };
+        if index.is_valid(file_count, reference_count) {
+            Ok(index)
+        } else {
+            Err(invalid())
+        }
+    }
+
+    // Whether the tables are consistent, given that they fit in the file:
+    // string ends never decrease and end with the file, symbols are sorted
+    // and their reference ends never decrease and end with the references
+    // table, and references name known files and definitions.
+    fn is_valid(&self, file_count: usize, reference_count: usize) -> bool {
+        let string_bytes = self.file.as_bytes().len() - self.strings;
+        let mut end = 0;
+        for i in self.string_ends..self.symbols {
+            let next = self.word(i) as usize;
+            if next < end || string_bytes < next {
+                return false;
+            }
+            end = next;
+        }
+        if end != string_bytes {
+            return false;
+        }
+        let mut end = 0;
+        let mut previous: Option<&[u8]> = None;
+        for entry in (self.symbols..self.references).step_by(2) {
+            let (symbol, next) = (self.word(entry) as usize, self.word(entry + 1) as usize);
+            if self.name_count <= symbol || next < end {
+                return false;
+            }
+            let name = self.string_bytes(symbol);
+            if previous.map_or(false, |previous| name <= previous) {
+                return false;
+            }
+            previous = Some(name);
+            end = next;
+        }
+        if end != reference_count {
+            return false;
+        }
+        (0..reference_count).all(|i| {
+            let entry = self.references + 4 * i;
+            (self.word(entry) as usize) < file_count
+                && self.word(entry + 1) <= self.word(entry + 2)
+                && self.word(entry + 3) as usize <= self.name_count
+        })
+    }
+
+    /// All references to the given name, grouped by file.
+    pub fn references(&self, name: &str) -> Vec<MappedReference<'_>> {
+        let symbol_count = (self.references - self.symbols) / 2;
+        let (mut low, mut high) = (0, symbol_count);
+        while low < high {
+            let middle = (low + high) / 2;
+            let symbol = self.word(self.symbols + 2 * middle) as usize;
+            match self.string_bytes(symbol).cmp(name.as_bytes()) {
+                std::cmp::Ordering::Less => low = middle + 1,
+                std::cmp::Ordering::Greater => high = middle,
+                std::cmp::Ordering::Equal => return self.symbol_references(middle),
+            }
+        }
+        Vec::new()
+    }
+
+    fn symbol_references(&self, index: usize) -> Vec<MappedReference<'_>> {
+        let start = match index {
+            0 => 0,
+            _ => self.word(self.symbols + 2 * index - 1) as usize,
+        };
+        let end = self.word(self.symbols + 2 * index + 1) as usize;
+        (start..end)
+            .map(|i| {
+                let entry = self.references + 4 * i;
+                let definition = self.word(entry + 3) as usize;
+                MappedReference {
+                    path: self.string(self.name_count + self.word(entry) as usize),
+                    byte_range: self.word(entry + 1) as usize..self.word(entry + 2) as usize,
+                    definition: if 0 == definition { None } else { Some(self.string(definition - 1)) },
+                }
+            })
+            .collect()
+    }
+
+    fn word(&self, index: usize) -> u32 {
+        read_word(self.file.as_bytes(), index)
+    }
+
+    fn string_bytes(&self, index: usize) -> &[u8] {
+        let start = match index {
+            0 => 0,
+            _ => self.word(self.string_ends + index - 1) as usize,
+        };
+        let end = self.word(self.string_ends + index) as usize;
+        &self.file.as_bytes()[self.strings + start..self.strings + end]
+    }
+
+    fn string(&self, index: usize) -> &str {
+        std::str::from_utf8(self.string_bytes(index)).unwrap_or("")
+    }
+}
+
+// Reads the little-endian word at the given index after the magic bytes.
+fn read_word(bytes: &[u8], index: usize) -> u32 {
+    let start = MAGIC.len() + 4 * index;
+    let mut word = [0; 4];
+    word.copy_from_slice(&bytes[start..start + 4]);
+    u32::from_le_bytes(word)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Index, MAGIC};
+    use std::fs;
+    use std::io;
+    use tree_sitter::Parser;
+
+    const SOURCE: &str = "---- MODULE Test ----\nVARIABLE x\nInc == x + 1\nNext == x' = Inc\n====\n";
+
+    #[test]
+    fn test_update_references() {
+        let dir = std::env::temp_dir().join("tree-sitter-tlaplus-test-update-references");
+        fs::create_dir_all(&dir).unwrap();
+        let paths = [dir.join("A.tla"), dir.join("B.tla")];
+        fs::write(&paths[0], SOURCE).unwrap();
+        fs::write(&paths[1], "---- MODULE B ----\nInit == x = 0\n====\n").unwrap();
+
+        let mut index = Index::new();
+        assert!(index.index_files(&paths).iter().all(|result| result.is_ok()));
+        let references = index.references("x");
+        assert_eq!(3, references.len());
+        assert_eq!(paths[0], index.path(references[0].file));
+        assert_eq!(Some("Inc"), references[0].definition.map(|symbol| index.name(symbol)));
+        assert_eq!(paths[1], index.path(references[2].file));
+        assert_eq!(1, index.references("Inc").len());
+
+        let source = "---- MODULE Test ----\nVARIABLE x\nNext == x' = x\n====\n";
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(source, None).unwrap();
+        index.update_file(&paths[0], &tree, source.as_bytes());
+        assert_eq!(3, index.references("x").len());
+        assert!(index.references("Inc").is_empty());
+
+        index.remove_file(&paths[1]);
+        assert_eq!(2, index.references("x").len());
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_mapped_index() {
+        let dir = std::env::temp_dir().join("tree-sitter-tlaplus-test-mapped-index");
+        fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("Test.tla");
+        fs::write(&path, SOURCE).unwrap();
+        let mut index = Index::new();
+        assert!(index.index_files(&[&path])[0].is_ok());
+        index.save(dir.join("index")).unwrap();
+
+        let mapped = unsafe { super::MappedIndex::open(dir.join("index")) }.unwrap();
+        let references = mapped.references("x");
+        assert_eq!(2, references.len());
+        assert_eq!(path.to_str().unwrap(), references[0].path);
+        assert_eq!(&SOURCE[references[1].byte_range.clone()], "x");
+        assert_eq!(Some("Next"), references[1].definition);
+        assert_eq!(1, mapped.references("Inc").len());
+        assert!(mapped.references("Missing").is_empty());
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_open_rejects_corrupt_index() {
+        let dir = std::env::temp_dir().join("tree-sitter-tlaplus-test-corrupt-index");
+        fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("index");
+        let open = |words: &[u32], strings: &[u8]| {
+            let mut bytes = MAGIC.to_vec();
+            for word in words {
+                bytes.extend_from_slice(&word.to_le_bytes());
+            }
+            bytes.extend_from_slice(strings);
+            fs::write(&path, bytes).unwrap();
+            unsafe { super::MappedIndex::open(&path) }.map(|index| index.references("b").len())
+        };
+
+        Index::new().save(&path).unwrap();
+        assert_eq!(0, unsafe { super::MappedIndex::open(&path) }.unwrap().references("x").len());
+        // Names a and b, file f, symbols a and b, and a reference to each,
+        // the one to b within the definition of a.
+        let valid = [2, 1, 2, 2, 1, 2, 3, 0, 1, 1, 2, 0, 0, 1, 0, 0, 4, 5, 1];
+        assert_eq!(1, open(&valid, b"abf").unwrap());
+
+        let mut corrupt = vec![
+            open(&valid, b"ab").unwrap_err(),
+            open(&[u32::MAX, u32::MAX, u32::MAX, u32::MAX], b"").unwrap_err(),
+        ];
+        let changes = [(5, 9), (5, 0), (6, 2), (7, 2), (7, 1), (8, 3), (10, 1), (11, 1), (12, 2), (18, 3)];
+        for &(i, value) in &changes {
+            let mut words = valid;
+            words[i] = value;
+            corrupt.push(open(&words, b"abf").unwrap_err());
+        }
+        assert!(corrupt.iter().all(|error| io::ErrorKind::InvalidData == error.kind()));
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
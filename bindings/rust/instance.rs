@@ -0,0 +1,443 @@
+//! Instantiated views of modules, as created by `INSTANCE`.
+//!
+//! `M == INSTANCE Foo WITH x <- e` views the definitions of `Foo` with each
+//! of its constants and variables replaced: `x` by `e`, and any parameter
+//! not mentioned by the symbol of the same name where the instance appears.
+//! An [InstanceCache][] holds the parsed tree of every module once and
+//! represents an instance by its substitution map alone, the expressions in
+//! it being byte ranges of the instantiating module. A [View][] of a nested
+//! instance links to the view it was reached through, so a refinement
+//! hierarchy shares every map above each instance. Maps are computed the
+//! first time a module's instances are expanded, and dropped when the
+//! module, or a module its instances' parameters come from, is replaced or
+//! removed.
+
+use crate::units::{named_children, text, top_level_modules};
+use std::collections::HashMap;
+use std::ops;
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use tree_sitter::{Node, Tree};
+
+/// The parsed modules of a workspace and the instances between them.
+#[derive(Default)]
+pub struct InstanceCache {
+    modules: HashMap<String, Module>,
+    // The modules last inserted from each file, by path.
+    files: HashMap<PathBuf, Vec<String>>,
+    // The instantiations made by each module, in source order.
+    instantiations: HashMap<String, Arc<Vec<Arc<Instantiation>>>>,
+}
+
+// A file, shared by the modules it contains.
+struct File {
+    path: PathBuf,
+    tree: Tree,
+    source: Vec<u8>,
+}
+
+struct Module {
+    file: Arc<File>,
+    extends: Vec<String>,
+    // The constants and variables the module declares itself.
+    parameters: Vec<String>,
+    instances: Vec<InstanceNode>,
+}
+
+// An `instance` node as written, before its implicit substitutions are known.
+struct InstanceNode {
+    name: Option<String>,
+    target: String,
+    range: ops::Range<usize>,
+    explicit: Vec<(String, ops::Range<usize>)>,
+}
+
+/// An instance of a module within another.
+#[derive(Debug)]
+pub struct Instantiation {
+    /// The name given by `Name == INSTANCE`, or None for a bare `INSTANCE`.
+    pub name: Option<String>,
+    /// The module containing the instance.
+    pub module: String,
+    /// The module instantiated.
+    pub target: String,
+    /// The byte range of the `instance` node in the instantiating module.
+    pub range: ops::Range<usize>,
+    // By parameter name, sorted.
+    substitutions: Vec<(String, Substitution)>,
+}
+
+/// What a parameter of an instantiated module is replaced by.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub enum Substitution {
+    /// An expression of the instantiating module, by its byte range.
+    Expression(ops::Range<usize>),
+    /// The symbol of the same name in the instantiating module.
+    Implicit,
+}
+
+impl Instantiation {
+    /// The substitution for a parameter of the instantiated module, or None
+    /// if it is not one.
+    pub fn substitution(&self, parameter: &str) -> Option<&Substitution> {
+        self.substitutions
+            .binary_search_by(|(name, _)| name.as_str().cmp(parameter))
+            .ok()
+            .map(|i| &self.substitutions[i].1)
+    }
+
+    /// The substitutions for every parameter of the instantiated module.
+    pub fn substitutions(&self) -> &[(String, Substitution)] {
+        &self.substitutions
+    }
+}
+
+/// An instantiated module, reached from a root module through a chain of
+/// instances.
+#[derive(Debug)]
+pub struct View {
+    instantiation: Arc<Instantiation>,
+    parent: Option<Arc<View>>,
+}
+
+impl View {
+    /// The instance this view is created by.
+    pub fn instantiation(&self) -> &Instantiation {
+        &self.instantiation
+    }
+
+    /// The view of the instantiating module, or None if it is the root.
+    pub fn parent(&self) -> Option<&View> {
+        self.parent.as_deref()
+    }
+
+    /// Follows a parameter of the instantiated module up through the chain
+    /// of instances to what it stands for: an expression, as the module it
+    /// is written in and its byte range, or, with no range, the symbol of
+    /// that name in the module where substitution stops. Returns None if the
+    /// name is not a parameter.
+    pub fn resolve(&self, parameter: &str) -> Option<(&str, Option<ops::Range<usize>>)> {
+        let mut view = self;
+        loop {
+            let instantiation = &view.instantiation;
+            match instantiation.substitution(parameter)? {
+                Substitution::Expression(range) => return Some((&instantiation.module, Some(range.clone()))),
+                Substitution::Implicit => match view.parent() {
+                    Some(parent) if parent.instantiation.substitution(parameter).is_some() => view = parent,
+                    _ => return Some((&instantiation.module, None)),
+                },
+            }
+        }
+    }
+}
+
+impl InstanceCache {
+    /// Creates an empty cache.
+    pub fn new() -> Self {
+        InstanceCache::default()
+    }
+
+    /// Adds the top-level modules of a parsed file, replacing any of the same
+    /// name, and returns their names. Modules the file held when last
+    /// inserted and no longer does are removed. Instances depending on a
+    /// replaced or removed module are computed again when next expanded.
+    pub fn insert(&mut self, path: impl AsRef<Path>, tree: Tree, source: Vec<u8>) -> Vec<String> {
+        let path = path.as_ref().to_path_buf();
+        let file = Arc::new(File {
+            path: path.clone(),
+            tree,
+            source,
+        });
+        let mut names = Vec::new();
+        for module in top_level_modules(&file.tree) {
+            let name = match module.child_by_field_name("name") {
+                Some(name) => text(name, &file.source),
+                None => continue,
+            };
+            let module = Module::new(Arc::clone(&file), module);
+            self.modules.insert(name.clone(), module);
+            self.invalidate(&name);
+            names.push(name);
+        }
+        let old_names = self.files.insert(path.clone(), names.clone()).unwrap_or_default();
+        for name in old_names.iter().filter(|name| !names.contains(name)) {
+            self.remove_module(&path, name);
+        }
+        names
+    }
+
+    /// Removes the modules last inserted from a file.
+    pub fn remove(&mut self, path: impl AsRef<Path>) {
+        let path = path.as_ref();
+        for name in self.files.remove(path).unwrap_or_default() {
+            self.remove_module(path, &name);
+        }
+    }
+
+    // Removes a module, unless it has since been replaced by one of the same
+    // name from another file.
+    fn remove_module(&mut self, path: &Path, name: &str) {
+        if self.modules.get(name).map_or(false, |module| module.file.path == path) {
+            self.modules.remove(name);
+            self.invalidate(name);
+        }
+    }
+
+    /// The tree and source of the file containing a module.
+    pub fn module(&self, name: &str) -> Option<(&Tree, &[u8])> {
+        self.modules
+            .get(name)
+            .map(|module| (&module.file.tree, module.file.source.as_slice()))
+    }
+
+    /// The instances made directly by a module, in source order.
+    pub fn instantiations(&mut self, module: &str) -> Arc<Vec<Arc<Instantiation>>> {
+        if let Some(instantiations) = self.instantiations.get(module) {
+            return Arc::clone(instantiations);
+        }
+        let instantiations: Vec<Arc<Instantiation>> = match self.modules.get(module) {
+            Some(instantiating) => instantiating
+                .instances
+                .iter()
+                .map(|instance| {
+                    let mut substitutions: Vec<(String, Substitution)> = self
+                        .parameters(&instance.target)
+                        .into_iter()
+                        .map(|parameter| (parameter, Substitution::Implicit))
+                        .collect();
+                    for (parameter, range) in &instance.explicit {
+                        substitutions.retain(|(name, _)| name != parameter);
+                        substitutions.push((parameter.clone(), Substitution::Expression(range.clone())));
+                    }
+                    substitutions.sort_by(|a, b| a.0.cmp(&b.0));
+                    Arc::new(Instantiation {
+                        name: instance.name.clone(),
+                        module: module.to_string(),
+                        target: instance.target.clone(),
+                        range: instance.range.clone(),
+                        substitutions,
+                    })
+                })
+                .collect(),
+            None => Vec::new(),
+        };
+        let instantiations = Arc::new(instantiations);
+        self.instantiations
+            .insert(module.to_string(), Arc::clone(&instantiations));
+        instantiations
+    }
+
+    /// Every view reachable from a root module through chains of instances,
+    /// each before the views nested in it. Instances of modules the cache
+    /// doesn't hold are included but not followed, as are instances that
+    /// would recurse.
+    pub fn expand(&mut self, root: &str) -> Vec<Arc<View>> {
+        let mut views = Vec::new();
+        let mut pending: Vec<Arc<View>> = self
+            .instantiations(root)
+            .iter()
+            .rev()
+            .map(|instantiation| {
+                Arc::new(View {
+                    instantiation: Arc::clone(instantiation),
+                    parent: None,
+                })
+            })
+            .collect();
+        while let Some(view) = pending.pop() {
+            let target = view.instantiation.target.clone();
+            let mut ancestor = Some(&*view);
+            let mut is_recursive = root == target;
+            while let Some(current) = ancestor {
+                is_recursive |= current.instantiation.module == target;
+                ancestor = current.parent();
+            }
+            if !is_recursive {
+                for instantiation in self.instantiations(&target).iter().rev() {
+                    pending.push(Arc::new(View {
+                        instantiation: Arc::clone(instantiation),
+                        parent: Some(Arc::clone(&view)),
+                    }));
+                }
+            }
+            views.push(view);
+        }
+        views
+    }
+
+    // The constants and variables of a module, including those of the
+    // modules it extends.
+    fn parameters(&self, module: &str) -> Vec<String> {
+        let mut parameters = Vec::new();
+        let mut seen = vec![module];
+        let mut i = 0;
+        while i < seen.len() {
+            if let Some(current) = self.modules.get(seen[i]) {
+                parameters.extend(current.parameters.iter().cloned());
+                for extended in &current.extends {
+                    if !seen.contains(&extended.as_str()) {
+                        seen.push(extended);
+                    }
+                }
+            }
+            i += 1;
+        }
+        parameters.sort();
+        parameters.dedup();
+        parameters
+    }
+
+    // Drops the instantiations made by a replaced module, and those of every
+    // module instantiating one whose parameters may have changed with it:
+    // the module itself and, transitively, the modules extending it.
+    fn invalidate(&mut self, module: &str) {
+        let mut changed = vec![module.to_string()];
+        let mut i = 0;
+        while i < changed.len() {
+            for (name, other) in &self.modules {
+                if other.extends.contains(&changed[i]) && !changed.contains(name) {
+                    changed.push(name.clone());
+                }
+            }
+            i += 1;
+        }
+        let modules = &self.modules;
+        self.instantiations.retain(|name, _| {
+            name != module
+                && !modules.get(name).map_or(false, |instantiating| {
+                    instantiating
+                        .instances
+                        .iter()
+                        .any(|instance| changed.contains(&instance.target))
+                })
+        });
+    }
+}
+
+impl Module {
+    fn new(file: Arc<File>, module: Node) -> Self {
+        let source = &file.source;
+        let mut extends = Vec::new();
+        let mut parameters = Vec::new();
+        let mut instances = Vec::new();
+        for i in 0..module.named_child_count() {
+            let mut unit = module.named_child(i).unwrap();
+            if "local_definition" == unit.kind() {
+                match unit.named_child(0) {
+                    Some(definition) => unit = definition,
+                    None => continue,
+                }
+            }
+            match unit.kind() {
+                "extends" => extends.extend(named_children(unit).map(|name| text(name, source))),
+                "constant_declaration" | "variable_declaration" => {
+                    for declaration in named_children(unit) {
+                        let name = match declaration.kind() {
+                            "operator_declaration" => declaration.child_by_field_name("name"),
+                            _ => Some(declaration),
+                        };
+                        parameters.extend(name.map(|name| text(name, source)));
+                    }
+                }
+                "instance" => instances.extend(InstanceNode::new(unit, None, source)),
+                "module_definition" => {
+                    let name = unit.child_by_field_name("name").map(|name| text(name, source));
+                    if let Some(instance) = unit.child_by_field_name("definition") {
+                        instances.extend(InstanceNode::new(instance, name, source));
+                    }
+                }
+                _ => {}
+            }
+        }
+        Module {
+            file: Arc::clone(&file),
+            extends,
+            parameters,
+            instances,
+        }
+    }
+}
+
+impl InstanceNode {
+    fn new(instance: Node, name: Option<String>, source: &[u8]) -> Option<Self> {
+        let target = instance.named_child(0).filter(|target| "identifier_ref" == target.kind())?;
+        let explicit = named_children(instance)
+            .filter(|child| "substitution" == child.kind())
+            .filter_map(|substitution| {
+                let parameter = substitution.named_child(0)?;
+                let expression = substitution.named_child(substitution.named_child_count() - 1)?;
+                Some((text(parameter, source), expression.byte_range()))
+            })
+            .collect();
+        Some(InstanceNode {
+            name,
+            target: text(target, source),
+            range: instance.byte_range(),
+            explicit,
+        })
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{InstanceCache, Substitution};
+    use tree_sitter::Parser;
+
+    fn insert(cache: &mut InstanceCache, path: &str, source: &str) {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(source, None).unwrap();
+        cache.insert(path, tree, source.as_bytes().to_vec());
+    }
+
+    #[test]
+    fn test_expand_hierarchy() {
+        let mut cache = InstanceCache::new();
+        let top = "---- MODULE Top ----\nVARIABLE t\nM == INSTANCE Mid WITH m <- t + 1\n====\n";
+        insert(&mut cache, "Top.tla", top);
+        insert(&mut cache, "Mid.tla", "---- MODULE Mid ----\nVARIABLE m\nINSTANCE Base\n====\n");
+        insert(&mut cache, "Base.tla", "---- MODULE Base ----\nEXTENDS Params\nVARIABLE b\n====\n");
+        insert(&mut cache, "Params.tla", "---- MODULE Params ----\nCONSTANT m\n====\n");
+
+        let views = cache.expand("Top");
+        assert_eq!(2, views.len());
+        assert_eq!(Some("M"), views[0].instantiation().name.as_deref());
+        assert_eq!("Base", views[1].instantiation().target);
+        assert_eq!(Some(&Substitution::Implicit), views[1].instantiation().substitution("b"));
+
+        // Base's m comes from Params, and is Mid's m, which is t + 1 in Top.
+        let (module, range) = views[1].resolve("m").unwrap();
+        assert_eq!(("Top", "t + 1"), (module, &top[range.unwrap()]));
+        assert_eq!(Some(("Mid", None)), views[1].resolve("b"));
+
+        // Dropping Params's m leaves Base with b alone.
+        insert(&mut cache, "Params.tla", "---- MODULE Params ----\n====\n");
+        let views = cache.expand("Top");
+        assert_eq!(None, views[1].instantiation().substitution("m"));
+
+        // Deleting Base from its file leaves its instance unexpanded.
+        insert(&mut cache, "Base.tla", "");
+        assert!(cache.module("Base").is_none());
+        let views = cache.expand("Top");
+        assert_eq!(2, views.len());
+        assert!(views[1].instantiation().substitutions().is_empty());
+    }
+
+    #[test]
+    fn test_unknown_and_recursive_instances() {
+        let mut cache = InstanceCache::new();
+        let a = "---- MODULE A ----\nLOCAL INSTANCE B\nX == INSTANCE Missing WITH c <- 1\n====\n";
+        insert(&mut cache, "A.tla", a);
+        insert(&mut cache, "B.tla", "---- MODULE B ----\nINSTANCE A\n====\n");
+
+        let targets: Vec<_> = cache
+            .expand("A")
+            .iter()
+            .map(|view| view.instantiation().target.clone())
+            .collect();
+        assert_eq!(vec!["B", "A", "Missing"], targets);
+        let one = a.find('1').unwrap();
+        assert_eq!(Some(("A", Some(one..one + 1))), cache.expand("A")[2].resolve("c"));
+        assert_eq!(None, cache.expand("A")[2].resolve("d"));
+    }
+}
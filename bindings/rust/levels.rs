@@ -0,0 +1,535 @@
+//! Levels of expressions, kept up to date across edits.
+//!
+//! Every TLA+ expression is of constant, state, action or temporal level:
+//! the highest level of what it is built from, raised by priming and
+//! `UNCHANGED` to action, and by `[]`, `<>`, `~>`, fairness and temporal
+//! quantification to temporal. [Levels][] computes the level of every
+//! expression bottom-up, and reports the combinations TLA+ rules out, such
+//! as priming an action or `[]` of an action that isn't `[A]_v`.
+//!
+//! Declared variables are of state level, and constants, parameters and
+//! bound variables of constant level, except for `\EE` and `\AA`, which
+//! bind variables. An operator applied is of the level of its body, taken
+//! with its parameters as constants, or of its arguments if higher; names
+//! defined in other modules are taken as constants.
+//!
+//! Each module-level unit is evaluated on its own, and remembers the levels
+//! it saw for the module-level names it refers to. After an edit,
+//! [Levels::update][] evaluates again the units overlapping the edits and
+//! tree-sitter's changed ranges, and those referring to a name whose level
+//! has changed as a result, in source order, so a change propagates to its
+//! dependents and no further.
+
+use crate::units::{
+    edit_range, named_children, text, top_level_modules, units_of, CachedUnit, Edits, UnitCache, UnitKey,
+};
+use std::collections::HashMap;
+use std::ops;
+use tree_sitter::{InputEdit, Node, Range, Tree};
+
+/// The level of an expression.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub enum Level {
+    Constant,
+    State,
+    Action,
+    Temporal,
+}
+
+/// An expression combining levels in a way TLA+ doesn't allow.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct LevelError {
+    pub range: Range,
+    pub message: &'static str,
+}
+
+/// The levels of the expressions of a tree.
+pub struct Levels {
+    // The units of each top-level module, in source order.
+    modules: Vec<Vec<Unit>>,
+    edited: Edits,
+    // The levels of the module-level names of all modules.
+    names: HashMap<String, Level>,
+}
+
+struct Unit {
+    kind_id: u16,
+    range: Range,
+    // The module-level names the unit declares or defines.
+    defines: Vec<(String, Level)>,
+    // The module-level names the unit refers to, with their levels when it
+    // was evaluated.
+    inputs: Vec<(String, Level)>,
+    // The expressions above constant level, by start and end byte relative
+    // to the unit and kind.
+    nodes: Vec<(u32, u32, u16, Level)>,
+    errors: Vec<LevelError>,
+}
+
+// Nodes binding the identifiers among their children, or in their
+// quantifier bounds, as constants.
+const BINDER_KINDS: [&str; 10] = [
+    "operator_definition",
+    "function_definition",
+    "module_definition",
+    "lambda",
+    "bounded_quantification",
+    "unbounded_quantification",
+    "choose",
+    "set_filter",
+    "set_map",
+    "function_literal",
+];
+
+impl Levels {
+    /// Computes the levels of the expressions of all modules of a tree.
+    pub fn new(tree: &Tree, source: &[u8]) -> Self {
+        let mut levels = Levels {
+            modules: Vec::new(),
+            edited: Edits::new(),
+            names: HashMap::new(),
+        };
+        let root = tree.root_node();
+        levels.rebuild(tree, source, &[root.byte_range()]);
+        levels
+    }
+
+    /// The level of an expression, or None if it isn't part of a
+    /// module-level unit.
+    pub fn level(&self, node: Node) -> Option<Level> {
+        let units = self.modules.iter().find(|units| {
+            units.first().map_or(false, |unit| unit.range.start_byte <= node.start_byte())
+                && units.last().map_or(false, |unit| node.end_byte() <= unit.range.end_byte)
+        })?;
+        let i = units.partition_point(|unit| unit.range.end_byte < node.end_byte());
+        let unit = units.get(i).filter(|unit| unit.range.start_byte <= node.start_byte())?;
+        let start = (node.start_byte() - unit.range.start_byte) as u32;
+        let end = (node.end_byte() - unit.range.start_byte) as u32;
+        let key = (start, end, node.kind_id());
+        Some(
+            match unit.nodes.binary_search_by(|&(start, end, kind_id, _)| (start, end, kind_id).cmp(&key)) {
+                Ok(i) => unit.nodes[i].3,
+                Err(_) => Level::Constant,
+            },
+        )
+    }
+
+    /// The level of a module-level definition or declaration.
+    pub fn definition(&self, name: &str) -> Option<Level> {
+        self.names.get(name).copied()
+    }
+
+    /// The level errors of all modules, in source order.
+    pub fn errors(&self) -> Vec<&LevelError> {
+        self.modules
+            .iter()
+            .flatten()
+            .flat_map(|unit| &unit.errors)
+            .collect()
+    }
+
+    /// Shifts all positions for an edit, and remembers its range to evaluate
+    /// again on the next [Levels::update][].
+    pub fn edit(&mut self, edit: &InputEdit) {
+        for unit in self.modules.iter_mut().flatten() {
+            edit_range(&mut unit.range, edit);
+            for error in &mut unit.errors {
+                edit_range(&mut error.range, edit);
+            }
+        }
+        self.edited.edit(edit);
+    }
+
+    /// Brings the levels up to date with a tree reparsed after the edits
+    /// passed to [Levels::edit][]. `old_tree` is the edited tree that was
+    /// passed to the parser. Only units overlapping an edit or a changed
+    /// range, or depending on a name whose level changed, are evaluated.
+    pub fn update(&mut self, old_tree: &Tree, new_tree: &Tree, source: &[u8]) {
+        let dirty = self.edited.dirty(old_tree, new_tree);
+        if !dirty.is_empty() {
+            self.rebuild(new_tree, source, &dirty);
+        }
+    }
+
+    fn rebuild(&mut self, tree: &Tree, source: &[u8], dirty: &[ops::Range<usize>]) {
+        let mut cached = UnitCache::new(self.modules.drain(..).flatten(), dirty);
+        self.names.clear();
+        for module in top_level_modules(tree) {
+            let mut names = HashMap::new();
+            let mut units = Vec::new();
+            for node in units_of(module) {
+                let unit = cached
+                    .reuse_if(node, |unit| unit.is_current(&names))
+                    .unwrap_or_else(|| Unit::evaluate(node, source, &names));
+                names.extend(unit.defines.iter().cloned());
+                units.push(unit);
+            }
+            self.names.extend(names);
+            self.modules.push(units);
+        }
+    }
+}
+
+impl CachedUnit for Unit {
+    fn key(&self) -> UnitKey {
+        (self.kind_id, self.range.start_byte, self.range.end_byte)
+    }
+}
+
+impl Unit {
+    fn evaluate(node: Node, source: &[u8], names: &HashMap<String, Level>) -> Self {
+        let mut evaluator = Evaluator {
+            source,
+            names,
+            start: node.start_byte(),
+            scopes: vec![HashMap::new()],
+            values: Vec::new(),
+            inputs: Vec::new(),
+            nodes: Vec::new(),
+            errors: Vec::new(),
+        };
+        let level = evaluator.evaluate(node);
+
+        let mut definition = node;
+        if "local_definition" == node.kind() {
+            definition = node.named_child(0).unwrap_or(node);
+        }
+        let mut defines = Vec::new();
+        match definition.kind() {
+            "variable_declaration" | "constant_declaration" | "recursive_declaration" => {
+                let level = match definition.kind() {
+                    "variable_declaration" => Level::State,
+                    _ => Level::Constant,
+                };
+                for declaration in named_children(definition) {
+                    if let Some(name) = declared_name(declaration) {
+                        defines.push((text(name, source), level));
+                    }
+                }
+            }
+            "operator_definition" | "function_definition" | "module_definition" => {
+                if let Some(name) = definition.child_by_field_name("name") {
+                    defines.push((text(name, source), level));
+                }
+            }
+            "assumption" if level > Level::Constant => evaluator.errors.push(LevelError {
+                range: node.range(),
+                message: "assumption is not a constant expression",
+            }),
+            _ => {}
+        }
+
+        let Evaluator {
+            mut inputs,
+            mut nodes,
+            errors,
+            ..
+        } = evaluator;
+        inputs.sort();
+        inputs.dedup();
+        nodes.sort();
+        nodes.dedup_by_key(|&mut (start, end, kind_id, _)| (start, end, kind_id));
+        Unit {
+            kind_id: node.kind_id(),
+            range: node.range(),
+            defines,
+            inputs,
+            nodes,
+            errors,
+        }
+    }
+
+    // Whether the module-level names the unit refers to still have the
+    // levels it was evaluated with.
+    fn is_current(&self, names: &HashMap<String, Level>) -> bool {
+        self.inputs
+            .iter()
+            .all(|(name, level)| names.get(name).copied().unwrap_or(Level::Constant) == *level)
+    }
+}
+
+struct Evaluator<'a> {
+    source: &'a [u8],
+    // The levels of the module-level names before the unit.
+    names: &'a HashMap<String, Level>,
+    start: usize,
+    // The names bound by enclosing nodes, innermost last.
+    scopes: Vec<HashMap<String, Level>>,
+    // The levels of the children evaluated so far of the nodes being
+    // evaluated.
+    values: Vec<Level>,
+    inputs: Vec<(String, Level)>,
+    nodes: Vec<(u32, u32, u16, Level)>,
+    errors: Vec<LevelError>,
+}
+
+impl Evaluator<'_> {
+    // Evaluates a node and everything in it, children before their parents
+    // and with no recursion, as expressions nest arbitrarily deep.
+    fn evaluate(&mut self, root: Node) -> Level {
+        // Each node being evaluated, the index of its next child, where its
+        // children's levels start in `values`, and whether it opened a scope.
+        let mut stack = vec![(root, 0, 0, self.enter(root))];
+        loop {
+            let (node, next, _, _) = stack.last_mut().unwrap();
+            if *next < node.named_child_count() {
+                let child = node.named_child(*next).unwrap();
+                *next += 1;
+                let is_scope = self.enter(child);
+                stack.push((child, 0, self.values.len(), is_scope));
+                continue;
+            }
+            let (node, _, first, is_scope) = stack.pop().unwrap();
+            if is_scope {
+                self.scopes.pop();
+            }
+            let level = self.level(node, first);
+            self.values.truncate(first);
+            if level > Level::Constant {
+                let start = (node.start_byte() - self.start) as u32;
+                let end = (node.end_byte() - self.start) as u32;
+                self.nodes.push((start, end, node.kind_id(), level));
+            }
+            if stack.is_empty() {
+                return level;
+            }
+            self.values.push(level);
+        }
+    }
+
+    // Opens a scope for the names a node binds, if any.
+    fn enter(&mut self, node: Node) -> bool {
+        let kind = node.kind();
+        if "let_in" == kind {
+            self.scopes.push(HashMap::new());
+            return true;
+        }
+        if !BINDER_KINDS.contains(&kind) {
+            return false;
+        }
+        let level = match node.child_by_field_name("quantifier").map(|quantifier| quantifier.kind()) {
+            Some("temporal_forall") | Some("temporal_exists") => Level::State,
+            _ => Level::Constant,
+        };
+        let mut scope = HashMap::new();
+        let name = node.child_by_field_name("name");
+        for child in named_children(node).filter(|child| Some(*child) != name) {
+            let bound = match child.kind() {
+                "quantifier_bound" | "single_quantifier_bound" | "tuple_of_identifiers" => named_children(child)
+                    .flat_map(|child| match child.kind() {
+                        "tuple_of_identifiers" => named_children(child).collect(),
+                        _ => vec![child],
+                    })
+                    .collect(),
+                _ => vec![child],
+            };
+            for name in bound.into_iter().filter_map(declared_name) {
+                scope.insert(text(name, self.source), level);
+            }
+        }
+        self.scopes.push(scope);
+        true
+    }
+
+    // The level of a node whose children's levels are `values[first..]`.
+    fn level(&mut self, node: Node, first: usize) -> Level {
+        let children = &self.values[first..];
+        let highest = children.iter().copied().max().unwrap_or(Level::Constant);
+        let operand = |field: &str| {
+            node.child_by_field_name(field)
+                .and_then(|child| named_children(node).position(|other| other == child))
+                .map_or(Level::Constant, |i| children[i])
+        };
+        let symbol = node.child_by_field_name("symbol").map_or("", |symbol| symbol.kind());
+        let (level, error) = match node.kind() {
+            "identifier_ref" => {
+                let name = text(node, self.source);
+                let level = match self.scopes.iter().rev().find_map(|scope| scope.get(&name)) {
+                    Some(level) => *level,
+                    None => {
+                        let level = self.names.get(&name).copied().unwrap_or(Level::Constant);
+                        self.inputs.push((name, level));
+                        level
+                    }
+                };
+                (level, None)
+            }
+            "bound_postfix_op" if "prime" == symbol => (
+                Level::Action,
+                Some("primed expression is already of action level").filter(|_| operand("lhs") >= Level::Action),
+            ),
+            "bound_prefix_op" => {
+                let rhs = operand("rhs");
+                let is_step = node
+                    .child_by_field_name("rhs")
+                    .map_or(false, |rhs| rhs.kind().starts_with("step_expr_"));
+                match symbol {
+                    "unchanged" => (Level::Action, Some("UNCHANGED of an action").filter(|_| rhs >= Level::Action)),
+                    "enabled" => (Level::State, Some("ENABLED of a temporal formula").filter(|_| rhs == Level::Temporal)),
+                    "always" | "eventually" => (
+                        Level::Temporal,
+                        Some("[] or <> of an action that isn't [A]_v or <<A>>_v")
+                            .filter(|_| rhs == Level::Action && !is_step),
+                    ),
+                    _ => (highest, None),
+                }
+            }
+            "bound_infix_op" => {
+                let (lhs, rhs) = (operand("lhs"), operand("rhs"));
+                let is_mixed = lhs.max(rhs) == Level::Temporal && lhs.min(rhs) == Level::Action;
+                match symbol {
+                    "leads_to" | "plus_arrow" => (Level::Temporal, None),
+                    "cdot" => (
+                        Level::Action,
+                        Some("\\cdot of a temporal formula").filter(|_| highest == Level::Temporal),
+                    ),
+                    _ => (highest, Some("action and temporal formulas combined").filter(|_| is_mixed)),
+                }
+            }
+            "conj_list" | "disj_list" => {
+                let is_mixed = highest == Level::Temporal && children.contains(&Level::Action);
+                (highest, Some("action and temporal formulas combined").filter(|_| is_mixed))
+            }
+            "step_expr_or_stutter" | "step_expr_no_stutter" => (
+                Level::Action,
+                Some("[A]_v or <<A>>_v of a temporal formula").filter(|_| highest == Level::Temporal),
+            ),
+            "fairness" => (
+                Level::Temporal,
+                Some("fairness of a temporal formula").filter(|_| children.last() == Some(&Level::Temporal)),
+            ),
+            "unbounded_quantification"
+                if matches!(
+                    node.child_by_field_name("quantifier").map(|quantifier| quantifier.kind()),
+                    Some("temporal_forall") | Some("temporal_exists")
+                ) =>
+            {
+                (Level::Temporal, None)
+            }
+            "new" => {
+                let level = named_children(node)
+                    .find(|child| "level" == child.kind())
+                    .map_or(Level::Constant, |level| match &self.source[level.byte_range()] {
+                        b"VARIABLE" | b"STATE" => Level::State,
+                        b"ACTION" => Level::Action,
+                        b"TEMPORAL" => Level::Temporal,
+                        _ => Level::Constant,
+                    });
+                if let Some(name) = named_children(node).find_map(declared_name) {
+                    let name = text(name, self.source);
+                    self.scopes.last_mut().unwrap().insert(name, level);
+                }
+                (Level::Constant, None)
+            }
+            "operator_definition" | "function_definition" | "module_definition" => {
+                // Nested in a LET, whose scope it is then added to.
+                if let Some(name) = node.child_by_field_name("name") {
+                    if self.scopes.len() > 1 {
+                        let name = text(name, self.source);
+                        self.scopes.last_mut().unwrap().insert(name, highest);
+                    }
+                }
+                (highest, None)
+            }
+            _ => (highest, None),
+        };
+        if let Some(message) = error {
+            self.errors.push(LevelError {
+                range: node.range(),
+                message,
+            });
+        }
+        level
+    }
+}
+
+// The name an identifier or operator declaration declares.
+fn declared_name(node: Node) -> Option<Node> {
+    match node.kind() {
+        "identifier" => Some(node),
+        "operator_declaration" => node.child_by_field_name("name"),
+        _ => None,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Level, Levels};
+    use crate::units::reparse;
+    use tree_sitter::Parser;
+
+    const SOURCE: &str = concat!(
+        "---- MODULE Test ----\n",
+        "CONSTANT N\n",
+        "VARIABLE x\n",
+        "Const == N + 1\n",
+        "State == x + Const\n",
+        "Act == x' = State /\\ UNCHANGED N\n",
+        "Spec == State = 0 /\\ [][Act]_x /\\ WF_x(Act)\n",
+        "Live == LET P == x > 0 IN P ~> \\A n \\in Nat : n = N\n",
+        "Hidden == \\EE y : y' = x\n",
+        "Primed == (x')'\n",
+        "Boxed == []Act\n",
+        "Mixed == Act /\\ Spec\n",
+        "Listed ==\n  /\\ Act\n  /\\ Spec\n",
+        "ASSUME x > 0\n",
+        "====\n",
+    );
+
+    fn messages(levels: &Levels) -> Vec<&str> {
+        levels.errors().iter().map(|error| error.message).collect()
+    }
+
+    #[test]
+    fn test_levels() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(SOURCE, None).unwrap();
+        let levels = Levels::new(&tree, SOURCE.as_bytes());
+
+        assert_eq!(Some(Level::Constant), levels.definition("Const"));
+        assert_eq!(Some(Level::State), levels.definition("State"));
+        assert_eq!(Some(Level::Action), levels.definition("Act"));
+        assert_eq!(Some(Level::Temporal), levels.definition("Spec"));
+        assert_eq!(Some(Level::Temporal), levels.definition("Live"));
+        assert_eq!(Some(Level::Temporal), levels.definition("Hidden"));
+        assert_eq!(
+            vec![
+                "primed expression is already of action level",
+                "[] or <> of an action that isn't [A]_v or <<A>>_v",
+                "action and temporal formulas combined",
+                "action and temporal formulas combined",
+                "assumption is not a constant expression",
+            ],
+            messages(&levels)
+        );
+
+        let start = SOURCE.find("x' = State").unwrap();
+        let node = tree.root_node().descendant_for_byte_range(start, start + 2).unwrap();
+        assert_eq!("bound_postfix_op", node.kind());
+        assert_eq!(Some(Level::Action), levels.level(node));
+    }
+
+    #[test]
+    fn test_update_propagates_to_dependents() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let mut tree = parser.parse(SOURCE, None).unwrap();
+        let mut levels = Levels::new(&tree, SOURCE.as_bytes());
+
+        // Making x a constant lowers everything defined from it.
+        let start = SOURCE.find("VARIABLE").unwrap();
+        let (source, edit, new_tree) =
+            reparse(&mut parser, &mut tree, SOURCE, start..start + "VARIABLE".len(), "CONSTANT");
+        levels.edit(&edit);
+        levels.update(&tree, &new_tree, source.as_bytes());
+
+        let fresh = Levels::new(&new_tree, source.as_bytes());
+        assert_eq!(Some(Level::Constant), levels.definition("State"));
+        for name in &["Const", "State", "Act", "Spec", "Live", "Hidden", "Primed", "Boxed", "Mixed", "Listed"] {
+            assert_eq!(fresh.definition(name), levels.definition(name), "{}", name);
+        }
+        assert_eq!(fresh.errors(), levels.errors());
+        assert_eq!(messages(&fresh).len(), 4);
+    }
+}
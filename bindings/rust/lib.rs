@@ -17,6 +17,28 @@
 
 use tree_sitter::Language;
 
+pub mod bundle;
+pub mod diagnostics;
+pub mod diff;
+pub mod folds;
+pub mod format;
+pub mod fragment;
+pub mod highlight;
+pub mod index;
+pub mod instance;
+pub mod levels;
+#[cfg(unix)]
+pub mod mapped;
+pub mod metrics;
+mod parallel;
+pub mod pluscal;
+pub mod proofs;
+pub mod search;
+pub mod stats;
+pub mod subexpr;
+pub mod unicode;
+mod units;
+
 extern "C" {
     fn tree_sitter_tlaplus() -> Language;
 }
@@ -33,9 +55,11 @@ pub fn language() -> Language {
 /// [`node-types.json`]: https://tree-sitter.github.io/tree-sitter/using-parsers#static-node-types
 pub const NODE_TYPES: &'static str = include_str!("../../src/node-types.json");
 
+/// The syntax highlighting query for this language.
+pub const HIGHLIGHTS_QUERY: &'static str = include_str!("../../queries/highlights.scm");
+
 // Uncomment these to include any queries that this grammar contains
 
-// pub const HIGHLIGHTS_QUERY: &'static str = include_str!("../../queries/highlights.scm");
 // pub const INJECTIONS_QUERY: &'static str = include_str!("../../queries/injections.scm");
 // pub const LOCALS_QUERY: &'static str = include_str!("../../queries/locals.scm");
 // pub const TAGS_QUERY: &'static str = include_str!("../../queries/tags.scm");
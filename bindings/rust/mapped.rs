@@ -0,0 +1,204 @@
+//! Zero-copy parsing of memory-mapped files.
+//!
+//! Generated specs and trace dumps can run to gigabytes. Rather than reading
+//! such a file into a string before parsing, [MappedFile][] maps it into
+//! memory and [parse_mapped][] feeds it to the parser in page-aligned chunks
+//! straight out of the mapping. Pages the parser has moved well past are
+//! handed back to the kernel as it goes, so peak resident memory stays close
+//! to the size of the tree rather than the tree plus the source.
+
+use std::fs::File;
+use std::io;
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use std::ptr;
+use std::slice;
+use tree_sitter::{Parser, Tree};
+
+// Size of the chunks handed to the parser; a multiple of every common page size.
+const CHUNK_SIZE: usize = 64 * 1024;
+
+// How far behind the furthest chunk read the parser may return to before the
+// pages it left behind are released. Tree-sitter almost always reads forward
+// but re-reads a little when it backtracks to re-lex tokens.
+const RETAINED_SIZE: usize = 64 * CHUNK_SIZE;
+
+// The longest UTF-8 encoding of a character.
+const MAX_CHARACTER_SIZE: usize = 4;
+
+/// A read-only memory mapping of an entire file.
+pub struct MappedFile {
+    data: *const u8,
+    len: usize,
+}
+
+// The mapping is read-only and owned, so it is safe to share across threads.
+unsafe impl Send for MappedFile {}
+unsafe impl Sync for MappedFile {}
+
+impl MappedFile {
+    /// Maps the file at the given path into memory.
+    ///
+    /// # Safety
+    ///
+    /// The mapping is not a copy of the file. If the file is written to while
+    /// it is mapped, the bytes behind [MappedFile::as_bytes][] change under a
+    /// shared reference, and if it is truncated, reading past its new end
+    /// raises SIGBUS. The caller must ensure that nothing modifies or
+    /// truncates the file until the mapping is dropped.
+    pub unsafe fn open(path: impl AsRef<Path>) -> io::Result<Self> {
+        let file = File::open(path)?;
+        let len = file.metadata()?.len() as usize;
+        if 0 == len {
+            // Zero-length mappings are not allowed.
+            return Ok(MappedFile {
+                data: ptr::NonNull::dangling().as_ptr(),
+                len,
+            });
+        }
+
+        let data = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_PRIVATE,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if libc::MAP_FAILED == data {
+            return Err(io::Error::last_os_error());
+        }
+
+        unsafe {
+            libc::madvise(data, len, libc::MADV_SEQUENTIAL);
+        }
+
+        Ok(MappedFile {
+            data: data as *const u8,
+            len,
+        })
+    }
+
+    /// The contents of the file.
+    pub fn as_bytes(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.data, self.len) }
+    }
+
+    /// Hints that the given byte range will not be needed soon, dropping its
+    /// pages from resident memory. The contents remain readable; they are
+    /// simply faulted back in from the file if accessed again.
+    pub fn release(&self, start: usize, end: usize) {
+        let page_size = page_size();
+        let start = (start + page_size - 1) / page_size * page_size;
+        let end = end.min(self.len) / page_size * page_size;
+        if start < end {
+            unsafe {
+                libc::madvise(
+                    self.data.add(start) as *mut libc::c_void,
+                    end - start,
+                    libc::MADV_DONTNEED,
+                );
+            }
+        }
+    }
+}
+
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        if self.len > 0 {
+            unsafe {
+                libc::munmap(self.data as *mut libc::c_void, self.len);
+            }
+        }
+    }
+}
+
+/// Parses a memory-mapped file without copying it. The parser reads the
+/// mapping through its input callback in chunks ending on page boundaries,
+/// and pages far behind the parser's furthest read are released.
+pub fn parse_mapped(parser: &mut Parser, file: &MappedFile, old_tree: Option<&Tree>) -> Option<Tree> {
+    let bytes = file.as_bytes();
+    let mut released_end = 0;
+    let mut furthest_read = 0;
+    parser.parse_with(
+        &mut |offset, _| {
+            if offset >= bytes.len() {
+                return &[] as &[u8];
+            }
+
+            let chunk_end = chunk_end(offset, bytes.len());
+            if chunk_end > furthest_read {
+                furthest_read = chunk_end;
+                let retained_start = furthest_read.saturating_sub(RETAINED_SIZE);
+                if retained_start > released_end + RETAINED_SIZE {
+                    file.release(released_end, retained_start);
+                    released_end = retained_start;
+                }
+            }
+
+            &bytes[offset..chunk_end]
+        },
+        old_tree,
+    )
+}
+
+// The end of the chunk read from an offset: the next chunk boundary, or the
+// one after if that would leave too few bytes for the lexer to decode a
+// UTF-8 character straddling the boundary. Tree-sitter asks again from the
+// same offset when a chunk ends within a character, and would otherwise get
+// the same truncated chunk back and decode it as U+FFFD.
+fn chunk_end(offset: usize, len: usize) -> usize {
+    let mut end = (offset / CHUNK_SIZE + 1) * CHUNK_SIZE;
+    if end - offset < MAX_CHARACTER_SIZE {
+        end += CHUNK_SIZE;
+    }
+    end.min(len)
+}
+
+fn page_size() -> usize {
+    unsafe { libc::sysconf(libc::_SC_PAGESIZE) as usize }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{chunk_end, parse_mapped, MappedFile, CHUNK_SIZE};
+    use std::fs;
+    use tree_sitter::Parser;
+
+    #[test]
+    fn test_map_file() {
+        let path = std::env::temp_dir().join("tree-sitter-tlaplus-test-map-file.tla");
+        fs::write(&path, "---- MODULE Test ----\n====\n").unwrap();
+        let file = unsafe { MappedFile::open(&path) }.unwrap();
+        assert_eq!(file.as_bytes(), b"---- MODULE Test ----\n====\n");
+        file.release(0, file.as_bytes().len());
+        assert_eq!(file.as_bytes(), b"---- MODULE Test ----\n====\n");
+        drop(file);
+        fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn test_character_straddling_chunks() {
+        assert_eq!(CHUNK_SIZE, chunk_end(0, 3 * CHUNK_SIZE));
+        assert_eq!(2 * CHUNK_SIZE, chunk_end(CHUNK_SIZE - 3, 3 * CHUNK_SIZE));
+        assert_eq!(CHUNK_SIZE + 5, chunk_end(CHUNK_SIZE - 1, CHUNK_SIZE + 5));
+
+        let mut source = String::from("---- MODULE Test ----\nOp == x");
+        while source.len() < CHUNK_SIZE - 1 {
+            source.push(' ');
+        }
+        source += "\u{2208} S\n====\n";
+        let path = std::env::temp_dir().join("tree-sitter-tlaplus-test-straddling-chunks.tla");
+        fs::write(&path, &source).unwrap();
+        let file = unsafe { MappedFile::open(&path) }.unwrap();
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parse_mapped(&mut parser, &file, None).unwrap();
+        assert!(!tree.root_node().has_error());
+        assert!(tree.root_node().to_sexp().contains("(set_in)"));
+        drop(file);
+        fs::remove_file(&path).unwrap();
+    }
+}
@@ -0,0 +1,287 @@
+//! Size and complexity metrics of specs.
+//!
+//! [Metrics::new][] takes everything it reports from one walk of a tree
+//! cursor. Each node is classified by a lookup of its kind id in a table
+//! built once from the language, so the walk neither compares kind names
+//! nor keeps any node past the step that visits it; depths are tracked as
+//! the cursor enters and leaves nodes. [collect][] parses and measures
+//! files in parallel, for corpora of specs, and [Metrics::to_json_line][]
+//! writes the result of one file as a line of JSON.
+
+use crate::parallel;
+use std::fs;
+use std::io;
+use std::ops;
+use std::path::Path;
+use tree_sitter::{Language, Parser, Tree};
+
+/// Size and complexity metrics of a spec.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct Metrics {
+    /// Bytes of source.
+    pub bytes: usize,
+    /// Lines holding anything other than whitespace, outside the text
+    /// around modules.
+    pub lines: usize,
+    /// Modules, including nested ones.
+    pub modules: usize,
+    /// Operator definitions, including local ones and those in LET and
+    /// proof steps.
+    pub operators: usize,
+    /// Function definitions.
+    pub functions: usize,
+    /// Theorems and other named or unnamed assertions.
+    pub theorems: usize,
+    /// Proof steps at each level, the first counting those directly under
+    /// a theorem. QED steps are included.
+    pub proof_steps: Vec<usize>,
+    /// Largest number of nested conjunction and disjunction lists.
+    pub max_jlist_depth: usize,
+    /// Largest number of nested quantifiers and CHOOSE expressions.
+    pub max_quantifier_depth: usize,
+    /// Whether the tree has syntax errors.
+    pub has_error: bool,
+}
+
+// What a node of some kind contributes to the metrics.
+#[derive(Clone, Copy, PartialEq, Eq)]
+enum Class {
+    Other,
+    Module,
+    Operator,
+    Function,
+    Theorem,
+    Jlist,
+    Quantifier,
+    Proof,
+    Step,
+    Extramodular,
+}
+
+// The class of every kind of the language, by kind id. Aliased kinds have
+// several ids and each of them gets an entry.
+fn classes(language: Language) -> Vec<Class> {
+    (0..language.node_kind_count() as u16)
+        .map(|id| match language.node_kind_for_id(id) {
+            Some("module") => Class::Module,
+            Some("operator_definition") => Class::Operator,
+            Some("function_definition") => Class::Function,
+            Some("theorem") => Class::Theorem,
+            Some("conj_list") | Some("disj_list") => Class::Jlist,
+            Some("bounded_quantification") | Some("unbounded_quantification") | Some("choose") => {
+                Class::Quantifier
+            }
+            Some("non_terminal_proof") => Class::Proof,
+            Some("proof_step") | Some("qed_step") => Class::Step,
+            Some("extramodular_text") => Class::Extramodular,
+            _ => Class::Other,
+        })
+        .collect()
+}
+
+impl Metrics {
+    /// Measures a tree and the source it was parsed from.
+    pub fn new(tree: &Tree, source: &[u8]) -> Self {
+        let classes = classes(tree.language());
+        let mut metrics = Metrics {
+            bytes: source.len(),
+            has_error: tree.root_node().has_error(),
+            ..Metrics::default()
+        };
+        let (mut jlist_depth, mut quantifier_depth, mut proof_depth) = (0, 0, 0);
+        // Byte ranges of extramodular text, in source order.
+        let mut excluded = Vec::new();
+        let mut cursor = tree.walk();
+        loop {
+            let node = cursor.node();
+            let class = classes.get(node.kind_id() as usize).copied().unwrap_or(Class::Other);
+            match class {
+                Class::Module => metrics.modules += 1,
+                Class::Operator => metrics.operators += 1,
+                Class::Function => metrics.functions += 1,
+                Class::Theorem => metrics.theorems += 1,
+                Class::Jlist => {
+                    jlist_depth += 1;
+                    metrics.max_jlist_depth = metrics.max_jlist_depth.max(jlist_depth);
+                }
+                Class::Quantifier => {
+                    quantifier_depth += 1;
+                    metrics.max_quantifier_depth = metrics.max_quantifier_depth.max(quantifier_depth);
+                }
+                Class::Proof => proof_depth += 1,
+                Class::Step if proof_depth > 0 => {
+                    if metrics.proof_steps.len() < proof_depth {
+                        metrics.proof_steps.resize(proof_depth, 0);
+                    }
+                    metrics.proof_steps[proof_depth - 1] += 1;
+                }
+                Class::Extramodular => excluded.push(node.byte_range()),
+                _ => {}
+            }
+            if cursor.goto_first_child() {
+                continue;
+            }
+            loop {
+                match classes.get(cursor.node().kind_id() as usize) {
+                    Some(Class::Jlist) => jlist_depth -= 1,
+                    Some(Class::Quantifier) => quantifier_depth -= 1,
+                    Some(Class::Proof) => proof_depth -= 1,
+                    _ => {}
+                }
+                if cursor.goto_next_sibling() {
+                    break;
+                }
+                if !cursor.goto_parent() {
+                    metrics.lines = count_lines(source, &excluded);
+                    return metrics;
+                }
+            }
+        }
+    }
+
+    /// The metrics as a single line of JSON, without a line terminator,
+    /// labelled with the path of the file they were taken from.
+    pub fn to_json_line(&self, path: &Path) -> String {
+        let proof_steps: Vec<String> = self.proof_steps.iter().map(|count| count.to_string()).collect();
+        format!(
+            "{{\"path\":{},\"bytes\":{},\"lines\":{},\"modules\":{},\"operators\":{},\"functions\":{},\
+             \"theorems\":{},\"proof_steps\":[{}],\"max_jlist_depth\":{},\"max_quantifier_depth\":{},\
+             \"has_error\":{}}}",
+            json_string(&path.to_string_lossy()),
+            self.bytes,
+            self.lines,
+            self.modules,
+            self.operators,
+            self.functions,
+            self.theorems,
+            proof_steps.join(","),
+            self.max_jlist_depth,
+            self.max_quantifier_depth,
+            self.has_error
+        )
+    }
+}
+
+// Counts the lines holding a byte other than whitespace outside the given
+// ranges, which are sorted and disjoint.
+fn count_lines(source: &[u8], excluded: &[ops::Range<usize>]) -> usize {
+    let mut lines = 0;
+    let mut is_blank = true;
+    let mut next = 0;
+    let mut i = 0;
+    while i < source.len() {
+        if next < excluded.len() && excluded[next].start <= i {
+            i = i.max(excluded[next].end);
+            next += 1;
+            continue;
+        }
+        if b'\n' == source[i] {
+            if !is_blank {
+                lines += 1;
+            }
+            is_blank = true;
+        } else if !source[i].is_ascii_whitespace() {
+            is_blank = false;
+        }
+        i += 1;
+    }
+    lines + if is_blank { 0 } else { 1 }
+}
+
+// Quotes and escapes a string as JSON.
+fn json_string(text: &str) -> String {
+    let mut quoted = String::with_capacity(text.len() + 2);
+    quoted.push('"');
+    for c in text.chars() {
+        match c {
+            '"' => quoted.push_str("\\\""),
+            '\\' => quoted.push_str("\\\\"),
+            '\n' => quoted.push_str("\\n"),
+            '\r' => quoted.push_str("\\r"),
+            '\t' => quoted.push_str("\\t"),
+            c if (c as u32) < 0x20 => quoted.push_str(&format!("\\u{:04x}", c as u32)),
+            c => quoted.push(c),
+        }
+    }
+    quoted.push('"');
+    quoted
+}
+
+/// Reads, parses and measures the files at the given paths, in parallel,
+/// returning their metrics in the order of the paths.
+pub fn collect<P: AsRef<Path> + Sync>(paths: &[P]) -> Vec<io::Result<Metrics>> {
+    let new_parser = || {
+        let mut parser = Parser::new();
+        parser
+            .set_language(crate::language())
+            .expect("Error loading tlaplus grammar");
+        parser
+    };
+    parallel::map(paths, new_parser, |parser, path| {
+        let source = fs::read(path)?;
+        let tree = parser
+            .parse(&source, None)
+            .ok_or_else(|| io::Error::new(io::ErrorKind::Other, "parse cancelled"))?;
+        Ok(Metrics::new(&tree, &source))
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{count_lines, json_string, Metrics};
+    use std::path::Path;
+    use tree_sitter::Parser;
+
+    #[test]
+    fn test_count_lines_and_json() {
+        let source = b"Text before\n---- MODULE M ----\n\n  x == 1\n====\nand after";
+        assert_eq!(5, count_lines(source, &[]));
+        assert_eq!(3, count_lines(source, &[0..12, 46..source.len()]));
+        assert_eq!("\"a\\\"b\\\\c\\u0001\"", json_string("a\"b\\c\u{1}"));
+        let metrics = Metrics {
+            bytes: 10,
+            proof_steps: vec![2, 1],
+            ..Metrics::default()
+        };
+        assert_eq!(
+            concat!(
+                "{\"path\":\"a.tla\",\"bytes\":10,\"lines\":0,\"modules\":0,\"operators\":0,\"functions\":0,",
+                "\"theorems\":0,\"proof_steps\":[2,1],\"max_jlist_depth\":0,\"max_quantifier_depth\":0,",
+                "\"has_error\":false}"
+            ),
+            metrics.to_json_line(Path::new("a.tla"))
+        );
+    }
+
+    #[test]
+    fn test_metrics() {
+        let source = concat!(
+            "A comment before the module.\n",
+            "---- MODULE Test ----\n",
+            "EXTENDS Naturals\n",
+            "VARIABLE x\n",
+            "Inv ==\n",
+            "  /\\ x \\in Nat\n",
+            "  /\\ \\/ x = 0\n",
+            "     \\/ \\A y \\in Nat : \\E z \\in Nat : y = z\n",
+            "f[n \\in Nat] == n\n",
+            "THEOREM Inv => x \\in Nat\n",
+            "<1>1. x \\in Nat\n",
+            "  <2>1. TRUE OBVIOUS\n",
+            "  <2> QED BY <2>1\n",
+            "<1> QED BY <1>1\n",
+            "====\n",
+            "\n",
+            "And after.\n",
+        );
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(source, None).unwrap();
+        let metrics = Metrics::new(&tree, source.as_bytes());
+        assert!(!metrics.has_error);
+        assert_eq!((1, 1, 1, 1), (metrics.modules, metrics.operators, metrics.functions, metrics.theorems));
+        assert_eq!(vec![2, 2], metrics.proof_steps);
+        assert_eq!((2, 2), (metrics.max_jlist_depth, metrics.max_quantifier_depth));
+        assert_eq!(14, metrics.lines);
+    }
+}
@@ -0,0 +1,54 @@
+//! Minimal work-sharing helper used to spread independent parses across threads.
+
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::thread;
+
+/// Applies `f` to every item on a pool of scoped worker threads and returns
+/// the results in item order. Items are handed out one at a time in the order
+/// given, so callers wanting the largest jobs to start first should sort them
+/// that way. Each worker builds its own state with `init` (typically a
+/// [Parser][]) and reuses it for every item it picks up.
+///
+/// [Parser]: https://docs.rs/tree-sitter/*/tree_sitter/struct.Parser.html
+pub(crate) fn map<T, R, S, I, F>(items: &[T], init: I, f: F) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+    I: Fn() -> S + Sync,
+    F: Fn(&mut S, &T) -> R + Sync,
+{
+    let worker_count = thread::available_parallelism()
+        .map(|n| n.get())
+        .unwrap_or(1)
+        .min(items.len());
+    if worker_count <= 1 {
+        let mut state = init();
+        return items.iter().map(|item| f(&mut state, item)).collect();
+    }
+
+    let next = AtomicUsize::new(0);
+    let results: Mutex<Vec<Option<R>>> = Mutex::new((0..items.len()).map(|_| None).collect());
+    thread::scope(|scope| {
+        for _ in 0..worker_count {
+            scope.spawn(|| {
+                let mut state = init();
+                loop {
+                    let index = next.fetch_add(1, Ordering::Relaxed);
+                    if index >= items.len() {
+                        break;
+                    }
+                    let result = f(&mut state, &items[index]);
+                    results.lock().unwrap()[index] = Some(result);
+                }
+            });
+        }
+    });
+
+    results
+        .into_inner()
+        .unwrap()
+        .into_iter()
+        .map(|result| result.expect("every item is processed exactly once"))
+        .collect()
+}
@@ -0,0 +1,143 @@
+//! PlusCal algorithms inside block comments.
+//!
+//! A PlusCal algorithm is written in a block comment, starting with a
+//! `--algorithm` or `--fair algorithm` header, and is otherwise opaque to the
+//! grammar. Rather than handing every block comment to a PlusCal parser,
+//! editors can ask for the comments holding an algorithm, in all of a tree
+//! or only the part of it on screen or just edited: [algorithms_in][] visits
+//! only the nodes overlapping the given range and reads only the text of
+//! the block comments among them.
+
+use std::ops;
+use tree_sitter::{Range, Tree};
+
+/// A block comment holding a PlusCal algorithm.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Algorithm {
+    /// The block comment.
+    pub comment: Range,
+    /// The byte range of the `--algorithm` or `--fair algorithm` header.
+    pub header: ops::Range<usize>,
+    /// Whether the header is `--fair algorithm`.
+    pub is_fair: bool,
+    /// The name following the header, if any.
+    pub name: Option<String>,
+}
+
+/// The PlusCal algorithms of a tree, in source order.
+pub fn algorithms(tree: &Tree, source: &[u8]) -> Vec<Algorithm> {
+    algorithms_in(tree, source, 0..source.len())
+}
+
+/// The PlusCal algorithms in the block comments overlapping a byte range,
+/// in source order.
+pub fn algorithms_in(tree: &Tree, source: &[u8], range: ops::Range<usize>) -> Vec<Algorithm> {
+    let mut algorithms = Vec::new();
+    let mut cursor = tree.walk();
+    loop {
+        let node = cursor.node();
+        let relevant = node.start_byte() <= range.end && range.start <= node.end_byte();
+        if relevant && "block_comment" == node.kind() {
+            if let Some((header, is_fair, name)) = find_header(&source[node.byte_range()]) {
+                let offset = node.start_byte();
+                algorithms.push(Algorithm {
+                    comment: node.range(),
+                    header: offset + header.start..offset + header.end,
+                    is_fair,
+                    name: name.map(|name| {
+                        String::from_utf8_lossy(&source[offset + name.start..offset + name.end]).into_owned()
+                    }),
+                });
+            }
+        } else if relevant && cursor.goto_first_child() {
+            continue;
+        }
+        while !cursor.goto_next_sibling() {
+            if !cursor.goto_parent() {
+                return algorithms;
+            }
+        }
+    }
+}
+
+// The first algorithm header in a comment's text, whether it is fair, and the
+// name after it, as byte ranges of the text.
+fn find_header(text: &[u8]) -> Option<(ops::Range<usize>, bool, Option<ops::Range<usize>>)> {
+    let is_word = |byte: u8| byte.is_ascii_alphanumeric() || b'_' == byte;
+    let skip_space = |mut i: usize| {
+        while i < text.len() && text[i].is_ascii_whitespace() {
+            i += 1;
+        }
+        i
+    };
+    let keyword = |i: usize, keyword: &[u8]| {
+        text[i..].starts_with(keyword) && text.get(i + keyword.len()).map_or(true, |&byte| !is_word(byte))
+    };
+    let mut start = 0;
+    while let Some(found) = text[start..].windows(2).position(|pair| pair == b"--") {
+        let dashes = start + found;
+        let mut i = dashes + 2;
+        let is_fair = keyword(i, b"fair");
+        if is_fair {
+            i = skip_space(i + b"fair".len());
+        }
+        if (!is_fair || i > dashes + 2 + b"fair".len()) && keyword(i, b"algorithm") {
+            let end = i + b"algorithm".len();
+            let name_start = skip_space(end);
+            let mut name_end = name_start;
+            while name_end < text.len() && is_word(text[name_end]) {
+                name_end += 1;
+            }
+            let name = Some(name_start..name_end).filter(|name| name_start > end && !name.is_empty());
+            return Some((dashes..end, is_fair, name));
+        }
+        start = dashes + 2;
+    }
+    None
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{algorithms, algorithms_in, find_header};
+    use tree_sitter::Parser;
+
+    #[test]
+    fn test_find_header() {
+        assert_eq!(
+            Some((3..14, false, Some(15..21))),
+            find_header(b"(* --algorithm Euclid { skip } *)")
+        );
+        assert_eq!(
+            Some((6..23, true, Some(24..26))),
+            find_header(b"(*\n   --fair  algorithm Ab\nbegin skip end algorithm *)")
+        );
+        assert_eq!(None, find_header(b"(* ---- --fairalgorithm --algorithms x *)"));
+        assert_eq!(Some((3..14, false, None)), find_header(b"(* --algorithm*)"));
+    }
+
+    #[test]
+    fn test_algorithms() {
+        let source = concat!(
+            "---- MODULE Test ----\n",
+            "(* Just a comment. *)\n",
+            "(* --algorithm Counter\n",
+            "variable x = 0;\n",
+            "begin x := x + 1;\n",
+            "end algorithm *)\n",
+            "VARIABLE x\n",
+            "====\n",
+        );
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(source, None).unwrap();
+
+        let found = algorithms(&tree, source.as_bytes());
+        assert_eq!(1, found.len());
+        assert_eq!(Some("Counter"), found[0].name.as_deref());
+        assert_eq!(2, found[0].comment.start_point.row);
+        assert_eq!("--algorithm", &source[found[0].header.clone()]);
+
+        let end = source.find("(* --").unwrap() - 1;
+        assert!(algorithms_in(&tree, source.as_bytes(), 0..end).is_empty());
+    }
+}
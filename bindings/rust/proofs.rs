@@ -0,0 +1,541 @@
+//! Dependencies of TLAPS proofs on facts and definitions, kept up to date
+//! across edits.
+//!
+//! Every theorem and step of its proof cites facts and definitions through
+//! the `BY` of its terminal proof: expressions, names of theorems,
+//! assumptions and definitions, earlier steps, and modules. `USE` does the
+//! same for every step after it in its scope, at module level for every
+//! later theorem. A [ProofIndex][] records each step's citations and, in
+//! reverse, which steps cite each name, so [ProofIndex::stale][] finds the
+//! steps to check again after a definition changes by following those links
+//! alone: from the definition to the definitions and theorem statements
+//! mentioning it, and from all of them to the steps citing them.
+//!
+//! As in [crate::diagnostics][], each module-level unit is walked on its own
+//! and [ProofIndex::update][] walks again only the units overlapping the
+//! edits and tree-sitter's changed ranges. `HIDE` is ignored: it never adds
+//! a dependency, so the stale steps it would remove are kept.
+
+use crate::units::{
+    edit_range, named_children, text, top_level_modules, units_of, CachedUnit, Edits, UnitCache, UnitKey,
+};
+use std::collections::{BTreeSet, HashMap, HashSet};
+use std::ops;
+use tree_sitter::{InputEdit, Node, Range, Tree};
+
+/// The proof dependencies of the modules of a tree.
+pub struct ProofIndex {
+    // The units of each top-level module, in source order.
+    modules: Vec<Vec<Unit>>,
+    edited: Edits,
+    next_id: u32,
+    // By unit id, the module and position of the unit.
+    positions: HashMap<u32, (usize, usize)>,
+    // By name, the units whose definition or statement mentions it.
+    mentioned_by: HashMap<String, Vec<u32>>,
+    // By name, the steps citing it, as unit id and step index.
+    cited_by: HashMap<String, Vec<(u32, usize)>>,
+}
+
+struct Unit {
+    id: u32,
+    kind_id: u16,
+    range: Range,
+    // The name of a definition, assumption or theorem.
+    name: Option<String>,
+    // The names a definition's body or a theorem's statement refers to.
+    mentions: Vec<String>,
+    // For a theorem, the theorem itself followed by the steps of its proof
+    // in source order; for a `USE`, the `USE` alone.
+    steps: Vec<Step>,
+}
+
+impl CachedUnit for Unit {
+    fn key(&self) -> UnitKey {
+        (self.kind_id, self.range.start_byte, self.range.end_byte)
+    }
+}
+
+/// A theorem, a step of a proof, or a module-level `USE`.
+#[derive(Debug)]
+pub struct Step {
+    pub range: Range,
+    /// The name of a theorem, or the id of a step, such as `<1>2`.
+    pub label: Option<String>,
+    /// What the step's `BY`, or a `USE` step itself, cites.
+    pub dependencies: Vec<Dependency>,
+    is_use: bool,
+    // The step whose proof this step is part of.
+    parent: usize,
+    // One past the index of the last step within this step's proof.
+    end: usize,
+}
+
+/// A fact or definition cited by a step.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub enum Dependency {
+    /// A name used as a fact, or in an expression used as one.
+    Fact(String),
+    /// A name following `DEF`.
+    Definition(String),
+    /// An earlier step of the same theorem, by index in
+    /// [ProofIndex::steps][].
+    Step(usize),
+    /// A module named by `MODULE`.
+    Module(String),
+}
+
+// Units that define a name other units can mention or cite.
+const DEFINITION_KINDS: [&str; 3] = ["operator_definition", "function_definition", "module_definition"];
+
+impl ProofIndex {
+    /// Indexes the proofs of all modules of a tree.
+    pub fn new(tree: &Tree, source: &[u8]) -> Self {
+        let mut index = ProofIndex {
+            modules: Vec::new(),
+            edited: Edits::new(),
+            next_id: 0,
+            positions: HashMap::new(),
+            mentioned_by: HashMap::new(),
+            cited_by: HashMap::new(),
+        };
+        let root = tree.root_node();
+        index.rebuild(tree, source, &[root.byte_range()]);
+        index
+    }
+
+    /// The steps of the theorem or `USE` at a byte offset, the theorem first.
+    pub fn steps(&self, byte: usize) -> &[Step] {
+        self.modules
+            .iter()
+            .flatten()
+            .find(|unit| unit.range.start_byte <= byte && byte < unit.range.end_byte)
+            .map_or(&[], |unit| unit.steps.as_slice())
+    }
+
+    /// The steps citing a name directly, as a fact, a definition or a module.
+    pub fn citations(&self, name: &str) -> Vec<&Step> {
+        self.cited_by
+            .get(name)
+            .into_iter()
+            .flatten()
+            .map(|&(id, step)| &self.unit(id).steps[step])
+            .collect()
+    }
+
+    /// The steps whose proofs may no longer hold once the given definitions,
+    /// assumptions or theorems change, in source order: those citing them,
+    /// or citing a definition or theorem mentioning them, either directly or
+    /// through a `USE` in scope; and every step of a theorem whose statement
+    /// mentions them.
+    pub fn stale<'a>(&self, changed: impl IntoIterator<Item = &'a str>) -> Vec<&Step> {
+        let mut names: Vec<&str> = Vec::new();
+        let mut seen = HashSet::new();
+        for name in changed {
+            if seen.insert(name) {
+                names.push(name);
+            }
+        }
+        let mut stale: BTreeSet<(usize, usize, usize)> = BTreeSet::new();
+        let mut i = 0;
+        while i < names.len() {
+            for &id in self.mentioned_by.get(names[i]).into_iter().flatten() {
+                let unit = self.unit(id);
+                let (module, position) = self.positions[&id];
+                stale.extend((0..unit.steps.len()).map(|step| (module, position, step)));
+                if let Some(name) = &unit.name {
+                    if seen.insert(name.as_str()) {
+                        names.push(name);
+                    }
+                }
+            }
+            i += 1;
+        }
+        for name in names {
+            for &(id, step) in self.cited_by.get(name).into_iter().flatten() {
+                let unit = self.unit(id);
+                let (module, position) = self.positions[&id];
+                if !unit.steps[step].is_use {
+                    stale.insert((module, position, step));
+                } else if step > 0 {
+                    let end = unit.steps[unit.steps[step].parent].end;
+                    stale.extend((step + 1..end).map(|step| (module, position, step)));
+                } else {
+                    for (later, unit) in self.modules[module].iter().enumerate().skip(position + 1) {
+                        if unit.steps.first().map_or(false, |step| !step.is_use) {
+                            stale.extend((0..unit.steps.len()).map(|step| (module, later, step)));
+                        }
+                    }
+                }
+            }
+        }
+        stale
+            .into_iter()
+            .map(|(module, position, step)| &self.modules[module][position].steps[step])
+            .collect()
+    }
+
+    /// Shifts all positions for an edit, and remembers its range to check
+    /// again on the next [ProofIndex::update][].
+    pub fn edit(&mut self, edit: &InputEdit) {
+        for unit in self.modules.iter_mut().flatten() {
+            edit_range(&mut unit.range, edit);
+            for step in &mut unit.steps {
+                edit_range(&mut step.range, edit);
+            }
+        }
+        self.edited.edit(edit);
+    }
+
+    /// Brings the index up to date with a tree reparsed after the edits
+    /// passed to [ProofIndex::edit][]. `old_tree` is the edited tree that was
+    /// passed to the parser. Only units overlapping an edit or a changed
+    /// range are walked, and only their entries in the reverse maps change.
+    pub fn update(&mut self, old_tree: &Tree, new_tree: &Tree, source: &[u8]) {
+        let dirty = self.edited.dirty(old_tree, new_tree);
+        if !dirty.is_empty() {
+            self.rebuild(new_tree, source, &dirty);
+        }
+    }
+
+    fn rebuild(&mut self, tree: &Tree, source: &[u8], dirty: &[ops::Range<usize>]) {
+        let mut cached = UnitCache::new(self.modules.drain(..).flatten(), dirty);
+        let mut fresh = Vec::new();
+        for module in top_level_modules(tree) {
+            let mut units = Vec::new();
+            for node in units_of(module) {
+                if let Some(unit) = cached.reuse(node) {
+                    units.push(unit);
+                } else if let Some(unit) = Unit::new(node, self.next_id, source) {
+                    self.next_id += 1;
+                    fresh.push(unit.id);
+                    units.push(unit);
+                }
+            }
+            self.modules.push(units);
+        }
+
+        for unit in cached.into_dropped() {
+            self.positions.remove(&unit.id);
+            for name in &unit.mentions {
+                unlink(&mut self.mentioned_by, name, |&id| id == unit.id);
+            }
+            for name in unit.cited_names() {
+                unlink(&mut self.cited_by, name, |&(id, _)| id == unit.id);
+            }
+        }
+        for (module, units) in self.modules.iter().enumerate() {
+            for (position, unit) in units.iter().enumerate() {
+                self.positions.insert(unit.id, (module, position));
+            }
+        }
+        for id in fresh {
+            let (module, position) = self.positions[&id];
+            let unit = &self.modules[module][position];
+            for name in &unit.mentions {
+                self.mentioned_by.entry(name.clone()).or_default().push(id);
+            }
+            for (step, dependencies) in unit.steps.iter().enumerate().map(|(i, step)| (i, &step.dependencies)) {
+                for name in dependencies.iter().filter_map(Dependency::name) {
+                    self.cited_by.entry(name.to_string()).or_default().push((id, step));
+                }
+            }
+        }
+    }
+
+    fn unit(&self, id: u32) -> &Unit {
+        let (module, position) = self.positions[&id];
+        &self.modules[module][position]
+    }
+}
+
+impl Dependency {
+    fn name(&self) -> Option<&str> {
+        match self {
+            Dependency::Fact(name) | Dependency::Definition(name) | Dependency::Module(name) => Some(name),
+            Dependency::Step(_) => None,
+        }
+    }
+}
+
+impl Unit {
+    fn new(node: Node, id: u32, source: &[u8]) -> Option<Self> {
+        let mut unit = Unit {
+            id,
+            kind_id: node.kind_id(),
+            range: node.range(),
+            name: None,
+            mentions: Vec::new(),
+            steps: Vec::new(),
+        };
+        let mut definition = node;
+        if "local_definition" == node.kind() {
+            definition = node.named_child(0)?;
+        }
+        match definition.kind() {
+            kind if DEFINITION_KINDS.contains(&kind) => {
+                unit.name = definition.child_by_field_name("name").map(|name| text(name, source));
+                unit.mentions = identifier_refs(definition, source);
+            }
+            "theorem" | "assumption" => {
+                unit.name = definition
+                    .named_child(0)
+                    .filter(|name| "identifier" == name.kind())
+                    .map(|name| text(name, source));
+                for statement in named_children(definition).filter(|child| !is_proof(*child)) {
+                    unit.mentions.extend(identifier_refs(statement, source));
+                }
+                if "theorem" == definition.kind() {
+                    let mut builder = Builder {
+                        source,
+                        steps: Vec::new(),
+                        scopes: Vec::new(),
+                    };
+                    builder.step(definition, unit.name.clone(), 0);
+                    unit.steps = builder.steps;
+                }
+            }
+            "use_or_hide" if is_use(definition) => {
+                let mut builder = Builder {
+                    source,
+                    steps: Vec::new(),
+                    scopes: Vec::new(),
+                };
+                builder.step(definition, None, 0);
+                unit.steps = builder.steps;
+            }
+            _ => return None,
+        }
+        unit.mentions.sort();
+        unit.mentions.dedup();
+        Some(unit)
+    }
+
+    fn cited_names(&self) -> HashSet<&str> {
+        self.steps
+            .iter()
+            .flat_map(|step| step.dependencies.iter().filter_map(Dependency::name))
+            .collect()
+    }
+}
+
+struct Builder<'a> {
+    source: &'a [u8],
+    steps: Vec<Step>,
+    // For each enclosing proof, its steps so far, by id.
+    scopes: Vec<Vec<(String, usize)>>,
+}
+
+impl Builder<'_> {
+    // Adds a theorem, proof step or `USE`, then the steps of its proof.
+    fn step(&mut self, node: Node, label: Option<String>, parent: usize) -> usize {
+        let index = self.steps.len();
+        self.steps.push(Step {
+            range: node.range(),
+            label,
+            dependencies: Vec::new(),
+            is_use: false,
+            parent,
+            end: index + 1,
+        });
+        // A proof step's statement, and so its proof, is its last child.
+        let body = match node.kind() {
+            "proof_step" => node.named_child(node.named_child_count() - 1).unwrap_or(node),
+            _ => node,
+        };
+        if "use_or_hide" == body.kind() {
+            if is_use(body) {
+                self.steps[index].is_use = true;
+                self.steps[index].dependencies = self.dependencies(body);
+            }
+        } else if let Some(proof) = named_children(body).find(|child| is_proof(*child)) {
+            if "terminal_proof" == proof.kind() {
+                self.steps[index].dependencies = self.dependencies(proof);
+            } else {
+                self.scopes.push(Vec::new());
+                for step in named_children(proof).filter(|child| matches!(child.kind(), "proof_step" | "qed_step")) {
+                    let id = step
+                        .named_child(0)
+                        .filter(|id| "proof_step_id" == id.kind())
+                        .map(|id| text(id, self.source).trim_end_matches('.').to_string());
+                    let child = self.step(step, id.clone(), index);
+                    if let Some(id) = id {
+                        self.scopes.last_mut().unwrap().push((id, child));
+                    }
+                }
+                self.scopes.pop();
+            }
+        }
+        self.steps[index].end = self.steps.len();
+        index
+    }
+
+    // What the `use_body` among the children of a node cites.
+    fn dependencies(&self, node: Node) -> Vec<Dependency> {
+        let mut dependencies = Vec::new();
+        let body = match named_children(node).find(|child| "use_body" == child.kind()) {
+            Some(body) => body,
+            None => return dependencies,
+        };
+        for part in named_children(body) {
+            let is_def = "use_body_def" == part.kind();
+            for item in named_children(part) {
+                match item.kind() {
+                    "module_ref" => {
+                        dependencies.extend(item.named_child(0).map(|name| Dependency::Module(text(name, self.source))))
+                    }
+                    kind if is_def && (kind == "identifier_ref" || kind.ends_with("op_symbol")) => {
+                        dependencies.push(Dependency::Definition(text(item, self.source)))
+                    }
+                    _ => self.facts(item, &mut dependencies),
+                }
+            }
+        }
+        dependencies.dedup();
+        dependencies
+    }
+
+    // The names and steps referred to by an expression cited as a fact.
+    fn facts(&self, node: Node, dependencies: &mut Vec<Dependency>) {
+        let mut stack = vec![node];
+        while let Some(node) = stack.pop() {
+            match node.kind() {
+                "identifier_ref" => dependencies.push(Dependency::Fact(text(node, self.source))),
+                "proof_step_ref" => dependencies.extend(self.resolve(&text(node, self.source)).map(Dependency::Step)),
+                _ => stack.extend((0..node.named_child_count()).rev().map(|i| node.named_child(i).unwrap())),
+            }
+        }
+    }
+
+    // The step a reference such as `<1>2` or `<*>a` refers to: the latest
+    // visible one with that id.
+    fn resolve(&self, reference: &str) -> Option<usize> {
+        let name = reference.strip_prefix("<*>");
+        self.scopes.iter().rev().flat_map(|scope| scope.iter().rev()).find_map(|(id, step)| {
+            let matches = match name {
+                Some(name) => id.split_once('>').map_or(false, |(_, suffix)| suffix == name),
+                None => id == reference,
+            };
+            matches.then(|| *step)
+        })
+    }
+}
+
+fn unlink<T>(map: &mut HashMap<String, Vec<T>>, name: &str, is_unit: impl Fn(&T) -> bool) {
+    if let Some(entries) = map.get_mut(name) {
+        entries.retain(|entry| !is_unit(entry));
+        if entries.is_empty() {
+            map.remove(name);
+        }
+    }
+}
+
+fn is_proof(node: Node) -> bool {
+    matches!(node.kind(), "terminal_proof" | "non_terminal_proof")
+}
+
+fn is_use(node: Node) -> bool {
+    node.child(0).map_or(false, |keyword| "USE" == keyword.kind())
+}
+
+fn identifier_refs(node: Node, source: &[u8]) -> Vec<String> {
+    let mut names = Vec::new();
+    let mut stack = vec![node];
+    while let Some(node) = stack.pop() {
+        if "identifier_ref" == node.kind() {
+            names.push(text(node, source));
+        } else {
+            stack.extend(named_children(node));
+        }
+    }
+    names
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{Dependency, ProofIndex};
+    use crate::units::reparse;
+    use tree_sitter::Parser;
+
+    const SOURCE: &str = concat!(
+        "---- MODULE Test ----\n",
+        "Inv == x \\in Nat\n",
+        "Safe == Inv /\\ y = 1\n",
+        "Other == z\n",
+        "THEOREM Thm == Safe\n",
+        "<1>1. x \\in Nat BY DEF Inv\n",
+        "<1>2. y = 1 OBVIOUS\n",
+        "<1> USE DEF Other\n",
+        "<1>3. z = z BY <1>1\n",
+        "<1> QED BY <1>1, <1>2\n",
+        "THEOREM Safe => TRUE BY Thm\n",
+        "====\n",
+    );
+
+    fn labels<'a>(steps: &[&'a super::Step]) -> Vec<&'a str> {
+        steps.iter().map(|step| step.label.as_deref().unwrap_or("")).collect()
+    }
+
+    #[test]
+    fn test_dependencies_and_stale_steps() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(SOURCE, None).unwrap();
+        let index = ProofIndex::new(&tree, SOURCE.as_bytes());
+
+        let steps = index.steps(SOURCE.find("THEOREM Thm").unwrap());
+        assert_eq!(6, steps.len());
+        assert_eq!(vec![Dependency::Definition("Inv".to_string())], steps[1].dependencies);
+        assert_eq!(vec![Dependency::Step(1), Dependency::Step(2)], steps[5].dependencies);
+        assert_eq!(vec!["<1>1"], labels(&index.citations("Inv")));
+
+        // Inv is cited by <1>1, and mentioned by Safe, which both theorems'
+        // statements mention.
+        assert_eq!(
+            vec!["Thm", "<1>1", "<1>2", "<1>", "<1>3", "<1>", ""],
+            labels(&index.stale(["Inv"]))
+        );
+        // The USE of Other holds for the steps after it.
+        assert_eq!(vec!["<1>3", "<1>"], labels(&index.stale(["Other"])));
+        assert!(index.stale(["Unused"]).is_empty());
+    }
+
+    #[test]
+    fn test_update_matches_full_recompute() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let mut tree = parser.parse(SOURCE, None).unwrap();
+        let mut index = ProofIndex::new(&tree, SOURCE.as_bytes());
+
+        let start = SOURCE.find("DEF Inv").unwrap();
+        let (source, edit, new_tree) =
+            reparse(&mut parser, &mut tree, SOURCE, start..start + "DEF Inv".len(), "Safe");
+        index.edit(&edit);
+        index.update(&tree, &new_tree, source.as_bytes());
+
+        let fresh = ProofIndex::new(&new_tree, source.as_bytes());
+        assert_eq!(labels(&fresh.stale(["Other", "Safe"])), labels(&index.stale(["Other", "Safe"])));
+        assert!(index.citations("Inv").is_empty());
+        assert_eq!(vec!["<1>1"], labels(&index.citations("Safe")));
+    }
+
+    #[test]
+    fn test_update_after_same_length_edit() {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let mut tree = parser.parse(SOURCE, None).unwrap();
+        let mut index = ProofIndex::new(&tree, SOURCE.as_bytes());
+
+        // The theorem keeps its range, so only the edit marks it dirty.
+        let start = SOURCE.find("DEF Inv").unwrap() + "DEF ".len();
+        let (source, edit, new_tree) =
+            reparse(&mut parser, &mut tree, SOURCE, start..start + "Inv".len(), "Foo");
+        index.edit(&edit);
+        index.update(&tree, &new_tree, source.as_bytes());
+
+        assert!(index.citations("Inv").is_empty());
+        assert_eq!(vec!["<1>1"], labels(&index.citations("Foo")));
+        let fresh = ProofIndex::new(&new_tree, source.as_bytes());
+        assert_eq!(labels(&fresh.stale(["Inv", "Foo"])), labels(&index.stale(["Inv", "Foo"])));
+    }
+}
@@ -0,0 +1,487 @@
+//! Structural search across a workspace, prefiltered by trigrams.
+//!
+//! Running a tree-sitter query over a tree of specs means parsing every
+//! file, every time. A [SearchIndex][] parses each file once, on a pool of
+//! threads, and keeps its tree along with two summaries: the trigrams of its
+//! text, and the kinds of node it contains. [SearchIndex::search][] works
+//! out from the query what any match must contain — the strings of
+//! anonymous nodes and `#eq?` predicates, and the kinds of named nodes,
+//! outside alternations and optional or repeated items — and runs the query
+//! in parallel on the cached trees of the files containing all of it.
+
+use crate::parallel;
+use std::collections::HashMap;
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+use tree_sitter::{Parser, Query, QueryCursor, QueryError, Range, Tree};
+
+/// A match of a query in a file.
+#[derive(Clone, Debug)]
+pub struct Match {
+    pub path: PathBuf,
+    /// The index of the matching pattern in the query.
+    pub pattern_index: usize,
+    /// The captured nodes, by capture name.
+    pub captures: Vec<(String, Range)>,
+}
+
+/// The parsed files of a workspace, indexed by trigram and node kind.
+pub struct SearchIndex {
+    paths: Vec<PathBuf>,
+    file_ids: HashMap<PathBuf, usize>,
+    // By file id; None once removed.
+    files: Vec<Option<File>>,
+    // For each trigram, the ids of the files containing it, ascending.
+    postings: HashMap<u32, Vec<u32>>,
+    // For each node kind id, the id of the first kind with its name, as
+    // aliases give one name several ids.
+    kind_ids: Vec<u16>,
+}
+
+struct File {
+    source: Vec<u8>,
+    tree: Tree,
+    trigrams: Vec<u32>,
+    // A bit for each node kind present, by the kind's first id.
+    kinds: Vec<u64>,
+}
+
+// What any match of one pattern of a query contains.
+#[derive(Debug, Default, PartialEq, Eq)]
+struct Requirement {
+    literals: Vec<String>,
+    kinds: Vec<String>,
+}
+
+impl SearchIndex {
+    /// Creates an empty index.
+    pub fn new() -> Self {
+        let language = crate::language();
+        let kind_ids = (0..language.node_kind_count() as u16)
+            .map(|id| match language.node_kind_for_id(id) {
+                Some(kind) => match language.id_for_node_kind(kind, language.node_kind_is_named(id)) {
+                    0 => id,
+                    first => first,
+                },
+                None => id,
+            })
+            .collect();
+        SearchIndex {
+            paths: Vec::new(),
+            file_ids: HashMap::new(),
+            files: Vec::new(),
+            postings: HashMap::new(),
+            kind_ids,
+        }
+    }
+
+    /// Reads, parses and indexes each file on a pool of threads, replacing
+    /// whatever was indexed for it before. Returns the outcome for each file
+    /// in the order given.
+    pub fn add_files<P: AsRef<Path> + Sync>(&mut self, paths: &[P]) -> Vec<io::Result<()>> {
+        let new_parser = || {
+            let mut parser = Parser::new();
+            parser
+                .set_language(crate::language())
+                .expect("Error loading tlaplus grammar");
+            parser
+        };
+        let results = parallel::map(paths, new_parser, |parser, path| {
+            let source = fs::read(path)?;
+            let tree = parser
+                .parse(&source, None)
+                .ok_or_else(|| io::Error::new(io::ErrorKind::Other, "parse cancelled"))?;
+            Ok((tree, source))
+        });
+        paths
+            .iter()
+            .zip(results)
+            .map(|(path, result)| result.map(|(tree, source)| self.update_file(path, tree, source)))
+            .collect()
+    }
+
+    /// Re-indexes a file from its current tree and source, as after an edit.
+    pub fn update_file(&mut self, path: impl AsRef<Path>, tree: Tree, source: Vec<u8>) {
+        let id = self.remove(path.as_ref());
+        let mut trigrams: Vec<u32> = source.windows(3).map(trigram).collect();
+        trigrams.sort_unstable();
+        trigrams.dedup();
+        for &trigram in &trigrams {
+            let postings = self.postings.entry(trigram).or_default();
+            if let Err(i) = postings.binary_search(&(id as u32)) {
+                postings.insert(i, id as u32);
+            }
+        }
+        let mut kinds = vec![0u64; (self.kind_ids.len() + 63) / 64];
+        let mut cursor = tree.walk();
+        'tree: loop {
+            let kind_id = self.kind_ids[cursor.node().kind_id() as usize] as usize;
+            kinds[kind_id / 64] |= 1 << (kind_id % 64);
+            if cursor.goto_first_child() {
+                continue;
+            }
+            while !cursor.goto_next_sibling() {
+                if !cursor.goto_parent() {
+                    break 'tree;
+                }
+            }
+        }
+        self.files[id] = Some(File {
+            source,
+            tree,
+            trigrams,
+            kinds,
+        });
+    }
+
+    /// Drops a file, as after it is deleted.
+    pub fn remove_file(&mut self, path: impl AsRef<Path>) {
+        if self.file_ids.contains_key(path.as_ref()) {
+            self.remove(path.as_ref());
+        }
+    }
+
+    /// Runs a query on every file that could match it, in parallel, and
+    /// returns the matches by file, in the order files were first indexed.
+    pub fn search(&self, source: &str) -> Result<Vec<Match>, QueryError> {
+        let query = Query::new(crate::language(), source)?;
+        // Trees are not Sync, so each worker takes a copy out of a Mutex.
+        let jobs: Vec<(usize, &[u8], Mutex<Option<Tree>>)> = self
+            .candidates(&requirements(source))
+            .into_iter()
+            .filter_map(|id| {
+                let file = self.files[id].as_ref()?;
+                Some((id, file.source.as_slice(), Mutex::new(Some(file.tree.clone()))))
+            })
+            .collect();
+        let (paths, capture_names) = (&self.paths, query.capture_names());
+        let results = parallel::map(&jobs, QueryCursor::new, |cursor, (id, source, tree)| {
+            let tree = tree.lock().unwrap().take().unwrap();
+            let matches = cursor
+                .matches(&query, tree.root_node(), *source)
+                .map(|found| Match {
+                    path: paths[*id].clone(),
+                    pattern_index: found.pattern_index,
+                    captures: found
+                        .captures
+                        .iter()
+                        .map(|capture| (capture_names[capture.index as usize].clone(), capture.node.range()))
+                        .collect(),
+                })
+                .collect::<Vec<_>>();
+            matches
+        });
+        Ok(results.into_iter().flatten().collect())
+    }
+
+    /// The paths of the files a query could match, without running it.
+    pub fn candidate_paths(&self, source: &str) -> Vec<&Path> {
+        self.candidates(&requirements(source))
+            .into_iter()
+            .map(|id| self.paths[id].as_path())
+            .collect()
+    }
+
+    // The ids of the files meeting any of the requirements, ascending.
+    fn candidates(&self, requirements: &[Requirement]) -> Vec<usize> {
+        let live = || (0..self.files.len()).filter(|&id| self.files[id].is_some());
+        let mut candidates: Vec<usize> = Vec::new();
+        'requirements: for requirement in requirements {
+            let mut trigrams: Vec<u32> = requirement
+                .literals
+                .iter()
+                .flat_map(|literal| literal.as_bytes().windows(3).map(trigram))
+                .collect();
+            trigrams.sort_unstable();
+            trigrams.dedup();
+            let mut postings = Vec::new();
+            for trigram in &trigrams {
+                match self.postings.get(trigram) {
+                    Some(files) => postings.push(files),
+                    None => continue 'requirements,
+                }
+            }
+            postings.sort_by_key(|files| files.len());
+            let mut files: Vec<usize> = match postings.split_first() {
+                Some((first, rest)) => first
+                    .iter()
+                    .filter(|id| rest.iter().all(|files| files.binary_search(id).is_ok()))
+                    .map(|&id| id as usize)
+                    .collect(),
+                None => live().collect(),
+            };
+
+            let language = crate::language();
+            let kinds: Vec<usize> = requirement
+                .kinds
+                .iter()
+                .map(|kind| language.id_for_node_kind(kind, true) as usize)
+                .filter(|&id| id != 0)
+                .collect();
+            files.retain(|&id| {
+                let file = self.files[id].as_ref().unwrap();
+                kinds.iter().all(|&kind| file.kinds[kind / 64] & (1 << (kind % 64)) != 0)
+            });
+            candidates.extend(files);
+        }
+        candidates.sort_unstable();
+        candidates.dedup();
+        candidates
+    }
+
+    // Empties a file's slot, allocating one if it has none, and returns its id.
+    fn remove(&mut self, path: &Path) -> usize {
+        let id = match self.file_ids.get(path) {
+            Some(&id) => id,
+            None => {
+                let id = self.paths.len();
+                self.paths.push(path.to_path_buf());
+                self.file_ids.insert(path.to_path_buf(), id);
+                self.files.push(None);
+                id
+            }
+        };
+        if let Some(file) = self.files[id].take() {
+            for trigram in file.trigrams {
+                if let Some(postings) = self.postings.get_mut(&trigram) {
+                    if let Ok(i) = postings.binary_search(&(id as u32)) {
+                        postings.remove(i);
+                    }
+                }
+            }
+        }
+        id
+    }
+}
+
+impl Default for SearchIndex {
+    fn default() -> Self {
+        SearchIndex::new()
+    }
+}
+
+fn trigram(bytes: &[u8]) -> u32 {
+    (bytes[0] as u32) << 16 | (bytes[1] as u32) << 8 | bytes[2] as u32
+}
+
+#[derive(Debug, PartialEq)]
+enum Token {
+    Open(char),
+    Close,
+    String(String),
+    Atom(String),
+    Quantifier(char),
+}
+
+// What the matches of each top-level pattern of a query contain. Patterns
+// the query syntax doesn't allow are left to Query::new to report.
+fn requirements(query: &str) -> Vec<Requirement> {
+    let tokens = tokenize(query);
+    let mut requirements = Vec::new();
+    let mut i = 0;
+    while i < tokens.len() {
+        // A predicate after a pattern belongs to it.
+        let is_predicate = matches!(&tokens[i..], [Token::Open('('), Token::Atom(atom), ..] if atom.starts_with('#'));
+        match requirements.last_mut() {
+            Some(requirement) if is_predicate => item(&tokens, &mut i, requirement),
+            _ => {
+                let mut requirement = Requirement::default();
+                item(&tokens, &mut i, &mut requirement);
+                requirements.push(requirement);
+            }
+        }
+    }
+    requirements
+}
+
+// Adds what any match of the item at `tokens[*i]` contains to `requirement`,
+// and moves past it.
+fn item(tokens: &[Token], i: &mut usize, requirement: &mut Requirement) {
+    let mut found = Requirement::default();
+    match tokens.get(*i) {
+        Some(Token::String(literal)) => {
+            found.literals.push(literal.clone());
+            *i += 1;
+        }
+        Some(Token::Open('(')) => {
+            *i += 1;
+            match tokens.get(*i) {
+                Some(Token::Atom(predicate)) if predicate.starts_with('#') => {
+                    let start = *i;
+                    skip_group(tokens, i);
+                    if "#eq?" == predicate {
+                        let arguments = &tokens[start + 1..*i - 1];
+                        if let [Token::Atom(_), Token::String(literal)] | [Token::String(literal), Token::Atom(_)] =
+                            arguments
+                        {
+                            found.literals.push(literal.clone());
+                        }
+                    }
+                }
+                _ => {
+                    if let Some(Token::Atom(kind)) = tokens.get(*i) {
+                        if is_kind(kind) {
+                            found.kinds.push(kind.clone());
+                        }
+                    }
+                    while *i < tokens.len() && tokens[*i] != Token::Close {
+                        item(tokens, i, &mut found);
+                    }
+                    *i += 1;
+                }
+            }
+        }
+        Some(Token::Open(_)) => {
+            *i += 1;
+            while *i < tokens.len() && tokens[*i] != Token::Close {
+                item(tokens, i, &mut Requirement::default());
+            }
+            *i += 1;
+        }
+        Some(Token::Atom(field)) if field.ends_with(':') => {
+            *i += 1;
+            item(tokens, i, &mut found);
+        }
+        _ => *i += 1,
+    }
+    match tokens.get(*i) {
+        Some(Token::Quantifier('+')) => *i += 1,
+        Some(Token::Quantifier(_)) => {
+            *i += 1;
+            return;
+        }
+        _ => {}
+    }
+    requirement.literals.extend(found.literals);
+    requirement.kinds.extend(found.kinds);
+}
+
+fn skip_group(tokens: &[Token], i: &mut usize) {
+    let mut depth = 1;
+    while *i < tokens.len() && depth > 0 {
+        match tokens[*i] {
+            Token::Open(_) => depth += 1,
+            Token::Close => depth -= 1,
+            _ => {}
+        }
+        *i += 1;
+    }
+}
+
+// Whether an atom at the start of a parenthesized pattern names a kind of
+// node every match has.
+fn is_kind(atom: &str) -> bool {
+    !matches!(atom, "_" | "ERROR" | "MISSING")
+        && atom.chars().all(|c| c.is_alphanumeric() || '_' == c)
+}
+
+fn tokenize(query: &str) -> Vec<Token> {
+    let mut tokens = Vec::new();
+    let mut chars = query.chars().peekable();
+    while let Some(c) = chars.next() {
+        match c {
+            ';' => {
+                while chars.next_if(|&c| c != '\n').is_some() {}
+            }
+            '(' | '[' => tokens.push(Token::Open(c)),
+            ')' | ']' => tokens.push(Token::Close),
+            '?' | '*' | '+' => tokens.push(Token::Quantifier(c)),
+            '"' => {
+                let mut literal = String::new();
+                while let Some(c) = chars.next() {
+                    match c {
+                        '"' => break,
+                        '\\' => match chars.next() {
+                            Some('n') => literal.push('\n'),
+                            Some('t') => literal.push('\t'),
+                            Some('r') => literal.push('\r'),
+                            Some('0') => literal.push('\0'),
+                            Some(c) => literal.push(c),
+                            None => {}
+                        },
+                        c => literal.push(c),
+                    }
+                }
+                tokens.push(Token::String(literal));
+            }
+            c if c.is_whitespace() => {}
+            c => {
+                let mut atom = c.to_string();
+                while let Some(c) = chars.next_if(|&c| !c.is_whitespace() && !"()[]\";".contains(c)) {
+                    // A trailing quantifier belongs to the item, not the atom.
+                    if matches!(c, '*' | '+') || ('?' == c && !atom.starts_with('#')) {
+                        tokens.push(Token::Atom(std::mem::take(&mut atom)));
+                        tokens.push(Token::Quantifier(c));
+                        break;
+                    }
+                    atom.push(c);
+                }
+                if !atom.is_empty() {
+                    tokens.push(Token::Atom(atom));
+                }
+            }
+        }
+    }
+    tokens
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{requirements, Requirement, SearchIndex};
+    use std::env;
+    use std::fs;
+
+    fn requirement(literals: &[&str], kinds: &[&str]) -> Requirement {
+        Requirement {
+            literals: literals.iter().map(|literal| literal.to_string()).collect(),
+            kinds: kinds.iter().map(|kind| kind.to_string()).collect(),
+        }
+    }
+
+    #[test]
+    fn test_requirements() {
+        assert_eq!(
+            vec![requirement(&["\\in", "Foo"], &["bounded_quantification", "quantifier_bound", "identifier_ref"])],
+            requirements(
+                r#"; quantifiers over Foo
+                (bounded_quantification
+                  bound: (quantifier_bound "\\in" set: (identifier_ref) @set)
+                  (#eq? @set "Foo"))"#
+            )
+        );
+        // Nothing in alternations or optional items is required.
+        assert_eq!(
+            vec![requirement(&[], &["conj_list"]), requirement(&[], &[])],
+            requirements(r#"(conj_list (conj_item "/\\")? [(lor) "\\lor"]) ((comment)* @c)"#)
+        );
+        assert_eq!(
+            vec![requirement(&["WF_"], &["fairness"])],
+            requirements(r#"(fairness "WF_" (_)+ @sub) (#match? @sub "x")"#)
+        );
+    }
+
+    #[test]
+    fn test_search_candidates() {
+        let dir = env::temp_dir().join("tree-sitter-tlaplus-test-search");
+        fs::create_dir_all(&dir).unwrap();
+        let paths = vec![dir.join("A.tla"), dir.join("B.tla")];
+        fs::write(&paths[0], "---- MODULE A ----\nP == \\A x \\in Foo : x\n====\n").unwrap();
+        fs::write(&paths[1], "---- MODULE B ----\nQ == \\E y \\in Bar : y\n====\n").unwrap();
+        let mut index = SearchIndex::new();
+        assert!(index.add_files(&paths).iter().all(|result| result.is_ok()));
+
+        let query = r#"((bounded_quantification (quantifier_bound (identifier_ref) @set)) (#eq? @set "Foo"))"#;
+        assert_eq!(vec![paths[0].as_path()], index.candidate_paths(query));
+        let matches = index.search(query).unwrap();
+        assert_eq!(1, matches.len());
+        assert_eq!("set", matches[0].captures[0].0);
+        assert_eq!(2, index.candidate_paths("(bounded_quantification)").len());
+        assert!(index.candidate_paths("(theorem)").is_empty());
+
+        index.remove_file(&paths[0]);
+        assert!(index.search(query).unwrap().is_empty());
+        fs::remove_dir_all(&dir).unwrap();
+    }
+}
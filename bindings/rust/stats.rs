@@ -0,0 +1,281 @@
+//! Instrumentation of the parser's GLR behaviour and of tree size.
+//!
+//! The grammar declares a number of `conflicts`; wherever one of them is hit,
+//! tree-sitter splits its parse stack into several versions and carries them
+//! all forward until all but one fail or they merge back together. This is
+//! invisible in the resulting tree but can dominate parse time. Parsing with
+//! [parse_with_stats][] records how often that happens, and in which parse
+//! states, by listening to the parser's debug log. The same log shows how
+//! much work the external scanner does looking ahead at each token.
+//!
+//! Memory held by a tree is dominated by its nodes, so [TreeStats][] counts
+//! them by kind and estimates the bytes they occupy.
+
+use std::cell::RefCell;
+use std::collections::HashMap;
+use std::rc::Rc;
+use tree_sitter::{LogType, Node, Parser, Tree};
+
+/// Counts of parse stack activity during one parse.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct ParseStats {
+    /// Times the parser processed a lookahead token on some stack version.
+    pub steps: usize,
+    /// Steps taken while more than one stack version was alive.
+    pub forked_steps: usize,
+    /// Times the number of stack versions grew.
+    pub forks: usize,
+    /// Times the number of stack versions shrank, by merging or discarding.
+    pub merges: usize,
+    /// Largest number of stack versions alive at once.
+    pub max_versions: usize,
+    /// Number of forks by the parse state processed just before each one.
+    pub fork_states: HashMap<u16, usize>,
+    /// Times the external scanner was called.
+    pub external_scans: usize,
+    /// Codepoints consumed or skipped by the external scanner, including
+    /// those of lookahead it discarded.
+    pub external_advances: usize,
+}
+
+// Position in the parse log carried from one message to the next.
+struct LogState {
+    version_count: usize,
+    state: u16,
+    is_external_lex: bool,
+}
+
+impl LogState {
+    fn new() -> Self {
+        LogState {
+            version_count: 1,
+            state: 0,
+            is_external_lex: false,
+        }
+    }
+}
+
+impl ParseStats {
+    /// Adds the counts of another parse to these.
+    pub fn add(&mut self, other: &ParseStats) {
+        self.steps += other.steps;
+        self.forked_steps += other.forked_steps;
+        self.forks += other.forks;
+        self.merges += other.merges;
+        self.max_versions = self.max_versions.max(other.max_versions);
+        for (&state, &count) in &other.fork_states {
+            *self.fork_states.entry(state).or_insert(0) += count;
+        }
+        self.external_scans += other.external_scans;
+        self.external_advances += other.external_advances;
+    }
+
+    /// Parse states ordered from the most to the least forks.
+    pub fn hottest_fork_states(&self) -> Vec<(u16, usize)> {
+        let mut states: Vec<(u16, usize)> = self.fork_states.iter().map(|(&s, &c)| (s, c)).collect();
+        states.sort_by(|a, b| b.1.cmp(&a.1).then(a.0.cmp(&b.0)));
+        states
+    }
+
+    // Records a line of the parse log.
+    fn record(&mut self, message: &str, last: &mut LogState) {
+        if message.starts_with("lex_external ") {
+            self.external_scans += 1;
+            last.is_external_lex = true;
+            return;
+        } else if message.starts_with("lex_internal ") {
+            last.is_external_lex = false;
+            return;
+        }
+        let fields = match message.strip_prefix("process ") {
+            Some(fields) => fields,
+            None => return,
+        };
+        let version_count = field(fields, "version_count").unwrap_or(1);
+        let state = field(fields, "state").unwrap_or(0) as u16;
+        self.steps += 1;
+        if version_count > 1 {
+            self.forked_steps += 1;
+        }
+        if version_count > last.version_count {
+            self.forks += 1;
+            *self.fork_states.entry(last.state).or_insert(0) += 1;
+        } else if version_count < last.version_count {
+            self.merges += 1;
+        }
+        self.max_versions = self.max_versions.max(version_count);
+        last.version_count = version_count;
+        last.state = state;
+        last.is_external_lex = false;
+    }
+
+    // Records a line of the lex log, which has one line per codepoint.
+    fn record_lex(&mut self, message: &str, last: &LogState) {
+        if last.is_external_lex && (message.starts_with("consume ") || message.starts_with("skip ")) {
+            self.external_advances += 1;
+        }
+    }
+}
+
+// Parses the value of a `name:value` field of a parse log message.
+fn field(fields: &str, name: &str) -> Option<usize> {
+    fields.split(", ").find_map(|field| {
+        let mut parts = field.splitn(2, ':');
+        if Some(name) == parts.next() {
+            parts.next()?.parse().ok()
+        } else {
+            None
+        }
+    })
+}
+
+/// Parses the source with the given parser while collecting [ParseStats][].
+/// Any logger already set on the parser is replaced for the duration of the
+/// parse and removed afterwards.
+pub fn parse_with_stats(parser: &mut Parser, source: &[u8], old_tree: Option<&Tree>) -> (Option<Tree>, ParseStats) {
+    let stats = Rc::new(RefCell::new(ParseStats::default()));
+    let log_stats = Rc::clone(&stats);
+    let mut last = LogState::new();
+    parser.set_logger(Some(Box::new(move |log_type, message| match log_type {
+        LogType::Parse => log_stats.borrow_mut().record(message, &mut last),
+        LogType::Lex => log_stats.borrow_mut().record_lex(message, &last),
+    })));
+    let tree = parser.parse(source, old_tree);
+    parser.set_logger(None);
+    let stats = stats.borrow().clone();
+    (tree, stats)
+}
+
+// Approximate sizes of tree-sitter's internal subtree representation: a
+// heap-allocated subtree header, and the pointer-sized reference to each
+// child held by its parent. Small single-line leaves are stored inline in
+// that reference and take no header.
+const SUBTREE_HEADER_SIZE: usize = 72;
+const SUBTREE_REFERENCE_SIZE: usize = 8;
+const MAX_INLINE_SIZE: usize = 255;
+
+/// Counts of the nodes making up a tree.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct TreeStats {
+    /// Bytes of source the tree was parsed from.
+    pub source_bytes: usize,
+    /// All nodes, including anonymous tokens.
+    pub nodes: usize,
+    /// Named nodes only.
+    pub named_nodes: usize,
+    /// Estimate of the memory taken by the nodes, in bytes. Only visible
+    /// nodes are counted, with their visible children: the node API skips
+    /// hidden subtrees, which still take a header and child slots each.
+    /// Hiding a rule therefore lowers this estimate without freeing memory;
+    /// only inlining it removes its subtrees.
+    pub estimated_bytes: usize,
+    /// Number of nodes of each kind.
+    pub kinds: HashMap<&'static str, usize>,
+}
+
+impl TreeStats {
+    /// Counts the nodes of a tree parsed from source of the given length.
+    pub fn new(tree: &Tree, source_bytes: usize) -> Self {
+        let mut stats = TreeStats {
+            source_bytes,
+            ..TreeStats::default()
+        };
+        let mut cursor = tree.walk();
+        loop {
+            stats.record(cursor.node());
+            if cursor.goto_first_child() {
+                continue;
+            }
+            while !cursor.goto_next_sibling() {
+                if !cursor.goto_parent() {
+                    return stats;
+                }
+            }
+        }
+    }
+
+    /// Adds the counts of another tree to these.
+    pub fn add(&mut self, other: &TreeStats) {
+        self.source_bytes += other.source_bytes;
+        self.nodes += other.nodes;
+        self.named_nodes += other.named_nodes;
+        self.estimated_bytes += other.estimated_bytes;
+        for (&kind, &count) in &other.kinds {
+            *self.kinds.entry(kind).or_insert(0) += count;
+        }
+    }
+
+    /// Nodes per KiB of source.
+    pub fn nodes_per_kib(&self) -> f64 {
+        if 0 == self.source_bytes {
+            0.0
+        } else {
+            self.nodes as f64 * 1024.0 / self.source_bytes as f64
+        }
+    }
+
+    /// Node kinds ordered from the most to the least frequent.
+    pub fn most_frequent_kinds(&self) -> Vec<(&'static str, usize)> {
+        let mut kinds: Vec<(&'static str, usize)> = self.kinds.iter().map(|(&k, &c)| (k, c)).collect();
+        kinds.sort_by(|a, b| b.1.cmp(&a.1).then(a.0.cmp(b.0)));
+        kinds
+    }
+
+    fn record(&mut self, node: Node) {
+        self.nodes += 1;
+        if node.is_named() {
+            self.named_nodes += 1;
+        }
+        *self.kinds.entry(node.kind()).or_insert(0) += 1;
+
+        let child_count = node.child_count();
+        let is_inline = 0 == child_count
+            && node.kind_id() < 255
+            && node.end_byte() - node.start_byte() < MAX_INLINE_SIZE
+            && node.start_position().row == node.end_position().row;
+        if !is_inline {
+            self.estimated_bytes += SUBTREE_HEADER_SIZE + child_count * SUBTREE_REFERENCE_SIZE;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{LogState, ParseStats};
+
+    #[test]
+    fn test_record_parse_log() {
+        let mut stats = ParseStats::default();
+        let mut last = LogState::new();
+        for message in [
+            "process version:0, version_count:1, state:10, row:0, col:0",
+            "lex_external state:2, row:0, column:4",
+            "lex_internal state:30, row:0, column:4",
+            "shift state:12",
+            "process version:0, version_count:2, state:12, row:0, col:4",
+            "process version:1, version_count:2, state:40, row:0, col:4",
+            "process version:0, version_count:1, state:13, row:0, col:5",
+        ]
+        .iter()
+        {
+            stats.record(message, &mut last);
+        }
+        assert_eq!(stats.steps, 4);
+        assert_eq!(stats.forked_steps, 2);
+        assert_eq!((stats.forks, stats.merges, stats.max_versions), (1, 1, 2));
+        assert_eq!(stats.hottest_fork_states(), vec![(10, 1)]);
+        assert_eq!(stats.external_scans, 1);
+    }
+
+    #[test]
+    fn test_record_lex_log() {
+        let mut stats = ParseStats::default();
+        let mut last = LogState::new();
+        stats.record("lex_external state:2, row:1, column:0", &mut last);
+        stats.record_lex("skip character:' '", &last);
+        stats.record_lex("consume character:'x'", &last);
+        stats.record("lex_internal state:30, row:1, column:0", &mut last);
+        stats.record_lex("consume character:'x'", &last);
+        assert_eq!((stats.external_scans, stats.external_advances), (1, 2));
+    }
+}
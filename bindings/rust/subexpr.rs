@@ -0,0 +1,509 @@
+//! Resolution of subexpression references such as `Op!lbl!2!<<!@`.
+//!
+//! TLA+ names parts of definitions by paths: a definition name, then labels
+//! or `LET` definitions within it, operand positions (`!2`, `!<<`, `!>>`),
+//! and `!:`, `!@` or `!(args)` for the body of a binder; a path may instead
+//! start from a proof step, as in `<2>3!1`. A [SubexprIndex][] records, for
+//! each module-level definition, theorem and assumption, the operands, body
+//! and named parts of every node a path can reach, so resolving a path costs
+//! one table lookup per component and one descent to fetch the final node.
+//! Positions within a definition are kept relative to its start, so edits
+//! outside a definition only shift it; only definitions overlapping an edit
+//! or tree-sitter's changed ranges are indexed again.
+
+use crate::units::{
+    edit_byte, named_children, text, top_level_modules, units_of, CachedUnit, Edits, UnitCache, UnitKey,
+};
+use std::collections::HashMap;
+use std::ops;
+use tree_sitter::{InputEdit, Node, Tree};
+
+// Named nodes that are not operands: the syntax of expressions, and the
+// proofs of proof steps.
+const SYNTAX_KINDS: [&str; 25] = [
+    "identifier",
+    "tuple_of_identifiers",
+    "def_eq",
+    "set_in",
+    "gets",
+    "all_map_to",
+    "maps_to",
+    "langle_bracket",
+    "rangle_bracket",
+    "rangle_bracket_sub",
+    "case_box",
+    "case_arrow",
+    "label_as",
+    "bullet_conj",
+    "bullet_disj",
+    "comment",
+    "block_comment",
+    "proof_step_id",
+    "level",
+    "placeholder",
+    "prefix_op_symbol",
+    "infix_op_symbol",
+    "postfix_op_symbol",
+    "terminal_proof",
+    "non_terminal_proof",
+];
+
+// Fields holding the syntax of an expression rather than its operands.
+const SYNTAX_FIELDS: [&str; 6] = ["symbol", "quantifier", "name", "parameter", "identifier", "definitions"];
+
+/// Resolves subexpression references within a tree, kept up to date across
+/// edits.
+pub struct SubexprIndex {
+    definitions: Vec<Definition>,
+    // Definitions by top-level module index and name.
+    names: HashMap<(usize, String), usize>,
+    // Byte ranges of the top-level modules.
+    modules: Vec<ops::Range<usize>>,
+    edited: Edits,
+}
+
+// The reachable nodes of one module-level unit. Entry 0 is what the unit's
+// name refers to: the body of a definition or the statement of a theorem.
+struct Definition {
+    kind_id: u16,
+    range: ops::Range<usize>,
+    name: Option<String>,
+    entries: Vec<Entry>,
+    // Labels and LET definitions, with the entries of what they name.
+    parts: Vec<(String, u32)>,
+    // Proof steps by their identifier, such as `<2>3`, in source order.
+    steps: Vec<(String, u32)>,
+}
+
+// A node reachable by a path, with its position relative to its definition.
+struct Entry {
+    kind_id: u16,
+    start: u32,
+    end: u32,
+    operands: Vec<u32>,
+    body: Option<u32>,
+}
+
+impl SubexprIndex {
+    /// Indexes every definition in the tree.
+    pub fn new(tree: &Tree, source: &[u8]) -> Self {
+        let mut index = SubexprIndex {
+            definitions: Vec::new(),
+            names: HashMap::new(),
+            modules: Vec::new(),
+            edited: Edits::new(),
+        };
+        index.rebuild(tree, source, &[tree.root_node().byte_range()]);
+        index
+    }
+
+    /// Shifts the definitions to account for an edit to the source, the same
+    /// way [Tree::edit][] shifts nodes. Call this alongside `Tree::edit` for
+    /// every edit, then [SubexprIndex::update][] once the tree has been
+    /// reparsed.
+    ///
+    /// [Tree::edit]: https://docs.rs/tree-sitter/*/tree_sitter/struct.Tree.html#method.edit
+    pub fn edit(&mut self, edit: &InputEdit) {
+        for definition in &mut self.definitions {
+            definition.range.start = edit_byte(definition.range.start, edit);
+            definition.range.end = edit_byte(definition.range.end, edit);
+        }
+        self.edited.edit(edit);
+    }
+
+    /// Brings the index up to date with a tree reparsed after the edits
+    /// passed to [SubexprIndex::edit][]. `old_tree` is the edited tree that
+    /// was passed to the parser. Only definitions overlapping an edit or a
+    /// changed range are indexed again.
+    pub fn update(&mut self, old_tree: &Tree, new_tree: &Tree, source: &[u8]) {
+        let dirty = self.edited.dirty(old_tree, new_tree);
+        if !dirty.is_empty() {
+            self.rebuild(new_tree, source, &dirty);
+        }
+    }
+
+    /// Resolves a `subexpression`, `prefixed_op` or `subexpr_prefix` node of
+    /// the tree to the node its path names. Returns None if the path doesn't
+    /// name a node of this tree: if it is malformed, or leads into a module
+    /// instantiated by the definition it starts from.
+    pub fn resolve<'t>(&self, tree: &'t Tree, source: &[u8], reference: Node<'t>) -> Option<Node<'t>> {
+        let (prefix, last) = match reference.kind() {
+            "subexpr_prefix" => (reference, None),
+            "prefixed_op" => (reference.child_by_field_name("prefix")?, reference.child_by_field_name("op")),
+            _ => (reference.named_child(0)?, reference.named_child(1)),
+        };
+        let mut steps: Vec<Node> = named_children(prefix).collect();
+        steps.extend(last);
+
+        let (first, rest) = steps.split_first()?;
+        let (definition_index, mut entry) = self.start(first, source, reference.start_byte())?;
+        let definition = &self.definitions[definition_index];
+        for step in rest {
+            entry = definition.step(entry, *step, source)?;
+        }
+        let entry = &definition.entries[entry as usize];
+        let start = definition.range.start + entry.start as usize;
+        let end = definition.range.start + entry.end as usize;
+        let mut node = tree.root_node().descendant_for_byte_range(start, end)?;
+        while node.kind_id() != entry.kind_id || node.byte_range() != (start..end) {
+            node = node.parent().filter(|parent| parent.byte_range() == (start..end))?;
+        }
+        Some(node)
+    }
+
+    // The definition and entry named by the first step of a path.
+    fn start(&self, step: &Node, source: &[u8], byte: usize) -> Option<(usize, u32)> {
+        let module = self.modules.iter().position(|module| module.contains(&byte))?;
+        if "proof_step_ref" == step.kind() {
+            let id = text(*step, source);
+            let index = self
+                .definitions
+                .iter()
+                .position(|definition| definition.range.contains(&byte))?;
+            let definition = &self.definitions[index];
+            let entry = definition
+                .steps
+                .iter()
+                .filter(|(step_id, entry)| {
+                    *step_id == id && definition.entries[*entry as usize].start as usize + definition.range.start < byte
+                })
+                .last()?
+                .1;
+            return Some((index, entry));
+        }
+        let name = component_name(*step, source)?;
+        let index = *self.names.get(&(module, name))?;
+        Some((index, 0))
+    }
+
+    fn rebuild(&mut self, tree: &Tree, source: &[u8], dirty: &[ops::Range<usize>]) {
+        let mut cached = UnitCache::new(self.definitions.drain(..), dirty);
+        self.names.clear();
+        self.modules.clear();
+        for module in top_level_modules(tree) {
+            for mut node in units_of(module) {
+                if "local_definition" == node.kind() {
+                    match node.named_child(0) {
+                        Some(definition) => node = definition,
+                        None => continue,
+                    }
+                }
+                let definition = match cached.reuse(node).or_else(|| Definition::build(node, source)) {
+                    Some(definition) => definition,
+                    None => continue,
+                };
+                if let Some(name) = &definition.name {
+                    self.names
+                        .insert((self.modules.len(), name.clone()), self.definitions.len());
+                }
+                self.definitions.push(definition);
+            }
+            self.modules.push(module.byte_range());
+        }
+    }
+}
+
+impl CachedUnit for Definition {
+    fn key(&self) -> UnitKey {
+        (self.kind_id, self.range.start, self.range.end)
+    }
+}
+
+impl Definition {
+    // Indexes a module-level unit, if it is a definition, theorem or
+    // assumption.
+    fn build(node: Node, source: &[u8]) -> Option<Self> {
+        let (name, root) = match node.kind() {
+            "operator_definition" | "function_definition" | "module_definition" => (
+                node.child_by_field_name("name").map(|name| text(name, source)),
+                node.child_by_field_name("definition")?,
+            ),
+            "theorem" | "assumption" => {
+                let first = node.named_child(0)?;
+                if "identifier" == first.kind() {
+                    (Some(text(first, source)), node.named_child(2)?)
+                } else {
+                    (None, first)
+                }
+            }
+            _ => return None,
+        };
+
+        let mut definition = Definition {
+            kind_id: node.kind_id(),
+            range: node.byte_range(),
+            name,
+            entries: Vec::new(),
+            parts: Vec::new(),
+            steps: Vec::new(),
+        };
+        let mut builder = Builder {
+            definition: &mut definition,
+            source,
+            ids: HashMap::new(),
+            pending: Vec::new(),
+        };
+        builder.add(root);
+        builder.finish();
+
+        // Proof steps, found by a walk of the proofs alone.
+        let mut proofs = nested_proofs(node);
+        while let Some(proof) = proofs.pop() {
+            for i in 0..proof.named_child_count() {
+                let step = proof.named_child(i).unwrap();
+                if let (Some(id), Some(content)) = (step.named_child(0), step.named_child(1)) {
+                    if "proof_step" == step.kind() && "proof_step_id" == id.kind() {
+                        let mut builder = Builder {
+                            definition: &mut definition,
+                            source,
+                            ids: HashMap::new(),
+                            pending: Vec::new(),
+                        };
+                        let entry = builder.add(content);
+                        builder.finish();
+                        let id = text(id, source).trim_end_matches('.').to_string();
+                        definition.steps.push((id, entry));
+                    }
+                }
+                proofs.extend(nested_proofs(step));
+            }
+        }
+        let entries = &definition.entries;
+        definition.steps.sort_by_key(|(_, entry)| entries[*entry as usize].start);
+        Some(definition)
+    }
+
+    // Follows one step of a path from an entry.
+    fn step(&self, entry: u32, step: Node, source: &[u8]) -> Option<u32> {
+        let current = &self.entries[entry as usize];
+        let nav = match step.kind() {
+            "subexpr_tree_nav" => step.named_child(0)?,
+            _ => step,
+        };
+        match nav.kind() {
+            "child_id" => {
+                let n: usize = text(nav, source).parse().ok()?;
+                current.operands.get(n.checked_sub(1)?).copied()
+            }
+            "langle_bracket" => current.operands.get(0).copied(),
+            "rangle_bracket" => current.operands.get(1).copied(),
+            "colon" | "address" | "operator_args" => current.body,
+            _ => {
+                // A label or LET definition within the current entry.
+                let name = component_name(step, source)?;
+                self.parts
+                    .iter()
+                    .find(|(part, target)| {
+                        let target = &self.entries[*target as usize];
+                        *part == name && current.start <= target.start && target.end <= current.end
+                    })
+                    .map(|(_, target)| *target)
+            }
+        }
+    }
+}
+
+// Adds the nodes reachable from a root to a definition's entries.
+struct Builder<'d, 'a, 't> {
+    definition: &'d mut Definition,
+    source: &'a [u8],
+    // Entries by node id, since a binder's body is also one of its operands.
+    ids: HashMap<usize, u32>,
+    pending: Vec<(Node<'t>, u32)>,
+}
+
+impl<'d, 'a, 't> Builder<'d, 'a, 't> {
+    fn add(&mut self, node: Node<'t>) -> u32 {
+        let node = transparent(node);
+        if let Some(&entry) = self.ids.get(&node.id()) {
+            return entry;
+        }
+        let start = self.definition.range.start;
+        let entry = self.definition.entries.len() as u32;
+        self.definition.entries.push(Entry {
+            kind_id: node.kind_id(),
+            start: (node.start_byte() - start) as u32,
+            end: (node.end_byte() - start) as u32,
+            operands: Vec::new(),
+            body: None,
+        });
+        self.ids.insert(node.id(), entry);
+        self.pending.push((node, entry));
+        entry
+    }
+
+    fn finish(&mut self) {
+        while let Some((node, entry)) = self.pending.pop() {
+            let mut operands = Vec::new();
+            let mut cursor = node.walk();
+            if cursor.goto_first_child() {
+                loop {
+                    let child = cursor.node();
+                    let is_syntax = cursor.field_name().map_or(false, |field| SYNTAX_FIELDS.contains(&field))
+                        || SYNTAX_KINDS.contains(&child.kind());
+                    if child.is_named() && !is_syntax {
+                        operands.push(self.add(child));
+                    }
+                    if !cursor.goto_next_sibling() {
+                        break;
+                    }
+                }
+            }
+            let body = body(node).map(|body| self.add(body));
+
+            match node.kind() {
+                "label" => {
+                    if let (Some(name), Some(expression)) = (node.named_child(0), node.named_child(node.named_child_count() - 1)) {
+                        let target = self.add(expression);
+                        self.definition.parts.push((text(name, self.source), target));
+                    }
+                }
+                "let_in" => {
+                    let mut cursor = node.walk();
+                    for child in node.children_by_field_name("definitions", &mut cursor) {
+                        if let (Some(name), Some(definition)) =
+                            (child.child_by_field_name("name"), child.child_by_field_name("definition"))
+                        {
+                            let target = self.add(definition);
+                            self.definition.parts.push((text(name, self.source), target));
+                        }
+                    }
+                }
+                _ => {}
+            }
+            let entry = &mut self.definition.entries[entry as usize];
+            entry.operands = operands;
+            entry.body = body;
+        }
+    }
+}
+
+// The non-terminal proofs among the children and grandchildren of a
+// theorem or proof step; a step's proof follows its statement.
+fn nested_proofs(node: Node) -> Vec<Node> {
+    let mut proofs = Vec::new();
+    for i in 0..node.named_child_count() {
+        let child = node.named_child(i).unwrap();
+        for j in 0..child.named_child_count() {
+            proofs.extend(child.named_child(j).filter(|proof| "non_terminal_proof" == proof.kind()));
+        }
+        if "non_terminal_proof" == child.kind() {
+            proofs.push(child);
+        }
+    }
+    proofs
+}
+
+// Skips nodes that a path sees through: parentheses, the bullets of
+// junction lists, the bound variables of quantifiers, and the keywords of
+// proof steps.
+fn transparent(mut node: Node) -> Node {
+    loop {
+        let next = match node.kind() {
+            "parentheses" | "have_proof_step" | "case_proof_step" | "suffices_proof_step" => node.named_child(0),
+            "conj_item" | "disj_item" => node.named_child(node.named_child_count().saturating_sub(1)),
+            "quantifier_bound" | "single_quantifier_bound" => {
+                node.child_by_field_name("set").or_else(|| node.named_child(node.named_child_count().saturating_sub(1)))
+            }
+            _ => None,
+        };
+        match next {
+            Some(next) => node = next,
+            None => return node,
+        }
+    }
+}
+
+// The expression a binder binds its variables in.
+fn body(node: Node) -> Option<Node> {
+    match node.kind() {
+        "bounded_quantification" | "unbounded_quantification" | "let_in" => node.child_by_field_name("expression"),
+        "set_filter" => node.child_by_field_name("filter"),
+        "set_map" => node.child_by_field_name("map"),
+        "choose" | "function_literal" | "lambda" | "label" => node.named_child(node.named_child_count().checked_sub(1)?),
+        _ => None,
+    }
+}
+
+// The name a path component refers to, ignoring any arguments.
+fn component_name(step: Node, source: &[u8]) -> Option<String> {
+    let mut node = step;
+    loop {
+        match node.kind() {
+            "identifier_ref" => return Some(text(node, source)),
+            "subexpr_component" => node = node.named_child(0)?,
+            "bound_op" => node = node.child_by_field_name("name")?,
+            _ => return None,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::SubexprIndex;
+    use crate::units::reparse;
+    use tree_sitter::{Node, Parser, Tree};
+
+    fn references(tree: &Tree) -> Vec<Node<'_>> {
+        let mut found = Vec::new();
+        let mut cursor = tree.walk();
+        loop {
+            let node = cursor.node();
+            if "subexpression" == node.kind() || "prefixed_op" == node.kind() {
+                found.push(node);
+            }
+            if cursor.goto_first_child() {
+                continue;
+            }
+            while !cursor.goto_next_sibling() {
+                if !cursor.goto_parent() {
+                    return found;
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn test_resolve_paths() {
+        let source = concat!(
+            "---- MODULE Test ----\n",
+            "Op(x) == x + (lbl :: \\A y \\in {x} : y = 2)\n",
+            "A == Op!1\n",
+            "B == Op!lbl!@\n",
+            "C == Op!lbl!<<\n",
+            "D == Op!2\n",
+            "====\n"
+        );
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(source, None).unwrap();
+        let index = SubexprIndex::new(&tree, source.as_bytes());
+        let resolved: Vec<&str> = references(&tree)
+            .into_iter()
+            .map(|reference| {
+                let node = index.resolve(&tree, source.as_bytes(), reference).unwrap();
+                &source[node.byte_range()]
+            })
+            .collect();
+        assert_eq!(resolved, vec!["x", "y = 2", "{x}", "lbl :: \\A y \\in {x} : y = 2"]);
+    }
+
+    #[test]
+    fn test_update_keeps_definitions_outside_edits() {
+        let source = "---- MODULE Test ----\nY == 5\nOp == 1 + 2\nA == Op!2\n====\n";
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let mut tree = parser.parse(source, None).unwrap();
+        let mut index = SubexprIndex::new(&tree, source.as_bytes());
+
+        // Lengthen the definition above Op, shifting Op without touching it.
+        let offset = source.find("5").unwrap() + 1;
+        let (new_source, edit, new_tree) = reparse(&mut parser, &mut tree, source, offset..offset, "0");
+        index.edit(&edit);
+        index.update(&tree, &new_tree, new_source.as_bytes());
+
+        let reference = references(&new_tree)[0];
+        let node = index.resolve(&new_tree, new_source.as_bytes(), reference).unwrap();
+        assert_eq!(&new_source[node.byte_range()], "2");
+    }
+}
@@ -0,0 +1,344 @@
+//! Translation of TLA+ operator symbols between their ASCII and Unicode
+//! spellings.
+//!
+//! The grammar accepts both spellings of every symbol, so translation is a
+//! matter of walking the tree once and replacing the text of each symbol
+//! node. The result is a list of [Splice][]s against the original source
+//! rather than a rewritten copy, so editors can apply it as a minimal edit.
+//!
+//! Replacing a symbol changes the width of its line, which would silently
+//! change the meaning of any conjunction or disjunction list bullet further
+//! along that line. To prevent this, the whitespace just before such a
+//! bullet is padded or trimmed so the bullet keeps its column; if there is
+//! not enough whitespace to trim, the symbols before the bullet are left
+//! alone.
+
+use std::ops;
+use tree_sitter::{Node, Tree};
+
+/// Direction in which to translate symbols.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum Direction {
+    /// Replace ASCII spellings with their Unicode equivalents.
+    ToUnicode,
+    /// Replace Unicode spellings with their ASCII equivalents.
+    ToAscii,
+}
+
+/// Replacement of a byte range of the source with new text.
+#[derive(Clone, Debug, PartialEq, Eq)]
+pub struct Splice {
+    pub range: ops::Range<usize>,
+    pub text: &'static str,
+}
+
+// A symbol node and its spellings; the first of each kind is canonical.
+struct Symbol {
+    kind: &'static str,
+    ascii: &'static [&'static str],
+    unicode: &'static [&'static str],
+}
+
+macro_rules! symbols {
+    ($($kind:literal: [$($ascii:literal),+] [$($unicode:literal),+],)*) => {
+        &[$(Symbol { kind: $kind, ascii: &[$($ascii),+], unicode: &[$($unicode),+] },)*]
+    };
+}
+
+const SYMBOLS: &[Symbol] = symbols! {
+    "def_eq":             ["=="] ["≜"],
+    "set_in":             ["\\in"] ["∈"],
+    "gets":               ["<-"] ["←", "⟵"],
+    "forall":             ["\\A", "\\forall"] ["∀"],
+    "exists":             ["\\E", "\\exists"] ["∃"],
+    "all_map_to":         ["|->"] ["↦", "⟼"],
+    "maps_to":            ["->"] ["→", "⟶"],
+    "langle_bracket":     ["<<"] ["⟨", "〈"],
+    "rangle_bracket":     [">>"] ["⟩", "〉"],
+    "rangle_bracket_sub": [">>_"] ["⟩_", "〉_"],
+    "case_box":           ["[]"] ["□"],
+    "case_arrow":         ["->"] ["→", "⟶"],
+    "label_as":           ["::"] ["∷"],
+    "nat_number_set":     ["Nat"] ["ℕ"],
+    "int_number_set":     ["Int"] ["ℤ"],
+    "real_number_set":    ["Real"] ["ℝ"],
+    "bullet_conj":        ["/\\"] ["∧"],
+    "bullet_disj":        ["\\/"] ["∨"],
+    "lnot":               ["~", "\\lnot", "\\neg"] ["¬"],
+    "always":             ["[]"] ["□"],
+    "eventually":         ["<>"] ["⋄"],
+    "implies":            ["=>"] ["⇒", "⟹"],
+    "plus_arrow":         ["-+->"] ["⇸", "⥅"],
+    "equiv":              ["\\equiv"] ["≡"],
+    "iff":                ["<=>"] ["⇔", "⟺"],
+    "leads_to":           ["~>"] ["↝", "⇝"],
+    "land":               ["/\\", "\\land"] ["∧"],
+    "lor":                ["\\/", "\\lor"] ["∨"],
+    "assign":             [":="] ["≔"],
+    "bnf_rule":           ["::="] ["⩴"],
+    "neq":                ["/=", "#"] ["≠"],
+    "leq":                ["<=", "=<", "\\leq"] ["≤"],
+    "geq":                [">=", "\\geq"] ["≥"],
+    "approx":             ["\\approx"] ["≈"],
+    "rs_ttile":           ["|-"] ["⊢"],
+    "rd_ttile":           ["|="] ["⊨"],
+    "ls_ttile":           ["-|"] ["⊣"],
+    "ld_ttile":           ["=|"] ["⫤"],
+    "asymp":              ["\\asymp"] ["≍"],
+    "cong":               ["\\cong"] ["≅"],
+    "doteq":              ["\\doteq"] ["≐"],
+    "gg":                 ["\\gg"] ["≫"],
+    "ll":                 ["\\ll"] ["≪"],
+    "in":                 ["\\in"] ["∈"],
+    "notin":              ["\\notin"] ["∉"],
+    "prec":               ["\\prec"] ["≺"],
+    "succ":               ["\\succ"] ["≻"],
+    "preceq":             ["\\preceq"] ["⪯"],
+    "succeq":             ["\\succeq"] ["⪰"],
+    "propto":             ["\\propto"] ["∝"],
+    "sim":                ["\\sim"] ["∼"],
+    "simeq":              ["\\simeq"] ["≃"],
+    "sqsubset":           ["\\sqsubset"] ["⊏"],
+    "sqsupset":           ["\\sqsupset"] ["⊐"],
+    "sqsubseteq":         ["\\sqsubseteq"] ["⊑"],
+    "sqsupseteq":         ["\\sqsupseteq"] ["⊒"],
+    "subset":             ["\\subset"] ["⊂"],
+    "supset":             ["\\supset"] ["⊃"],
+    "subseteq":           ["\\subseteq"] ["⊆"],
+    "supseteq":           ["\\supseteq"] ["⊇"],
+    "cap":                ["\\cap", "\\intersect"] ["∩"],
+    "cup":                ["\\cup", "\\union"] ["∪"],
+    "dots_2":             [".."] ["‥"],
+    "dots_3":             ["..."] ["…"],
+    "oplus":              ["\\oplus", "(+)"] ["⊕"],
+    "ominus":             ["\\ominus", "(-)"] ["⊖"],
+    "vertvert":           ["||"] ["‖"],
+    "odot":               ["\\odot", "(.)"] ["⊙"],
+    "oslash":             ["\\oslash", "(/)"] ["⊘"],
+    "otimes":             ["\\otimes", "(\\X)"] ["⊗"],
+    "bigcirc":            ["\\bigcirc"] ["◯"],
+    "bullet":             ["\\bullet"] ["●"],
+    "div":                ["\\div"] ["÷"],
+    "circ":               ["\\o", "\\circ"] ["∘"],
+    "star":               ["\\star"] ["⋆"],
+    "excl":               ["!!"] ["‼"],
+    "qq":                 ["??"] ["⁇"],
+    "sqcap":              ["\\sqcap"] ["⊓"],
+    "sqcup":              ["\\sqcup"] ["⊔"],
+    "uplus":              ["\\uplus"] ["⊎"],
+    "times":              ["\\X", "\\times"] ["×"],
+    "wr":                 ["\\wr"] ["≀"],
+    "cdot":               ["\\cdot"] ["⋅"],
+    "sup_plus":           ["^+"] ["⁺"],
+};
+
+const SPACES: &str = "                                                                ";
+
+/// Computes the splices translating every operator symbol in the tree in the
+/// given direction. Splices are ordered by position and do not overlap,
+/// except that insertions may share a start position with the replacement
+/// following them. Runs in time linear in the size of the tree.
+pub fn translate(tree: &Tree, source: &[u8], direction: Direction) -> Vec<Splice> {
+    let language = tree.language();
+    let mut symbols_by_kind: Vec<Option<&Symbol>> = vec![None; language.node_kind_count()];
+    for symbol in SYMBOLS {
+        let kind_id = language.id_for_node_kind(symbol.kind, true) as usize;
+        if kind_id > 0 && kind_id < symbols_by_kind.len() {
+            symbols_by_kind[kind_id] = Some(symbol);
+        }
+    }
+
+    let mut translator = Translator {
+        source,
+        direction,
+        splices: Vec::new(),
+        row: usize::MAX,
+        delta: 0,
+        segment_start: 0,
+    };
+    let mut cursor = tree.walk();
+    loop {
+        let node = cursor.node();
+        let symbol = symbols_by_kind.get(node.kind_id() as usize).copied().flatten();
+        let descend = match symbol {
+            Some(symbol) => {
+                translator.visit_symbol(node, symbol);
+                false
+            }
+            None => !node.is_error(),
+        };
+        if descend && cursor.goto_first_child() {
+            continue;
+        }
+        while !cursor.goto_next_sibling() {
+            if !cursor.goto_parent() {
+                return translator.splices;
+            }
+        }
+    }
+}
+
+/// Applies splices produced by [translate][] to the source they were
+/// computed against.
+pub fn apply(source: &str, splices: &[Splice]) -> String {
+    let mut result = String::with_capacity(source.len());
+    let mut offset = 0;
+    for splice in splices {
+        result.push_str(&source[offset..splice.range.start]);
+        result.push_str(splice.text);
+        offset = splice.range.end;
+    }
+    result.push_str(&source[offset..]);
+    result
+}
+
+struct Translator<'a> {
+    source: &'a [u8],
+    direction: Direction,
+    splices: Vec<Splice>,
+    // The row being translated.
+    row: usize,
+    // Change in width of the row so far, in codepoints.
+    delta: isize,
+    // Index of the first splice since the last column-sensitive symbol.
+    segment_start: usize,
+}
+
+impl<'a> Translator<'a> {
+    fn visit_symbol(&mut self, node: Node, symbol: &Symbol) {
+        let row = node.start_position().row;
+        if row != self.row {
+            self.row = row;
+            self.delta = 0;
+            self.segment_start = self.splices.len();
+        }
+
+        let start = node.start_byte();
+        let is_bullet = "bullet_conj" == symbol.kind || "bullet_disj" == symbol.kind;
+        if is_bullet {
+            self.restore_column(start);
+        }
+
+        let text = match std::str::from_utf8(&self.source[start..node.end_byte()]) {
+            Ok(text) => text,
+            Err(_) => return,
+        };
+        let (from, to) = match self.direction {
+            Direction::ToUnicode => (symbol.ascii, symbol.unicode),
+            Direction::ToAscii => (symbol.unicode, symbol.ascii),
+        };
+        if !from.contains(&text) {
+            return;
+        }
+
+        // The scanner does not treat \land and \lor as jlist bullets; turning
+        // one at the start of a line into ∧ or ∨ could start a new jlist item.
+        if !is_bullet && ("land" == symbol.kind || "lor" == symbol.kind) && self.starts_line(start) {
+            return;
+        }
+
+        let replacement = to[0];
+        self.splices.push(Splice {
+            range: start..node.end_byte(),
+            text: replacement,
+        });
+        self.delta += width(replacement) - width(text);
+
+        // Keep word-like ASCII spellings from running into adjacent identifiers.
+        let end = node.end_byte();
+        if Direction::ToAscii == self.direction
+            && replacement.ends_with(is_identifier_char)
+            && self.source.get(end).map_or(false, |&c| is_identifier_char(c as char))
+        {
+            self.splices.push(Splice {
+                range: end..end,
+                text: " ",
+            });
+            self.delta += 1;
+        }
+    }
+
+    /// Pads or trims the whitespace before a jlist bullet so it stays in the
+    /// column it had before translation; gives up on the translations since
+    /// the last bullet if there is not enough whitespace to trim.
+    fn restore_column(&mut self, start: usize) {
+        if self.delta < 0 {
+            let mut padding = (-self.delta) as usize;
+            while padding > 0 {
+                let length = padding.min(SPACES.len());
+                self.splices.push(Splice {
+                    range: start..start,
+                    text: &SPACES[..length],
+                });
+                padding -= length;
+            }
+        } else if self.delta > 0 {
+            let excess = self.delta as usize;
+            let spaces = self.source[..start]
+                .iter()
+                .rev()
+                .take_while(|&&c| b' ' == c)
+                .count();
+            // Keep at least one space separating the bullet from what precedes it.
+            if spaces > excess {
+                self.splices.push(Splice {
+                    range: start - excess..start,
+                    text: "",
+                });
+            } else {
+                self.splices.truncate(self.segment_start);
+            }
+        }
+
+        self.delta = 0;
+        self.segment_start = self.splices.len();
+    }
+
+    fn starts_line(&self, start: usize) -> bool {
+        self.source[..start]
+            .iter()
+            .rev()
+            .take_while(|&&c| b'\n' != c)
+            .all(|c| c.is_ascii_whitespace())
+    }
+}
+
+// Width of text in codepoints, which is how the external scanner measures columns.
+fn width(text: &str) -> isize {
+    text.chars().count() as isize
+}
+
+fn is_identifier_char(c: char) -> bool {
+    c.is_alphanumeric() || '_' == c
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{apply, translate, Direction};
+    use tree_sitter::Parser;
+
+    fn round_trip(source: &str, direction: Direction) -> String {
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let tree = parser.parse(source, None).unwrap();
+        apply(source, &translate(&tree, source.as_bytes(), direction))
+    }
+
+    #[test]
+    fn test_translate_preserves_jlist_columns() {
+        let ascii = concat!(
+            "---- MODULE Test ----\n",
+            "Init == /\\ x \\in Nat\n",
+            "        /\\ y = <<1, 2>>\n",
+            "====\n"
+        );
+        let unicode = concat!(
+            "---- MODULE Test ----\n",
+            "Init ≜  ∧ x ∈ ℕ\n",
+            "        ∧ y = ⟨1, 2⟩\n",
+            "====\n"
+        );
+        assert_eq!(round_trip(ascii, Direction::ToUnicode), unicode);
+        assert_eq!(round_trip(unicode, Direction::ToAscii), ascii);
+    }
+}
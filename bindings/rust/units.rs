@@ -0,0 +1,259 @@
+//! Module-level units, and the bookkeeping shared by the analyses that keep
+//! one entry per unit up to date across edits.
+//!
+//! Those analyses, such as [crate::diagnostics][], all follow the same
+//! cycle. Each edit shifts their entries and is recorded in an [Edits][].
+//! Once the tree is reparsed, [Edits::dirty][] turns the recorded edits,
+//! together with tree-sitter's changed ranges, into the ranges to look at
+//! again. A [UnitCache][] then hands back the entry of every unit clear of
+//! those ranges, and the entries it did not hand back, so an analysis
+//! keeping indexes of its own can unlink them.
+
+use std::collections::HashMap;
+use std::ops;
+use tree_sitter::{InputEdit, Node, Point, Range, Tree};
+
+/// Identifies a unit across reparses: its kind, start byte and end byte.
+pub(crate) type UnitKey = (u16, usize, usize);
+
+/// An entry kept for a unit.
+pub(crate) trait CachedUnit {
+    fn key(&self) -> UnitKey;
+}
+
+/// Byte ranges of the current source edited since the last update.
+pub(crate) struct Edits {
+    ranges: Vec<ops::Range<usize>>,
+}
+
+impl Edits {
+    pub(crate) fn new() -> Self {
+        Edits { ranges: Vec::new() }
+    }
+
+    /// Shifts the ranges recorded so far for an edit, and records its own.
+    pub(crate) fn edit(&mut self, edit: &InputEdit) {
+        for range in &mut self.ranges {
+            range.start = edit_byte(range.start, edit);
+            range.end = edit_byte(range.end, edit);
+        }
+        self.ranges.push(edit.start_byte..edit.new_end_byte);
+    }
+
+    /// The ranges of the reparsed tree to look at again: those edited since
+    /// the last call, and those tree-sitter reports as changed between the
+    /// edited tree passed to the parser and the new one.
+    pub(crate) fn dirty(&mut self, old_tree: &Tree, new_tree: &Tree) -> Vec<ops::Range<usize>> {
+        let mut dirty: Vec<ops::Range<usize>> = self.ranges.drain(..).collect();
+        dirty.extend(
+            old_tree
+                .changed_ranges(new_tree)
+                .map(|range| range.start_byte..range.end_byte),
+        );
+        dirty
+    }
+}
+
+/// The entries of the units of a tree before a reparse, by key.
+pub(crate) struct UnitCache<'a, U> {
+    units: HashMap<UnitKey, U>,
+    dirty: &'a [ops::Range<usize>],
+    dropped: Vec<U>,
+}
+
+impl<'a, U: CachedUnit> UnitCache<'a, U> {
+    pub(crate) fn new(units: impl IntoIterator<Item = U>, dirty: &'a [ops::Range<usize>]) -> Self {
+        UnitCache {
+            units: units.into_iter().map(|unit| (unit.key(), unit)).collect(),
+            dirty,
+            dropped: Vec::new(),
+        }
+    }
+
+    /// The entry of a unit node, if its key is unchanged and it is clear of
+    /// the dirty ranges.
+    pub(crate) fn reuse(&mut self, node: Node) -> Option<U> {
+        self.reuse_if(node, |_| true)
+    }
+
+    /// As [UnitCache::reuse][], if the entry is also still current. An entry
+    /// found under the node's key but not reused is dropped.
+    pub(crate) fn reuse_if(&mut self, node: Node, is_current: impl FnOnce(&U) -> bool) -> Option<U> {
+        let unit = self.units.remove(&(node.kind_id(), node.start_byte(), node.end_byte()))?;
+        if !overlaps_any(node.byte_range(), self.dirty) && is_current(&unit) {
+            Some(unit)
+        } else {
+            self.dropped.push(unit);
+            None
+        }
+    }
+
+    /// The entries not reused: those replaced by a fresh entry for the same
+    /// key, and those of units no longer in the tree.
+    pub(crate) fn into_dropped(self) -> Vec<U> {
+        let mut dropped = self.dropped;
+        dropped.extend(self.units.into_values());
+        dropped
+    }
+}
+
+// Ranges touching at an endpoint count as overlapping, since an edit right
+// at the end of a node can extend it.
+pub(crate) fn overlaps_any(range: ops::Range<usize>, ranges: &[ops::Range<usize>]) -> bool {
+    ranges
+        .iter()
+        .any(|other| range.start <= other.end && other.start <= range.end)
+}
+
+pub(crate) fn edit_range(range: &mut Range, edit: &InputEdit) {
+    range.start_point = edit_point(range.start_byte, range.start_point, edit);
+    range.end_point = edit_point(range.end_byte, range.end_point, edit);
+    range.start_byte = edit_byte(range.start_byte, edit);
+    range.end_byte = edit_byte(range.end_byte, edit);
+}
+
+pub(crate) fn edit_byte(byte: usize, edit: &InputEdit) -> usize {
+    if byte >= edit.old_end_byte {
+        byte - edit.old_end_byte + edit.new_end_byte
+    } else if byte > edit.start_byte {
+        edit.new_end_byte.min(byte)
+    } else {
+        byte
+    }
+}
+
+fn edit_point(byte: usize, point: Point, edit: &InputEdit) -> Point {
+    if byte >= edit.old_end_byte {
+        if point.row == edit.old_end_position.row {
+            Point::new(
+                edit.new_end_position.row,
+                point.column - edit.old_end_position.column + edit.new_end_position.column,
+            )
+        } else {
+            Point::new(
+                point.row - edit.old_end_position.row + edit.new_end_position.row,
+                point.column,
+            )
+        }
+    } else if byte > edit.start_byte {
+        edit.new_end_position.min(point)
+    } else {
+        point
+    }
+}
+
+pub(crate) fn top_level_modules(tree: &Tree) -> Vec<Node<'_>> {
+    named_children(tree.root_node())
+        .filter(|node| "module" == node.kind())
+        .collect()
+}
+
+/// The module-level units of a module: everything after its header.
+pub(crate) fn units_of<'a>(module: Node<'a>) -> impl Iterator<Item = Node<'a>> {
+    let name = module.child_by_field_name("name");
+    named_children(module).filter(move |node| Some(*node) != name)
+}
+
+pub(crate) fn named_children<'a>(node: Node<'a>) -> impl Iterator<Item = Node<'a>> {
+    (0..node.named_child_count()).map(move |i| node.named_child(i).unwrap())
+}
+
+pub(crate) fn text(node: Node, source: &[u8]) -> String {
+    String::from_utf8_lossy(&source[node.byte_range()]).into_owned()
+}
+
+/// Replaces a byte range of a source with some text, returning the new
+/// source and the edit describing the change.
+#[cfg(test)]
+pub(crate) fn replace(source: &str, range: ops::Range<usize>, text: &str) -> (String, InputEdit) {
+    let point = |source: &str, byte: usize| {
+        let line_start = source[..byte].rfind('\n').map_or(0, |i| i + 1);
+        Point::new(source[..byte].matches('\n').count(), byte - line_start)
+    };
+    let new_source = [&source[..range.start], text, &source[range.end..]].concat();
+    let edit = InputEdit {
+        start_byte: range.start,
+        old_end_byte: range.end,
+        new_end_byte: range.start + text.len(),
+        start_position: point(source, range.start),
+        old_end_position: point(source, range.end),
+        new_end_position: point(&new_source, range.start + text.len()),
+    };
+    (new_source, edit)
+}
+
+/// As [replace][], also editing and reparsing the tree of the source.
+/// Returns the new source, the edit and the new tree; `tree` is left as the
+/// edited tree passed to the parser.
+#[cfg(test)]
+pub(crate) fn reparse(
+    parser: &mut tree_sitter::Parser,
+    tree: &mut Tree,
+    source: &str,
+    range: ops::Range<usize>,
+    text: &str,
+) -> (String, InputEdit, Tree) {
+    let (new_source, edit) = replace(source, range, text);
+    tree.edit(&edit);
+    let new_tree = parser.parse(&new_source, Some(tree)).unwrap();
+    (new_source, edit, new_tree)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{replace, reparse, top_level_modules, units_of, CachedUnit, Edits, UnitCache, UnitKey};
+    use tree_sitter::{Parser, Point};
+
+    #[test]
+    fn test_replace_and_edits() {
+        let source = "ab\ncd\nef\n";
+        let (new_source, edit) = replace(source, 4..7, "X\nYZ");
+        assert_eq!("ab\ncX\nYZf\n", new_source);
+        assert_eq!(
+            (Point::new(1, 1), Point::new(2, 1), Point::new(2, 2)),
+            (edit.start_position, edit.old_end_position, edit.new_end_position)
+        );
+
+        let mut edits = Edits::new();
+        edits.edit(&edit);
+        let (_, later) = replace(&new_source, 0..1, "");
+        edits.edit(&later);
+        assert_eq!(vec![3..7, 0..0], edits.ranges);
+    }
+
+    struct Unit(UnitKey);
+
+    impl CachedUnit for Unit {
+        fn key(&self) -> UnitKey {
+            self.0
+        }
+    }
+
+    #[test]
+    fn test_unit_cache_drops_replaced_units() {
+        let source = "---- MODULE Test ----\nA == 1\nB == 2\nC == 3\n====\n";
+        let mut parser = Parser::new();
+        parser.set_language(crate::language()).unwrap();
+        let mut tree = parser.parse(source, None).unwrap();
+        let keys: Vec<UnitKey> = units_of(top_level_modules(&tree)[0])
+            .map(|node| (node.kind_id(), node.start_byte(), node.end_byte()))
+            .collect();
+
+        // A same-length edit leaves B's key unchanged, and C is made to look
+        // out of date.
+        let mut edits = Edits::new();
+        let start = source.find('2').unwrap();
+        let (source, edit, new_tree) = reparse(&mut parser, &mut tree, source, start..start + 1, "5");
+        edits.edit(&edit);
+        let dirty = edits.dirty(&tree, &new_tree);
+        let mut cache = UnitCache::new(keys.iter().map(|&key| Unit(key)), &dirty);
+        let reused: Vec<bool> = units_of(top_level_modules(&new_tree)[0])
+            .map(|node| cache.reuse_if(node, |unit| unit.0.1 != keys[2].1).is_some())
+            .collect();
+        assert_eq!(vec![true, false, false], reused);
+        let mut dropped: Vec<UnitKey> = cache.into_dropped().into_iter().map(|unit| unit.0).collect();
+        dropped.sort();
+        assert_eq!(keys[1..].to_vec(), dropped);
+        assert!(source.contains("B == 5"));
+    }
+}
@@ -0,0 +1,75 @@
+// Reports the size, instantiation time and parse throughput of WebAssembly
+// builds of the parser, such as the -Os and -O3 variants built by
+// script/build-wasm.
+//
+// Usage: node script/measure-wasm.js <wasm file>... -- <file or directory>...
+//
+// Needs web-tree-sitter, which is not a dependency of the package; install
+// the version matching the CLI with `npm install --no-save web-tree-sitter@0.20`.
+
+const fs = require('fs');
+const path = require('path');
+const { performance } = require('perf_hooks');
+const Parser = require('web-tree-sitter');
+
+const ROUNDS = 5;
+
+function collect(target, files) {
+  if (fs.statSync(target).isDirectory()) {
+    for (const entry of fs.readdirSync(target).sort()) {
+      collect(path.join(target, entry), files);
+    }
+  } else if (target.endsWith('.tla')) {
+    files.push(target);
+  }
+}
+
+async function measure(wasmPath, sources) {
+  const bytes = fs.readFileSync(wasmPath);
+  const start = performance.now();
+  const language = await Parser.Language.load(bytes);
+  const instantiateMs = performance.now() - start;
+
+  const parser = new Parser();
+  parser.setLanguage(language);
+  let sourceBytes = 0;
+  let elapsedMs = 0;
+  for (let round = 0; round < ROUNDS; round++) {
+    for (const source of sources) {
+      const parseStart = performance.now();
+      const tree = parser.parse(source);
+      elapsedMs += performance.now() - parseStart;
+      sourceBytes += Buffer.byteLength(source);
+      tree.delete();
+    }
+  }
+  parser.delete();
+
+  const mib = sourceBytes / (1024 * 1024);
+  console.log(
+    `${wasmPath}: ${bytes.length} B, instantiated in ${instantiateMs.toFixed(1)} ms, ` +
+    `${(mib / (elapsedMs / 1000)).toFixed(2)} MiB/s over ${ROUNDS} rounds`
+  );
+}
+
+async function main() {
+  const args = process.argv.slice(2);
+  const split = args.indexOf('--');
+  if (split < 1 || split === args.length - 1) {
+    console.error('usage: node script/measure-wasm.js <wasm file>... -- <file or directory>...');
+    process.exit(1);
+  }
+
+  const files = [];
+  for (const target of args.slice(split + 1)) {
+    collect(target, files);
+  }
+  const sources = files.map((file) => fs.readFileSync(file, 'utf8'));
+
+  await Parser.init();
+  for (const wasmPath of args.slice(0, split)) {
+    await measure(wasmPath, sources);
+  }
+}
+
+main();
@@ -1,9 +1,10 @@
 ﻿#include <tree_sitter/parser.h>
 #include <cassert>
 #include <climits>
+#include <cstdlib>
 #include <cstring>
 #include <cwctype>
-#include <vector>
+#include <new>
 
 /**
  * Macro; goes to the lexer state without consuming any codepoints.
@@ -74,6 +75,84 @@ namespace {
 
   // Datatype used to record proof levels.
   using proof_level = int32_t;
+
+  /**
+   * A growable array of trivially-copyable values. This stands in for
+   * std::vector, which pulls a good deal of the C++ standard library into
+   * the wasm build and needs symbols the tree-sitter web runtime does not
+   * provide to the modules it loads.
+   */
+  template <typename T>
+  class Array {
+    T* contents;
+    size_t length;
+    size_t capacity;
+
+    void reserve(size_t const new_capacity) {
+      if (new_capacity > capacity) {
+        T* const new_contents =
+          static_cast<T*>(realloc(contents, new_capacity * sizeof(T)));
+        if (NULL == new_contents) {
+          abort();
+        }
+
+        contents = new_contents;
+        capacity = new_capacity;
+      }
+    }
+
+  public:
+    Array() : contents(NULL), length(0), capacity(0) { }
+
+    ~Array() {
+      free(contents);
+    }
+
+    Array(const Array&) = delete;
+    Array& operator=(const Array&) = delete;
+
+    size_t size() const { return length; }
+
+    bool empty() const { return 0 == length; }
+
+    T* data() { return contents; }
+
+    T& operator[](size_t const index) { return contents[index]; }
+
+    const T& operator[](size_t const index) const { return contents[index]; }
+
+    T& back() { return contents[length - 1]; }
+
+    const T& back() const { return contents[length - 1]; }
+
+    void push_back(const T& value) {
+      if (length == capacity) {
+        reserve(capacity > 0 ? 2 * capacity : 8);
+      }
+
+      contents[length++] = value;
+    }
+
+    void pop_back() {
+      if (length > 0) {
+        length--;
+      }
+    }
+
+    void clear() {
+      length = 0;
+    }
+
+    /**
+     * Sets the number of values; values added are left uninitialized.
+     *
+     * @param new_length The new number of values.
+     */
+    void resize(size_t const new_length) {
+      reserve(new_length);
+      length = new_length;
+    }
+  };
   
   /**
    * Advances the scanner while marking the codepoint as non-whitespace.
@@ -350,11 +429,11 @@ namespace {
      * 
      * @param raw_level The unparsed contents of the <...> lexeme.
      */
-    ProofStepId(const std::vector<char>& raw_level) {
+    ProofStepId(const Array<char>& raw_level) {
       level = -1;
-      if ('*' == raw_level.at(0)) {
+      if ('*' == raw_level[0]) {
         type = ProofStepIdType_STAR;
-      } else if ('+' == raw_level.at(0)) {
+      } else if ('+' == raw_level[0]) {
         type = ProofStepIdType_PLUS;
       } else {
         type = ProofStepIdType_NUMBERED;
@@ -366,7 +445,7 @@ namespace {
         int32_t multiplier = 1;
         for (size_t i = 0; i < raw_level.size(); i++) {
           const size_t index = raw_level.size() - i - 1;
-          int8_t digit_value = raw_level.at(index) - 48;
+          int8_t digit_value = raw_level[index] - 48;
           level += digit_value * multiplier;
           multiplier *= 10;
         }
@@ -466,29 +545,68 @@ namespace {
     LexState_END_OF_FILE
   };
   
+  /**
+   * Checks whether the column of a lexeme could affect how it is handled.
+   * The column is needed to interpret junct tokens, which start jlists,
+   * and any token inside a jlist, which might end it.
+   *
+   * @param codepoint The first codepoint of the lexeme.
+   * @param is_in_jlist Whether the scanner is currently in a jlist.
+   * @return Whether the column of the lexeme is needed.
+   */
+  bool is_column_needed(int32_t const codepoint, bool const is_in_jlist) {
+    return is_in_jlist
+      || '/' == codepoint
+      || '\\' == codepoint
+      || L'∧' == codepoint
+      || L'∨' == codepoint;
+  }
+
   /**
    * Looks ahead to identify the next lexeme. Consumes all leading
-   * whitespace. Out parameters include column of first non-whitespace
-   * codepoint and the level of the proof step ID lexeme if encountered.
+   * whitespace. Out parameters include column & value of the first
+   * non-whitespace codepoint and the level of the proof step ID lexeme
+   * if encountered.
+   *
+   * Asking tree-sitter for the column rescans the line from its start,
+   * which is quadratic over very long lines. If the leading whitespace
+   * includes a newline the column is instead counted while skipping it;
+   * otherwise it is only looked up if the lexeme's handling depends on
+   * it, and left negative if not.
    *
    * @param lexer The tree-sitter lexing control structure.
+   * @param is_in_jlist Whether the scanner is currently in a jlist.
    * @param lexeme_start_col The starting column of the first lexeme. 
+   * @param lexeme_start_codepoint The first codepoint of the first lexeme.
    * @param proof_step_id_level The level of the proof step ID.
    * @return The lexeme encountered.
    */
   Lexeme lex_lookahead(
     TSLexer* const lexer,
+    bool const is_in_jlist,
     column_index& lexeme_start_col,
-    std::vector<char>& proof_step_id_level
+    int32_t& lexeme_start_codepoint,
+    Array<char>& proof_step_id_level
   ) {
     LexState state = LexState_CONSUME_LEADING_SPACE;
     Lexeme result_lexeme = Lexeme_OTHER;
+    lexeme_start_col = -1;
     START_LEXER();
     eof = !has_next(lexer);
     switch (state) {
       case LexState_CONSUME_LEADING_SPACE:
-        if (iswspace(lookahead)) SKIP(LexState_CONSUME_LEADING_SPACE);
-        lexeme_start_col = lexer->get_column(lexer);
+        if ('\n' == lookahead) {
+          lexeme_start_col = 0;
+          SKIP(LexState_CONSUME_LEADING_SPACE);
+        }
+        if (iswspace(lookahead)) {
+          if (lexeme_start_col >= 0) lexeme_start_col++;
+          SKIP(LexState_CONSUME_LEADING_SPACE);
+        }
+        if (lexeme_start_col < 0 && is_column_needed(lookahead, is_in_jlist)) {
+          lexeme_start_col = lexer->get_column(lexer);
+        }
+        lexeme_start_codepoint = lookahead;
         lexer->mark_end(lexer);
         if (eof) ADVANCE(LexState_END_OF_FILE);
         if ('/' == lookahead) ADVANCE(LexState_FORWARD_SLASH);
@@ -963,10 +1081,10 @@ namespace {
   struct Scanner {
 
     //The nested junction lists at the current lexer position.
-    std::vector<JunctList> jlists;
+    Array<JunctList> jlists;
 
     // The nested proofs at the current lexer position.
-    std::vector<proof_level> proofs;
+    Array<proof_level> proofs;
 
     // The level of the last proof.
     proof_level last_proof_level;
@@ -974,6 +1092,20 @@ namespace {
     // Whether we have seen a PROOF token.
     bool have_seen_proof_keyword;
 
+    // The number of further DEDENT tokens to emit at the current lexer
+    // position, when a single token closes multiple jlists at once.
+    nest_address pending_dedents;
+
+    // The first codepoint and the column of the token closing the jlists;
+    // used to check pending DEDENT tokens are emitted at the position they
+    // apply to. The lexer does not expose byte positions.
+    int32_t pending_dedent_codepoint;
+    column_index pending_dedent_token_column;
+
+    // Jlists with an alignment column at or after this are closed by the
+    // pending DEDENT tokens.
+    column_index pending_dedent_column;
+
     /**
      * Initializes a new instance of the Scanner object.
      */
@@ -1023,6 +1155,27 @@ namespace {
       offset += copied;
       byte_count += copied;
 
+      copied = sizeof(nest_address);
+      memcpy(&buffer[offset], &pending_dedents, copied);
+      offset += copied;
+      byte_count += copied;
+      if (has_pending_dedents()) {
+        copied = sizeof(int32_t);
+        memcpy(&buffer[offset], &pending_dedent_codepoint, copied);
+        offset += copied;
+        byte_count += copied;
+
+        copied = sizeof(column_index);
+        memcpy(&buffer[offset], &pending_dedent_token_column, copied);
+        offset += copied;
+        byte_count += copied;
+
+        copied = sizeof(column_index);
+        memcpy(&buffer[offset], &pending_dedent_column, copied);
+        offset += copied;
+        byte_count += copied;
+      }
+
       return byte_count;
     }
 
@@ -1040,6 +1193,7 @@ namespace {
       proofs.clear();
       last_proof_level = -1;
       have_seen_proof_keyword = false;
+      clear_pending_dedents();
 
       if (length > 0) {
         unsigned offset = 0;
@@ -1072,6 +1226,23 @@ namespace {
         copied = sizeof(uint8_t);
         have_seen_proof_keyword = static_cast<bool>(buffer[offset] & 1);
         offset += copied;
+
+        copied = sizeof(nest_address);
+        memcpy(&pending_dedents, &buffer[offset], copied);
+        offset += copied;
+        if (has_pending_dedents()) {
+          copied = sizeof(int32_t);
+          memcpy(&pending_dedent_codepoint, &buffer[offset], copied);
+          offset += copied;
+
+          copied = sizeof(column_index);
+          memcpy(&pending_dedent_token_column, &buffer[offset], copied);
+          offset += copied;
+
+          copied = sizeof(column_index);
+          memcpy(&pending_dedent_column, &buffer[offset], copied);
+          offset += copied;
+        }
  
         assert(offset == length);
       }
@@ -1161,6 +1332,113 @@ namespace {
       return true;
     }
 
+    /**
+     * Counts the jlists, innermost first, with an alignment column at or
+     * after the given column.
+     * 
+     * @param col The column from which to count jlists.
+     * @return The number of jlists at or after the given column.
+     */
+    nest_address count_jlists_from_column(column_index const col) const {
+      nest_address count = 0;
+      for (size_t i = jlists.size(); i > 0 && jlists[i - 1].alignment_column >= col; i--) {
+        count++;
+      }
+
+      return count;
+    }
+
+    /**
+     * Emits the first of the DEDENT tokens closing all jlists with an
+     * alignment column at or after the given column, and records the rest
+     * as pending. The pending DEDENT tokens are then emitted by subsequent
+     * calls to the scanner without lexing the closing token again; since
+     * DEDENT tokens are zero-width, those calls start at the same position.
+     * 
+     * If the column of the closing token is unknown, nothing is left
+     * pending and the token is lexed again for each further DEDENT.
+     * 
+     * @param lexer The tree-sitter lexing control structure.
+     * @param next_codepoint The first codepoint of the closing token.
+     * @param next_col The column of the closing token; -1 if unknown.
+     * @param col The column from which to close jlists.
+     * @return Whether a DEDENT token was emitted.
+     */
+    bool emit_dedents_from_column(
+      TSLexer* const lexer,
+      int32_t const next_codepoint,
+      column_index const next_col,
+      column_index const col
+    ) {
+      const nest_address count = count_jlists_from_column(col);
+      if (count > 1 && next_col >= 0) {
+        pending_dedents = count - 1;
+        pending_dedent_codepoint = next_codepoint;
+        pending_dedent_token_column = next_col;
+        pending_dedent_column = col;
+      }
+
+      return count > 0 && emit_dedent(lexer);
+    }
+
+    /**
+     * Whether there are DEDENT tokens left to emit from closing multiple
+     * jlists at once.
+     * 
+     * @return Whether there are pending DEDENT tokens.
+     */
+    bool has_pending_dedents() const {
+      return pending_dedents > 0;
+    }
+
+    /**
+     * Whether a pending DEDENT token can be emitted here. The lexer must
+     * still be at the token which closed the jlists, as far as its first
+     * codepoint and column tell, the next jlist must be one that token
+     * closes, and tree-sitter must be expecting a DEDENT. If any of these
+     * do not hold, the token is lexed again as usual.
+     * 
+     * @param lexer The tree-sitter lexing control structure.
+     * @param valid_symbols Tokens possibly expected in this spot.
+     * @return Whether a pending DEDENT token can be emitted.
+     */
+    bool can_emit_pending_dedent(
+      TSLexer* const lexer,
+      const bool* const valid_symbols
+    ) const {
+      return has_pending_dedents()
+        && valid_symbols[DEDENT]
+        && is_in_jlist()
+        && is_next_codepoint(lexer, pending_dedent_codepoint)
+        && get_current_jlist_column_index() >= pending_dedent_column
+        && lexer->get_column(lexer) == static_cast<uint32_t>(pending_dedent_token_column);
+    }
+
+    /**
+     * Emits a pending DEDENT token.
+     * 
+     * @param lexer The tree-sitter lexing control structure.
+     * @return Whether a DEDENT token was emitted.
+     */
+    bool emit_pending_dedent(TSLexer* const lexer) {
+      pending_dedents--;
+      if (!has_pending_dedents()) {
+        clear_pending_dedents();
+      }
+
+      return emit_dedent(lexer);
+    }
+
+    /**
+     * Discards any pending DEDENT tokens.
+     */
+    void clear_pending_dedents() {
+      pending_dedents = 0;
+      pending_dedent_codepoint = 0;
+      pending_dedent_token_column = 0;
+      pending_dedent_column = 0;
+    }
+
     /**
      * Jlists are identified with the column position (cpos) of the first
      * junct token in the list, and the junction type. For a given junct
@@ -1184,13 +1462,15 @@ namespace {
      * @param valid_symbols Tokens possibly expected in this spot.
      * @param type The type of junction encountered.
      * @param next The column position of the junct token encountered.
+     * @param next_codepoint The first codepoint of the junct token.
      * @return Whether a jlist-relevant token should be emitted.
      */
     bool handle_junct_token(
       TSLexer* const lexer,
       const bool* const valid_symbols,
       JunctType const next_type,
-      column_index const next_col
+      column_index const next_col,
+      int32_t const next_codepoint
     ) {
       const column_index current_col = get_current_jlist_column_index();
       if (current_col < next_col) {
@@ -1234,9 +1514,10 @@ namespace {
       } else {
         /**
          * Junct found prior to the alignment column of the current jlist.
-         * This marks the end of the jlist.
+         * This marks the end of the jlist, along with any enclosing jlists
+         * which also start after the junct.
          */
-        return emit_dedent(lexer);
+        return emit_dedents_from_column(lexer, next_codepoint, next_col, next_col + 1);
       }
     }
 
@@ -1332,17 +1613,23 @@ namespace {
      * 2. End-of-module token (====)
      * 3. End-of-file (this shouldn't happen but we will end the jlist to
      *    improve error reporting since the end-of-module token is missing)
+     * All open jlists are ended, so the remaining DEDENT tokens are left
+     * pending to avoid lexing the terminator again for each of them.
      *
      * @param lexer The tree-sitter lexing control structure.
      * @param valid_symbols Tokens possibly expected in this spot.
+     * @param next_col The column of the terminator token; -1 if unknown.
+     * @param next_codepoint The first codepoint of the terminator token.
      * @return Whether a jlist-relevant token should be emitted.
      */
     bool handle_terminator_token(
       TSLexer* const lexer,
-      const bool* const valid_symbols
+      const bool* const valid_symbols,
+      column_index const next_col,
+      int32_t const next_codepoint
     ) {
       return is_in_jlist()
-        && emit_dedent(lexer);
+        && emit_dedents_from_column(lexer, next_codepoint, next_col, 0);
     }
     
     /**
@@ -1362,16 +1649,18 @@ namespace {
      * 
      * @param lexer The tree-sitter lexing control structure.
      * @param next The column position of the encountered token.
+     * @param next_codepoint The first codepoint of the encountered token.
      * @return Whether a jlist-relevant token should be emitted.
      */
     bool handle_other_token(
       TSLexer* const lexer,
       const bool* const valid_symbols,
-      column_index const next
+      column_index const next,
+      int32_t const next_codepoint
     ) {
       return is_in_jlist()
         && next <= get_current_jlist_column_index()
-        && emit_dedent(lexer);
+        && emit_dedents_from_column(lexer, next_codepoint, next, next);
     }
     
     /**
@@ -1467,13 +1756,16 @@ namespace {
      * @param lexer The tree-sitter lexing control structure.
      * @param valid_symbols Tokens possibly expected in this spot.
      * @param next The column position of the encountered token.
+     * @param next_codepoint The first codepoint of the encountered token.
+     * @param proof_step_id_level The level of the proof step ID.
      * @return Whether a token should be emitted.
      */
     bool handle_proof_step_id_token(
       TSLexer* const lexer,
       const bool* const valid_symbols,
       column_index const next,
-      const std::vector<char>& proof_step_id_level
+      int32_t const next_codepoint,
+      const Array<char>& proof_step_id_level
     ) {
       ProofStepId proof_step_id_token(proof_step_id_level);
       if (valid_symbols[BEGIN_PROOF] || valid_symbols[BEGIN_PROOF_STEP]) {
@@ -1530,10 +1822,10 @@ namespace {
       } else {
         if (valid_symbols[DEDENT]) {
           // End all jlists before start of proof.
-          return handle_terminator_token(lexer, valid_symbols);
+          return handle_terminator_token(lexer, valid_symbols, next, next_codepoint);
         } else {
           // This is a reference to a proof step in an expression.
-          return handle_other_token(lexer, valid_symbols, next);
+          return handle_other_token(lexer, valid_symbols, next, next_codepoint);
         }
       }
     }
@@ -1545,11 +1837,15 @@ namespace {
      * 
      * @param lexer The tree-sitter lexing control structure.
      * @param valid_symbols Tokens possibly expected in this spot.
+     * @param next_col The column of the keyword; -1 if unknown.
+     * @param next_codepoint The first codepoint of the keyword.
      * @return Whether a token should be emitted.
      */
     bool handle_proof_keyword_token(
       TSLexer* const lexer,
-      const bool* const valid_symbols
+      const bool* const valid_symbols,
+      column_index const next_col,
+      int32_t const next_codepoint
     ) {
       if (valid_symbols[PROOF_KEYWORD]) {
         have_seen_proof_keyword = true;
@@ -1557,7 +1853,7 @@ namespace {
         lexer->mark_end(lexer);
         return true;
       } else {
-        return handle_terminator_token(lexer, valid_symbols);
+        return handle_terminator_token(lexer, valid_symbols, next_col, next_codepoint);
       }
     }
     
@@ -1570,12 +1866,16 @@ namespace {
      * @param lexer The tree-sitter lexing control structure.
      * @param valid_symbols Tokens possibly expected in this spot.
      * @param keyword_type The specific keyword being handled.
+     * @param next_col The column of the keyword; -1 if unknown.
+     * @param next_codepoint The first codepoint of the keyword.
      * @return Whether a token should be emitted.
      */
     bool handle_terminal_proof_keyword_token(
       TSLexer* const lexer,
       const bool* const valid_symbols,
-      TokenType keyword_type
+      TokenType keyword_type,
+      column_index const next_col,
+      int32_t const next_codepoint
     ) {
       if (valid_symbols[keyword_type]) {
         have_seen_proof_keyword = false;
@@ -1583,7 +1883,7 @@ namespace {
         lexer->mark_end(lexer);
         return true;
       } else {
-        return handle_terminator_token(lexer, valid_symbols);
+        return handle_terminator_token(lexer, valid_symbols, next_col, next_codepoint);
       }
     }
     
@@ -1609,6 +1909,30 @@ namespace {
       return true;
     }
     
+    /**
+     * Whether lexing the lookahead could lead to a token being emitted.
+     * Outside of jlists and proofs, a token is only emitted if tree-sitter
+     * expects a jlist or proof to start here; otherwise every lexeme is
+     * handled by returning false, so there is no need to lex it at all.
+     * Tree-sitter calls the scanner before nearly every token of an
+     * expression, so this skips most of the scanning done outside jlists.
+     * 
+     * @param valid_symbols Tokens possibly expected in this spot.
+     * @return Whether the lookahead needs to be lexed.
+     */
+    bool is_lookahead_needed(const bool* const valid_symbols) const {
+      return is_in_jlist()
+        || is_in_proof()
+        || valid_symbols[INDENT]
+        || valid_symbols[BEGIN_PROOF]
+        || valid_symbols[BEGIN_PROOF_STEP]
+        || valid_symbols[PROOF_KEYWORD]
+        || valid_symbols[BY_KEYWORD]
+        || valid_symbols[OBVIOUS_KEYWORD]
+        || valid_symbols[OMITTED_KEYWORD]
+        || valid_symbols[QED_KEYWORD];
+    }
+
     /**
      * Scans for various possible external tokens.
      * 
@@ -1622,6 +1946,14 @@ namespace {
       // (unused) external symbol, ERROR_SENTINEL.
       const bool is_error_recovery = valid_symbols[ERROR_SENTINEL];
 
+      // Pending DEDENT tokens apply only to the call straight after the
+      // one recording them; whatever else this call returns, they must
+      // not be serialized with it and resurface at a later token.
+      if (!is_error_recovery && can_emit_pending_dedent(lexer, valid_symbols)) {
+        return emit_pending_dedent(lexer);
+      }
+      clear_pending_dedents();
+
       // TODO: actually function during error recovery
       // https://github.com/tlaplus-community/tree-sitter-tlaplus/issues/19
       if (is_error_recovery) {
@@ -1632,34 +1964,37 @@ namespace {
         return scan_extramodular_text(lexer);
       } else if (valid_symbols[BLOCK_COMMENT_TEXT]) {
         return scan_block_comment_text(lexer);
+      } else if (!is_lookahead_needed(valid_symbols)) {
+        return false;
       } else {
         column_index col = -1;
-        std::vector<char> proof_step_id_level;
-        switch (tokenize_lexeme(lex_lookahead(lexer, col, proof_step_id_level))) {
+        int32_t codepoint = 0;
+        Array<char> proof_step_id_level;
+        switch (tokenize_lexeme(lex_lookahead(lexer, is_in_jlist(), col, codepoint, proof_step_id_level))) {
           case Token_LAND:
-            return handle_junct_token(lexer, valid_symbols, JunctType_CONJUNCTION, col);
+            return handle_junct_token(lexer, valid_symbols, JunctType_CONJUNCTION, col, codepoint);
           case Token_LOR:
-            return handle_junct_token(lexer, valid_symbols, JunctType_DISJUNCTION, col);
+            return handle_junct_token(lexer, valid_symbols, JunctType_DISJUNCTION, col, codepoint);
           case Token_RIGHT_DELIMITER:
             return handle_right_delimiter_token(lexer, valid_symbols);
           case Token_COMMENT_START:
             return false;
           case Token_TERMINATOR:
-            return handle_terminator_token(lexer, valid_symbols);
+            return handle_terminator_token(lexer, valid_symbols, col, codepoint);
           case Token_PROOF_STEP_ID:
-            return handle_proof_step_id_token(lexer, valid_symbols, col, proof_step_id_level);
+            return handle_proof_step_id_token(lexer, valid_symbols, col, codepoint, proof_step_id_level);
           case Token_PROOF_KEYWORD:
-            return handle_proof_keyword_token(lexer, valid_symbols);
+            return handle_proof_keyword_token(lexer, valid_symbols, col, codepoint);
           case Token_BY_KEYWORD:
-            return handle_terminal_proof_keyword_token(lexer, valid_symbols, BY_KEYWORD);
+            return handle_terminal_proof_keyword_token(lexer, valid_symbols, BY_KEYWORD, col, codepoint);
           case Token_OBVIOUS_KEYWORD:
-            return handle_terminal_proof_keyword_token(lexer, valid_symbols, OBVIOUS_KEYWORD);
+            return handle_terminal_proof_keyword_token(lexer, valid_symbols, OBVIOUS_KEYWORD, col, codepoint);
           case Token_OMITTED_KEYWORD:
-            return handle_terminal_proof_keyword_token(lexer, valid_symbols, OMITTED_KEYWORD);
+            return handle_terminal_proof_keyword_token(lexer, valid_symbols, OMITTED_KEYWORD, col, codepoint);
           case Token_QED_KEYWORD:
             return handle_qed_keyword_token(lexer, valid_symbols);
           case Token_OTHER:
-            return handle_other_token(lexer, valid_symbols, col);
+            return handle_other_token(lexer, valid_symbols, col, codepoint);
           default:
             return false;
         }
@@ -1673,14 +2008,24 @@ extern "C" {
   // Called once when language is set on a parser.
   // Allocates memory for storing scanner state.
   void* tree_sitter_tlaplus_external_scanner_create() {
-    return new Scanner();
+    // Allocated with malloc and placement new so that, built with
+    // -fno-exceptions as script/build-wasm does, the scanner needs no C++
+    // runtime support. With exceptions enabled, the cleanups the compiler
+    // emits still reference __gxx_personality_v0 and _Unwind_Resume.
+    void* const memory = malloc(sizeof(Scanner));
+    if (NULL == memory) {
+      abort();
+    }
+
+    return new (memory) Scanner();
   }
 
   // Called once parser is deleted or different language set.
   // Frees memory storing scanner state.
   void tree_sitter_tlaplus_external_scanner_destroy(void* const payload) {
     Scanner* const scanner = static_cast<Scanner*>(payload);
-    delete scanner;
+    scanner->~Scanner();
+    free(scanner);
   }
 
   // Called whenever this scanner recognizes a token.